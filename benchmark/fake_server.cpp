@@ -0,0 +1,457 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include "fake_server.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <sstream>
+
+namespace asio = boost::asio;
+using asio::ip::tcp;
+
+using namespace bench;
+
+namespace {
+
+static std::string url_decode(const std::string &encoded) {
+    std::string decoded;
+    for (std::size_t i = 0; i < encoded.size(); i++) {
+        if (encoded[i] == '%' && i + 2 < encoded.size()) {
+            decoded += static_cast<char>(std::stoi(encoded.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        } else if (encoded[i] == '+') {
+            decoded += ' ';
+        } else {
+            decoded += encoded[i];
+        }
+    }
+    return decoded;
+}
+
+static std::string lower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    return text;
+}
+
+static std::string trim(const std::string &text) {
+    std::size_t start = text.find_first_not_of(" \t\r\n");
+    std::size_t end = text.find_last_not_of(" \t\r\n");
+    return start == std::string::npos ? "" : text.substr(start, end + 1 - start);
+}
+
+/**
+ * Split a request target into its path and decoded query parameters.
+ */
+static void parse_target(const std::string &target, FakeServer::Request &request) {
+    std::size_t question = target.find('?');
+    request.path = url_decode(target.substr(0, question));
+    if (question == std::string::npos)
+        return;
+    std::istringstream params(target.substr(question + 1));
+    std::string param;
+    while (std::getline(params, param, '&')) {
+        std::size_t equals = param.find('=');
+        std::string key = url_decode(param.substr(0, equals));
+        std::string value = equals == std::string::npos ? "" : url_decode(param.substr(equals + 1));
+        request.query[key].push_back(value);
+    }
+}
+
+static std::string param(const FakeServer::Request &request, const std::string &key,
+                         const std::string &fallback = "") {
+    auto iter = request.query.find(key);
+    return (iter == request.query.end() || iter->second.empty()) ? fallback : iter->second.front();
+}
+
+static std::set<std::string> params(const FakeServer::Request &request, const std::string &key) {
+    auto iter = request.query.find(key);
+    if (iter == request.query.end())
+        return std::set<std::string>();
+    return std::set<std::string>(iter->second.begin(), iter->second.end());
+}
+
+static std::string to_json(const QJsonObject &object) {
+    return QJsonDocument(object).toJson(QJsonDocument::Compact).toStdString();
+}
+
+static FakeServer::Response json_response(const QJsonObject &object) {
+    if (object.isEmpty())
+        return { 404, "application/json; charset=UTF-8",
+                 R"({"error":{"code":404,"message":"Not Found"}})" };
+    return { 200, "application/json; charset=UTF-8", to_json(object) };
+}
+
+static const char *status_text(int status) {
+    switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    default: return "Unknown";
+    }
+}
+
+static std::set<std::string> string_set(const QJsonValue &value) {
+    std::set<std::string> strings;
+    for (const QJsonValue &item : value.toArray())
+        strings.insert(item.toString().toStdString());
+    return strings;
+}
+
+}
+
+
+NetworkProfile NetworkProfile::named(const std::string &name) {
+    NetworkProfile profile;
+    profile.name = name;
+    if (name == "wifi") {
+        profile.latency = std::chrono::milliseconds(30);
+        profile.connect_latency = std::chrono::milliseconds(90);
+        profile.bandwidth = 2500000;
+    } else if (name == "4g") {
+        profile.latency = std::chrono::milliseconds(60);
+        profile.connect_latency = std::chrono::milliseconds(180);
+        profile.bandwidth = 1000000;
+    } else if (name == "3g") {
+        profile.latency = std::chrono::milliseconds(150);
+        profile.connect_latency = std::chrono::milliseconds(450);
+        profile.bandwidth = 200000;
+    } else if (name == "edge") {
+        profile.latency = std::chrono::milliseconds(400);
+        profile.connect_latency = std::chrono::milliseconds(1200);
+        profile.bandwidth = 30000;
+    } else {
+        profile.name = "lan";
+    }
+    return profile;
+}
+
+
+FakeServer::FakeServer(Mailbox::Ptr mailbox, const NetworkProfile &profile,
+                       const std::string &apiroot) :
+    mailbox_(mailbox), apiroot_(apiroot), profile_(profile), shuffle_batches_(false),
+    acceptor_(io_service_), port_(0), running_(false), requests_(0), connections_(0) {
+}
+
+FakeServer::~FakeServer() {
+    stop();
+}
+
+unsigned short FakeServer::start(unsigned short port) {
+    tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    port_ = acceptor_.local_endpoint().port();
+    running_ = true;
+    acceptor_thread_ = std::thread(&FakeServer::accept_loop, this);
+    return port_;
+}
+
+void FakeServer::stop() {
+    if (!running_.exchange(false))
+        return;
+    boost::system::error_code ec;
+    acceptor_.close(ec);
+    if (acceptor_thread_.joinable())
+        acceptor_thread_.join();
+
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &weak : sockets_) {
+            if (auto socket = weak.lock()) {
+                socket->shutdown(tcp::socket::shutdown_both, ec);
+                socket->close(ec);
+            }
+        }
+        threads.swap(connection_threads_);
+        sockets_.clear();
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+std::string FakeServer::url() const {
+    return "http://127.0.0.1:" + std::to_string(port_);
+}
+
+std::size_t FakeServer::requests() const {
+    return requests_;
+}
+
+std::size_t FakeServer::connections() const {
+    return connections_;
+}
+
+void FakeServer::set_profile(const NetworkProfile &profile) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    profile_ = profile;
+}
+
+void FakeServer::set_shuffle_batches(bool shuffle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shuffle_batches_ = shuffle;
+}
+
+NetworkProfile FakeServer::profile() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return profile_;
+}
+
+void FakeServer::accept_loop() {
+    while (running_) {
+        auto socket = std::make_shared<tcp::socket>(io_service_);
+        boost::system::error_code ec;
+        acceptor_.accept(*socket, ec);
+        if (ec)
+            continue;
+        connections_ += 1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        sockets_.push_back(socket);
+        connection_threads_.emplace_back(&FakeServer::serve, this, socket);
+    }
+}
+
+void FakeServer::serve(std::shared_ptr<tcp::socket> socket) {
+    asio::streambuf buffer;
+    bool first = true;
+    while (running_) {
+        boost::system::error_code ec;
+        std::size_t length = asio::read_until(*socket, buffer, "\r\n\r\n", ec);
+        if (ec)
+            return;
+        std::string head(asio::buffers_begin(buffer.data()),
+                         asio::buffers_begin(buffer.data()) + length);
+        buffer.consume(length);
+
+        Request request;
+        std::istringstream lines(head);
+        std::string line, target;
+        std::getline(lines, line);
+        std::istringstream(line) >> request.method >> target;
+        parse_target(target, request);
+        while (std::getline(lines, line)) {
+            std::size_t colon = line.find(':');
+            if (colon != std::string::npos)
+                request.headers[lower(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1));
+        }
+
+        if (lower(request.headers["expect"]) == "100-continue")
+            asio::write(*socket, asio::buffer(std::string("HTTP/1.1 100 Continue\r\n\r\n")), ec);
+        std::size_t content_length = request.headers.count("content-length") ?
+                    std::stoul(request.headers["content-length"]) : 0;
+        if (buffer.size() < content_length)
+            asio::read(*socket, buffer, asio::transfer_exactly(content_length - buffer.size()), ec);
+        if (ec)
+            return;
+        request.body.assign(asio::buffers_begin(buffer.data()),
+                            asio::buffers_begin(buffer.data()) + content_length);
+        buffer.consume(content_length);
+        requests_ += 1;
+
+        NetworkProfile network = profile();
+        std::this_thread::sleep_for(network.latency + (first ? network.connect_latency :
+                                                               std::chrono::milliseconds(0)));
+        first = false;
+
+        Response response = handle(request);
+        std::ostringstream out;
+        out << "HTTP/1.1 " << response.status << " " << status_text(response.status) << "\r\n";
+        out << "Content-Type: " << response.content_type << "\r\n";
+        out << "Content-Length: " << response.body.size() << "\r\n";
+        out << "Connection: keep-alive\r\n\r\n";
+        asio::write(*socket, asio::buffer(out.str()), ec);
+        if (!ec)
+            write_throttled(*socket, response.body, network);
+        if (ec || lower(request.headers["connection"]) == "close")
+            return;
+    }
+}
+
+void FakeServer::write_throttled(tcp::socket &socket, const std::string &data,
+                                 const NetworkProfile &profile) {
+    boost::system::error_code ec;
+    if (profile.bandwidth == 0) {
+        asio::write(socket, asio::buffer(data), ec);
+        return;
+    }
+    // Dribble the body out in 50 ms slices
+    std::size_t slice = std::max<std::size_t>(profile.bandwidth / 20, 1);
+    for (std::size_t offset = 0; offset < data.size() && !ec; offset += slice) {
+        asio::write(socket, asio::buffer(data.data() + offset,
+                                         std::min(slice, data.size() - offset)), ec);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+FakeServer::Response FakeServer::handle(const Request &request) {
+    if (request.path == "/batch")
+        return handle_batch(request);
+
+    std::string path = request.path;
+    if (path.compare(0, apiroot_.size(), apiroot_) == 0)
+        path = path.substr(apiroot_.size());
+    std::vector<std::string> segments;
+    std::istringstream split(path);
+    std::string segment;
+    while (std::getline(split, segment, '/')) {
+        if (!segment.empty())
+            segments.push_back(segment);
+    }
+    if (segments.size() < 3 || segments[0] != "users" || segments[1] != "me")
+        return json_response(QJsonObject());
+
+    const std::string &resource = segments[2];
+    QJsonObject body = QJsonDocument::fromJson(QByteArray(request.body.data(),
+                                                          request.body.size())).object();
+    std::size_t max_results = std::stoul(param(request, "maxResults", "100"));
+    std::string format = param(request, "format", "full");
+    std::set<std::string> headers = params(request, "metadataHeaders");
+
+    if (resource == "profile" && segments.size() == 3)
+        return json_response(mailbox_->profile_json());
+
+    if (resource == "labels" && segments.size() == 3)
+        return json_response(mailbox_->labels_json());
+
+    if (resource == "history" && segments.size() == 3)
+        return json_response(mailbox_->history_json(param(request, "startHistoryId"),
+                                                    param(request, "pageToken"), max_results));
+
+    if (resource == "messages" && segments.size() == 3 && request.method == "GET") {
+        Mailbox::Page page = mailbox_->list_messages(param(request, "q"),
+                                                     param(request, "labelIds"),
+                                                     param(request, "pageToken"), max_results);
+        QJsonArray messages;
+        for (const std::string &id : page.first) {
+            QJsonObject message = mailbox_->message_json(id, "minimal", {});
+            QJsonObject item;
+            item["id"] = message["id"];
+            item["threadId"] = message["threadId"];
+            messages.append(item);
+        }
+        QJsonObject root;
+        if (!messages.isEmpty())
+            root["messages"] = messages;
+        if (!page.second.empty())
+            root["nextPageToken"] = QString::fromStdString(page.second);
+        root["resultSizeEstimate"] = messages.size();
+        return { 200, "application/json; charset=UTF-8", to_json(root) };
+    }
+
+    if (resource == "messages" && segments.size() == 4 && segments[3] == "send")
+        return json_response(mailbox_->send(body["raw"].toString().toStdString(),
+                                            body["threadId"].toString().toStdString()));
+
+    if (resource == "messages" && segments.size() == 4)
+        return json_response(mailbox_->message_json(segments[3], format, headers));
+
+    if (resource == "messages" && segments.size() == 5) {
+        const std::string &id = segments[3];
+        if (segments[4] == "modify")
+            return json_response(mailbox_->modify(id, string_set(body["addLabelIds"]),
+                                                  string_set(body["removeLabelIds"])));
+        if (segments[4] == "trash")
+            return json_response(mailbox_->modify(id, { "TRASH" }, { "INBOX" }));
+        if (segments[4] == "untrash")
+            return json_response(mailbox_->modify(id, {}, { "TRASH" }));
+    }
+
+    if (resource == "threads" && segments.size() == 3) {
+        Mailbox::Page page = mailbox_->list_threads(param(request, "q"),
+                                                    param(request, "labelIds"),
+                                                    param(request, "pageToken"), max_results);
+        QJsonArray threads;
+        for (const std::string &id : page.first)
+            threads.append(mailbox_->thread_summary_json(id));
+        QJsonObject root;
+        if (!threads.isEmpty())
+            root["threads"] = threads;
+        if (!page.second.empty())
+            root["nextPageToken"] = QString::fromStdString(page.second);
+        root["resultSizeEstimate"] = threads.size();
+        return { 200, "application/json; charset=UTF-8", to_json(root) };
+    }
+
+    if (resource == "threads" && segments.size() == 4)
+        return json_response(mailbox_->thread_json(segments[3], format, headers));
+
+    return json_response(QJsonObject());
+}
+
+FakeServer::Response FakeServer::handle_batch(const Request &request) {
+    std::string content_type = request.headers.count("content-type") ?
+                request.headers.at("content-type") : "";
+    std::size_t equals = content_type.find("boundary=");
+    if (equals == std::string::npos)
+        return { 400, "text/plain", "Missing boundary" };
+    std::string delimiter = "--" + trim(content_type.substr(equals + 9));
+
+    // Pull out the Content-ID and request line of each part
+    std::vector<std::pair<std::string, Request>> parts;
+    std::size_t pos = request.body.find(delimiter);
+    while (pos != std::string::npos) {
+        pos += delimiter.size();
+        if (request.body.compare(pos, 2, "--") == 0)
+            break;
+        std::size_t next = request.body.find(delimiter, pos);
+        std::istringstream lines(request.body.substr(pos, next - pos));
+        std::string line, content_id;
+        bool in_headers = true;
+        Request part;
+        while (std::getline(lines, line)) {
+            line = trim(line);
+            if (in_headers) {
+                if (line.empty() && !content_id.empty())
+                    in_headers = false;
+                else if (lower(line).compare(0, 11, "content-id:") == 0)
+                    content_id = trim(line.substr(11));
+            } else if (!line.empty() && part.method.empty()) {
+                std::string target;
+                std::istringstream(line) >> part.method >> target;
+                parse_target(target, part);
+            }
+        }
+        if (content_id.size() > 2 && content_id.front() == '<')
+            content_id = content_id.substr(1, content_id.size() - 2);
+        parts.emplace_back(content_id, part);
+        pos = next;
+    }
+
+    bool shuffle;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        shuffle = shuffle_batches_;
+    }
+    if (shuffle) {
+        std::mt19937 rng(parts.size());
+        std::shuffle(parts.begin(), parts.end(), rng);
+    }
+
+    std::string boundary = "batch_fake_server_boundary";
+    std::ostringstream out;
+    for (const auto &part : parts) {
+        Response response = handle(part.second);
+        out << "--" << boundary << "\r\n";
+        out << "Content-Type: application/http\r\n";
+        out << "Content-ID: <response-" << part.first << ">\r\n\r\n";
+        out << "HTTP/1.1 " << response.status << " " << status_text(response.status) << "\r\n";
+        out << "Content-Type: " << response.content_type << "\r\n";
+        out << "Content-Length: " << response.body.size() << "\r\n\r\n";
+        out << response.body << "\r\n";
+    }
+    out << "--" << boundary << "--\r\n";
+    return { 200, "multipart/mixed; boundary=" + boundary, out.str() };
+}
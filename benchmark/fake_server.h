@@ -0,0 +1,153 @@
+#ifndef BENCHMARK_FAKE_SERVER_H_
+#define BENCHMARK_FAKE_SERVER_H_
+
+#include "mailbox.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace bench {
+
+/**
+ * How the simulated network behaves.
+ */
+struct NetworkProfile {
+    NetworkProfile() :
+        name("lan"), latency(0), connect_latency(0), bandwidth(0) {
+    }
+
+    /**
+     * Look up one of the presets: lan, wifi, 4g, 3g, or edge
+     */
+    static NetworkProfile named(const std::string &name);
+
+    std::string name;
+
+    /**
+     * Added before each response, standing in for the round trip
+     */
+    std::chrono::milliseconds latency;
+
+    /**
+     * Added before the first response on each connection, standing in for the TCP
+     * and TLS handshakes
+     */
+    std::chrono::milliseconds connect_latency;
+
+    /**
+     * Bytes per second for response bodies; 0 is unlimited
+     */
+    std::size_t bandwidth;
+};
+
+/**
+ * A local HTTP/1.1 stand-in for the parts of the Gmail API that the scope uses.
+ *
+ * It serves users/me/messages, threads, labels, history, and profile, the modify,
+ * trash, untrash, and send calls, and multipart /batch requests, all out of a
+ * Mailbox.
+ * Point the scope at it with NETWORK_SCOPE_APIDOMAIN=url().
+ */
+class FakeServer {
+public:
+    FakeServer(Mailbox::Ptr mailbox, const NetworkProfile &profile,
+               const std::string &apiroot = "/gmail/v1");
+
+    ~FakeServer();
+
+    /**
+     * Start listening on the loopback interface.  With port 0, a free port is
+     * chosen.  Returns the port.
+     */
+    unsigned short start(unsigned short port = 0);
+
+    void stop();
+
+    std::string url() const;
+
+    /**
+     * Statistics, for the benchmarks
+     */
+    std::size_t requests() const;
+
+    std::size_t connections() const;
+
+    void set_profile(const NetworkProfile &profile);
+
+    /**
+     * Return batch parts in a shuffled order, as Google is allowed to
+     */
+    void set_shuffle_batches(bool shuffle);
+
+    struct Request {
+        std::string method;
+        std::string path;
+        std::map<std::string, std::vector<std::string>> query;
+        std::map<std::string, std::string> headers;
+        std::string body;
+    };
+
+    struct Response {
+        int status;
+        std::string content_type;
+        std::string body;
+    };
+
+    /**
+     * Handle a single request, without any of the simulated network; this is
+     * also how the parts of a batch are answered.
+     */
+    Response handle(const Request &request);
+
+private:
+    void accept_loop();
+
+    void serve(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
+
+    Response handle_batch(const Request &request);
+
+    void write_throttled(boost::asio::ip::tcp::socket &socket, const std::string &data,
+                         const NetworkProfile &profile);
+
+    NetworkProfile profile() const;
+
+    Mailbox::Ptr mailbox_;
+
+    std::string apiroot_;
+
+    mutable std::mutex mutex_;
+
+    NetworkProfile profile_;
+
+    bool shuffle_batches_;
+
+    boost::asio::io_service io_service_;
+
+    boost::asio::ip::tcp::acceptor acceptor_;
+
+    unsigned short port_;
+
+    std::atomic<bool> running_;
+
+    std::thread acceptor_thread_;
+
+    std::vector<std::thread> connection_threads_;
+
+    std::vector<std::weak_ptr<boost::asio::ip::tcp::socket>> sockets_;
+
+    std::atomic<std::size_t> requests_;
+
+    std::atomic<std::size_t> connections_;
+};
+
+}
+
+#endif // BENCHMARK_FAKE_SERVER_H_
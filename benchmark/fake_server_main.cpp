@@ -0,0 +1,100 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include "fake_server.h"
+#include "mailbox.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace bench;
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [options]\n"
+              << "  --port N              port to listen on (default: any free port)\n"
+              << "  --apiroot PATH        API root (default: /gmail/v1)\n"
+              << "  --profile NAME        lan, wifi, 4g, 3g, or edge (default: lan)\n"
+              << "  --latency MS          per-request latency\n"
+              << "  --connect-latency MS  extra latency on new connections\n"
+              << "  --bandwidth BYTES     bytes per second, 0 for unlimited\n"
+              << "  --messages N          size of the generated mailbox (default: 2000)\n"
+              << "  --seed N              seed for the generated mailbox (default: 1)\n"
+              << "  --mailbox FILE        replay a saved mailbox instead of generating one\n"
+              << "  --save FILE           save the mailbox, for later replay\n"
+              << "  --shuffle             return batch parts out of order\n";
+}
+
+int main(int argc, char **argv) {
+    unsigned short port = 0;
+    std::string apiroot = "/gmail/v1";
+    std::string load_path, save_path;
+    MailboxOptions options;
+    NetworkProfile profile;
+    bool shuffle = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (arg == "--shuffle") {
+            shuffle = true;
+        } else if (!has_value) {
+            usage(argv[0]);
+            return 1;
+        } else if (arg == "--port") {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--apiroot") {
+            apiroot = argv[++i];
+        } else if (arg == "--profile") {
+            profile = NetworkProfile::named(argv[++i]);
+        } else if (arg == "--latency") {
+            profile.latency = std::chrono::milliseconds(std::atoi(argv[++i]));
+        } else if (arg == "--connect-latency") {
+            profile.connect_latency = std::chrono::milliseconds(std::atoi(argv[++i]));
+        } else if (arg == "--bandwidth") {
+            profile.bandwidth = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--messages") {
+            options.messages = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--seed") {
+            options.seed = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--mailbox") {
+            load_path = argv[++i];
+        } else if (arg == "--save") {
+            save_path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Mailbox::Ptr mailbox = load_path.empty() ? Mailbox::generate(options) :
+                                               Mailbox::load(load_path);
+    if (!save_path.empty())
+        mailbox->save(save_path);
+
+    // Block the signals before starting any threads, so that only sigwait sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    FakeServer server(mailbox, profile, apiroot);
+    server.set_shuffle_batches(shuffle);
+    server.start(port);
+    std::cout << "Serving " << mailbox->size() << " messages on " << server.url()
+              << " (" << profile.name << ")" << std::endl;
+    std::cout << "Run the scope with NETWORK_SCOPE_APIDOMAIN=" << server.url() << std::endl;
+
+    int signal;
+    sigwait(&signals, &signal);
+    server.stop();
+    std::cout << server.requests() << " requests over " << server.connections()
+              << " connections" << std::endl;
+    return 0;
+}
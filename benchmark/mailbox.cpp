@@ -0,0 +1,797 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include "mailbox.h"
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QString>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+using namespace bench;
+
+namespace {
+
+const char *FIRST_NAMES[] = {
+    "Alice", "Bob", "Carol", "Dave", "Erin", "Frank", "Grace", "Heidi", "Ivan", "Judy",
+    "José", "Zoë", "Søren", "Françoise", "Jürgen", "Łukasz", "Ольга", "Дмитрий",
+    "太郎", "美咲", "민준", "Αλέξανδρος", "محمد", "Nguyễn"
+};
+
+const char *LAST_NAMES[] = {
+    "Smith", "Jones", "Taylor", "Brown", "Müller", "García", "O'Brien", "van der Berg",
+    "Иванова", "田中", "김", "Παπαδόπουλος", "Ñúñez", "Østergård"
+};
+
+const char *DOMAINS[] = {
+    "example.com", "example.org", "mail.example.net", "lists.example.edu", "example.co.uk"
+};
+
+const char *SUBJECT_WORDS[] = {
+    "meeting", "notes", "quarterly", "report", "lunch", "tomorrow", "draft", "review",
+    "invoice", "receipt", "plans", "weekend", "update", "question", "photos", "trip",
+    "Überprüfung", "réunion", "встреча", "会議", "회의", "schedule", "budget", "ideas"
+};
+
+const char *BODY_WORDS[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be",
+    "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but",
+    "have", "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her",
+    "has", "there", "been", "if", "more", "when", "will", "would", "who", "so", "no",
+    "café", "naïve", "Straße", "добрый", "日本語", "ελληνικά", "ok?", "thanks!", "<tag>",
+    "a&b", "\"quoted\"", "it's"
+};
+
+const char *USER_LABELS[] = {
+    "Work", "Family", "Receipts", "Travel", "Newsletters", "Projects/Alpha",
+    "Projects/Beta", "Família", "Книги", "領収書", "Archive/2013", "Archive/2014"
+};
+
+const char *DAY_NAMES[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+
+const char *MONTH_NAMES[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+const int TZ_OFFSETS[] = { -700, -400, 0, 100, 200, 530, 900, 1000 };
+
+template<typename T, std::size_t N>
+static const T &pick(std::mt19937 &rng, const T (&items)[N]) {
+    return items[std::uniform_int_distribution<std::size_t>(0, N - 1)(rng)];
+}
+
+static bool chance(std::mt19937 &rng, double probability) {
+    return std::uniform_real_distribution<double>(0, 1)(rng) < probability;
+}
+
+static std::string rfc2822_date(std::int64_t msecs, int offset) {
+    int offset_secs = (offset / 100) * 3600 + (offset % 100) * 60;
+    QDateTime date = QDateTime::fromMSecsSinceEpoch(msecs, Qt::OffsetFromUTC, offset_secs);
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s, %d %s %d %02d:%02d:%02d %c%04d",
+             DAY_NAMES[date.date().dayOfWeek() - 1], date.date().day(),
+             MONTH_NAMES[date.date().month() - 1], date.date().year(),
+             date.time().hour(), date.time().minute(), date.time().second(),
+             offset < 0 ? '-' : '+', offset < 0 ? -offset : offset);
+    return buffer;
+}
+
+struct Person {
+    std::string name;
+    std::string address;
+
+    std::string header() const {
+        // Names with commas or quotes must be quoted, as real mailers do
+        if (name.find_first_of(",\"") != std::string::npos) {
+            std::string escaped;
+            for (char c : name) {
+                if (c == '"' || c == '\\')
+                    escaped += '\\';
+                escaped += c;
+            }
+            return "\"" + escaped + "\" <" + address + ">";
+        }
+        return name + " <" + address + ">";
+    }
+};
+
+static Person make_person(std::mt19937 &rng) {
+    Person person;
+    std::string first = pick(rng, FIRST_NAMES);
+    std::string last = pick(rng, LAST_NAMES);
+    if (chance(rng, 0.15))
+        person.name = last + ", " + first;
+    else if (chance(rng, 0.05))
+        person.name = first + " \"" + last + "\"";
+    else
+        person.name = first + " " + last;
+    std::ostringstream address;
+    address << "user" << std::uniform_int_distribution<int>(1, 500)(rng) << "@" << pick(rng, DOMAINS);
+    person.address = address.str();
+    if (chance(rng, 0.1))
+        person.name = "";
+    return person;
+}
+
+static std::string person_list(const std::deque<Person> &people) {
+    std::string list;
+    for (const Person &person : people) {
+        if (!list.empty())
+            list += ", ";
+        list += person.name.empty() ? person.address : person.header();
+    }
+    return list;
+}
+
+static std::string make_paragraph(std::mt19937 &rng, std::size_t words) {
+    std::string text;
+    std::size_t line = 0;
+    for (std::size_t i = 0; i < words; i++) {
+        std::string word = pick(rng, BODY_WORDS);
+        if (line + word.size() > 72) {
+            // Soft breaks, as in format=flowed
+            text += chance(rng, 0.5) ? " \r\n" : "\r\n";
+            line = 0;
+        } else if (i > 0) {
+            text += " ";
+            line += 1;
+        }
+        text += word;
+        line += word.size();
+    }
+    return text + "\r\n";
+}
+
+static std::string quote(const std::string &body) {
+    std::string quoted;
+    std::size_t start = 0;
+    while (start < body.size()) {
+        std::size_t end = body.find('\n', start);
+        if (end == std::string::npos)
+            end = body.size() - 1;
+        quoted += (body[start] == '>') ? ">" : "> ";
+        quoted += body.substr(start, end + 1 - start);
+        start = end + 1;
+    }
+    return quoted;
+}
+
+static std::string html_escape(const std::string &text) {
+    std::string escaped;
+    for (char c : text) {
+        switch (c) {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        case '\'': escaped += "&#39;"; break;
+        default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * Gmail's snippets are the start of the new text, with whitespace collapsed and HTML
+ * entities escaped.
+ */
+static std::string make_snippet(const std::string &body) {
+    QString text;
+    std::istringstream lines(body);
+    std::string line;
+    while (std::getline(lines, line) && text.size() < 120) {
+        if (!line.empty() && line[0] == '>')
+            continue;
+        text += QString::fromStdString(line).simplified() + " ";
+    }
+    return html_escape(text.left(100).trimmed().toStdString());
+}
+
+static std::string lower(const std::string &text) {
+    return QString::fromStdString(text).toLower().toStdString();
+}
+
+static bool contains(const std::string &haystack, const std::string &needle) {
+    return lower(haystack).find(lower(needle)) != std::string::npos;
+}
+
+static QJsonArray string_array(const std::set<std::string> &strings) {
+    QJsonArray array;
+    for (const std::string &s : strings)
+        array.append(QString::fromStdString(s));
+    return array;
+}
+
+static QString base64url(const std::string &data) {
+    return QByteArray(data.data(), data.size()).toBase64(QByteArray::Base64UrlEncoding);
+}
+
+static std::string header_value(const Mailbox::Headers &headers, const std::string &name) {
+    for (const auto &header : headers) {
+        if (header.first == name)
+            return header.second;
+    }
+    return "";
+}
+
+}
+
+
+Mailbox::Mailbox() :
+    history_id_(1000), history_start_(1000), next_id_(0x149a0c2d3e000000ULL) {
+}
+
+Mailbox::Ptr Mailbox::generate(const MailboxOptions &options) {
+    Ptr mailbox = std::make_shared<Mailbox>();
+    std::mt19937 rng(options.seed);
+    mailbox->address_ = "me@example.com";
+
+    for (const char *id : { "INBOX", "UNREAD", "STARRED", "IMPORTANT", "SENT", "DRAFT",
+                            "TRASH", "SPAM" })
+        mailbox->labels_.push_back({ id, id, false });
+    std::size_t user_labels = std::min(options.labels, sizeof(USER_LABELS) / sizeof(*USER_LABELS));
+    for (std::size_t i = 0; i < user_labels; i++)
+        mailbox->labels_.push_back({ "Label_" + std::to_string(i + 1), USER_LABELS[i], true });
+
+    // Messages arrive every few minutes through 2014
+    std::int64_t date = 1388534400000LL;
+    Person me { "Me Myself", mailbox->address_ };
+    while (mailbox->messages_.size() < options.messages) {
+        std::size_t length = std::uniform_int_distribution<std::size_t>(
+                    1, std::max<std::size_t>(options.max_thread_length, 1))(rng);
+        std::string subject;
+        for (int i = std::uniform_int_distribution<int>(2, 6)(rng); i > 0; i--)
+            subject += std::string(subject.empty() ? "" : " ") + pick(rng, SUBJECT_WORDS);
+        std::deque<Person> people;
+        for (int i = std::uniform_int_distribution<int>(2, 4)(rng); i > 0; i--)
+            people.push_back(make_person(rng));
+        std::string thread_id;
+        std::string previous_body;
+        std::string previous_id;
+        std::set<std::string> thread_labels;
+        if (user_labels > 0 && chance(rng, 0.3))
+            thread_labels.insert(mailbox->labels_[mailbox->labels_.size() - 1 - rng() % user_labels].id);
+
+        for (std::size_t n = 0; n < length && mailbox->messages_.size() < options.messages; n++) {
+            Message message;
+            char id[17];
+            snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(mailbox->next_id_));
+            mailbox->next_id_ += std::uniform_int_distribution<int>(1, 0xfff)(rng);
+            message.id = id;
+            message.threadId = thread_id.empty() ? message.id : thread_id;
+            thread_id = message.threadId;
+            date += std::uniform_int_distribution<std::int64_t>(10000, 1800000)(rng);
+            message.internalDate = date;
+            message.historyId = ++mailbox->history_id_;
+
+            bool from_me = chance(rng, 0.2);
+            const Person &from = from_me ? me : people[rng() % people.size()];
+            std::deque<Person> to;
+            std::size_t recipients = std::uniform_int_distribution<std::size_t>(
+                        1, std::max<std::size_t>(options.max_recipients, 1))(rng);
+            for (std::size_t i = 0; i < recipients; i++)
+                to.push_back(i == 0 && !from_me ? me : make_person(rng));
+
+            message.headers.emplace_back("Date", rfc2822_date(date, pick(rng, TZ_OFFSETS)));
+            message.headers.emplace_back("From", from.name.empty() ? from.address : from.header());
+            message.headers.emplace_back("To", person_list(to));
+            if (chance(rng, 0.3)) {
+                std::deque<Person> cc;
+                for (int i = std::uniform_int_distribution<int>(1, 6)(rng); i > 0; i--)
+                    cc.push_back(make_person(rng));
+                message.headers.emplace_back("Cc", person_list(cc));
+            }
+            if (chance(rng, 0.1))
+                message.headers.emplace_back("Reply-To", make_person(rng).header());
+            message.headers.emplace_back("Subject", n == 0 ? subject : "Re: " + subject);
+            message.headers.emplace_back("Message-ID", "<" + message.id + "@mail.example.com>");
+            if (!previous_id.empty())
+                message.headers.emplace_back("In-Reply-To", "<" + previous_id + "@mail.example.com>");
+
+            std::string body;
+            for (int i = std::uniform_int_distribution<int>(1, 5)(rng); i > 0; i--)
+                body += make_paragraph(rng, std::uniform_int_distribution<std::size_t>(5, 120)(rng)) + "\r\n";
+            // Reply with the whole thread quoted below, up to the maximum depth
+            if (!previous_body.empty() && n <= options.max_quote_depth)
+                body += "\r\nOn an earlier date, someone wrote:\r\n" + quote(previous_body);
+            if (chance(rng, 0.3))
+                body += "\r\n-- \r\nSent from my phone\r\n";
+            message.body = body;
+            if (chance(rng, 0.5))
+                message.html = "<div>" + html_escape(body) + "</div>";
+            message.snippet = make_snippet(body);
+
+            message.labels = thread_labels;
+            if (from_me) {
+                message.labels.insert("SENT");
+            } else {
+                if (chance(rng, 0.7))
+                    message.labels.insert("INBOX");
+                if (chance(rng, 0.3))
+                    message.labels.insert("UNREAD");
+                if (chance(rng, 0.2))
+                    message.labels.insert("IMPORTANT");
+            }
+            if (chance(rng, 0.05))
+                message.labels.insert("STARRED");
+            if (chance(rng, 0.02))
+                message.labels = { "DRAFT" };
+            else if (chance(rng, 0.02))
+                message.labels = { "TRASH" };
+
+            previous_body = body;
+            previous_id = message.id;
+            mailbox->messages_[message.id] = message;
+        }
+    }
+    mailbox->history_start_ = mailbox->history_id_;
+    return mailbox;
+}
+
+Mailbox::Ptr Mailbox::load(const std::string &path) {
+    QFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::ReadOnly))
+        throw std::runtime_error("Could not open " + path);
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+
+    Ptr mailbox = std::make_shared<Mailbox>();
+    mailbox->address_ = root["address"].toString().toStdString();
+    mailbox->history_id_ = root["historyId"].toString().toULongLong();
+    for (const QJsonValue &value : root["labels"].toArray()) {
+        QJsonObject label = value.toObject();
+        mailbox->labels_.push_back({ label["id"].toString().toStdString(),
+                                     label["name"].toString().toStdString(),
+                                     label["visible"].toBool() });
+    }
+    for (const QJsonValue &value : root["messages"].toArray()) {
+        QJsonObject item = value.toObject();
+        Message message;
+        message.id = item["id"].toString().toStdString();
+        message.threadId = item["threadId"].toString().toStdString();
+        for (const QJsonValue &label : item["labelIds"].toArray())
+            message.labels.insert(label.toString().toStdString());
+        message.internalDate = item["internalDate"].toString().toLongLong();
+        message.historyId = item["historyId"].toString().toULongLong();
+        for (const QJsonValue &header : item["headers"].toArray())
+            message.headers.emplace_back(header.toArray()[0].toString().toStdString(),
+                                         header.toArray()[1].toString().toStdString());
+        message.snippet = item["snippet"].toString().toStdString();
+        message.body = item["body"].toString().toStdString();
+        message.html = item["html"].toString().toStdString();
+        mailbox->next_id_ = std::max(mailbox->next_id_, std::stoull(message.id, nullptr, 16) + 1);
+        mailbox->messages_[message.id] = message;
+    }
+    mailbox->history_start_ = mailbox->history_id_;
+    return mailbox;
+}
+
+void Mailbox::save(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QJsonObject root;
+    root["address"] = QString::fromStdString(address_);
+    root["historyId"] = QString::number(history_id_);
+    QJsonArray labels;
+    for (const Label &label : labels_) {
+        QJsonObject item;
+        item["id"] = QString::fromStdString(label.id);
+        item["name"] = QString::fromStdString(label.name);
+        item["visible"] = label.visible;
+        labels.append(item);
+    }
+    root["labels"] = labels;
+    QJsonArray messages;
+    for (const auto &pair : messages_) {
+        const Message &message = pair.second;
+        QJsonObject item;
+        item["id"] = QString::fromStdString(message.id);
+        item["threadId"] = QString::fromStdString(message.threadId);
+        item["labelIds"] = string_array(message.labels);
+        item["internalDate"] = QString::number(message.internalDate);
+        item["historyId"] = QString::number(message.historyId);
+        QJsonArray headers;
+        for (const auto &header : message.headers) {
+            QJsonArray pair;
+            pair.append(QString::fromStdString(header.first));
+            pair.append(QString::fromStdString(header.second));
+            headers.append(pair);
+        }
+        item["headers"] = headers;
+        item["snippet"] = QString::fromStdString(message.snippet);
+        item["body"] = QString::fromStdString(message.body);
+        item["html"] = QString::fromStdString(message.html);
+        messages.append(item);
+    }
+    root["messages"] = messages;
+
+    QFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::WriteOnly))
+        throw std::runtime_error("Could not write " + path);
+    file.write(QJsonDocument(root).toJson());
+}
+
+std::string Mailbox::address() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return address_;
+}
+
+std::size_t Mailbox::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return messages_.size();
+}
+
+std::deque<const Mailbox::Message*> Mailbox::sorted() const {
+    std::deque<const Message*> sorted;
+    for (const auto &pair : messages_)
+        sorted.push_back(&pair.second);
+    std::sort(sorted.begin(), sorted.end(), [](const Message *a, const Message *b) {
+        return a->internalDate > b->internalDate;
+    });
+    return sorted;
+}
+
+bool Mailbox::matches(const Message &message, const std::string &query,
+                      const std::string &label_id) const {
+    // Like Gmail, hide the trash and spam unless they were asked for
+    for (const char *hidden : { "TRASH", "SPAM" }) {
+        if (message.labels.count(hidden) && label_id != hidden &&
+                query.find(std::string("in:") + hidden) == std::string::npos)
+            return false;
+    }
+    if (!label_id.empty() && !message.labels.count(label_id))
+        return false;
+
+    std::istringstream terms(query);
+    std::string term;
+    while (terms >> term) {
+        size_t colon = term.find(':');
+        std::string op = colon == std::string::npos ? "" : lower(term.substr(0, colon));
+        std::string arg = colon == std::string::npos ? term : term.substr(colon + 1);
+        if (op == "from") {
+            if (!contains(header_value(message.headers, "From"), arg))
+                return false;
+        } else if (op == "to") {
+            if (!contains(header_value(message.headers, "To"), arg) &&
+                    !contains(header_value(message.headers, "Cc"), arg))
+                return false;
+        } else if (op == "in" || op == "label") {
+            bool found = false;
+            for (const Label &label : labels_) {
+                if ((contains(label.id, arg) || contains(label.name, arg)) && message.labels.count(label.id))
+                    found = true;
+            }
+            if (!found)
+                return false;
+        } else if (op == "is") {
+            if (lower(arg) == "unread" && !message.labels.count("UNREAD"))
+                return false;
+            if (lower(arg) == "starred" && !message.labels.count("STARRED"))
+                return false;
+        } else if (!contains(header_value(message.headers, "Subject"), arg) &&
+                   !contains(header_value(message.headers, "From"), arg) &&
+                   !contains(message.body, arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Mailbox::Page Mailbox::list_messages(const std::string &query, const std::string &label_id,
+                                     const std::string &token, std::size_t max_results) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t offset = token.empty() ? 0 : std::stoul(token);
+    Page page;
+    std::size_t index = 0;
+    for (const Message *message : sorted()) {
+        if (!matches(*message, query, label_id))
+            continue;
+        if (index >= offset + max_results) {
+            page.second = std::to_string(index);
+            break;
+        }
+        if (index >= offset)
+            page.first.push_back(message->id);
+        index += 1;
+    }
+    return page;
+}
+
+Mailbox::Page Mailbox::list_threads(const std::string &query, const std::string &label_id,
+                                    const std::string &token, std::size_t max_results) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t offset = token.empty() ? 0 : std::stoul(token);
+    Page page;
+    std::set<std::string> seen;
+    std::size_t index = 0;
+    for (const Message *message : sorted()) {
+        if (seen.count(message->threadId) || !matches(*message, query, label_id))
+            continue;
+        seen.insert(message->threadId);
+        if (index >= offset + max_results) {
+            page.second = std::to_string(index);
+            break;
+        }
+        if (index >= offset)
+            page.first.push_back(message->threadId);
+        index += 1;
+    }
+    return page;
+}
+
+QJsonObject Mailbox::message_json_locked(const Message &message, const std::string &format,
+                                         const std::set<std::string> &headers) const {
+    QJsonObject item;
+    item["id"] = QString::fromStdString(message.id);
+    item["threadId"] = QString::fromStdString(message.threadId);
+    item["labelIds"] = string_array(message.labels);
+    item["snippet"] = QString::fromStdString(message.snippet);
+    item["historyId"] = QString::number(message.historyId);
+    item["internalDate"] = QString::number(message.internalDate);
+    item["sizeEstimate"] = static_cast<int>(message.body.size() + message.html.size() + 1024);
+    if (format == "minimal")
+        return item;
+
+    QJsonObject payload;
+    payload["partId"] = QString("");
+    payload["mimeType"] = QString(message.html.empty() ? "text/plain" : "multipart/alternative");
+    payload["filename"] = QString("");
+    QJsonArray header_list;
+    for (const auto &header : message.headers) {
+        if (format == "metadata" && !headers.empty() && !headers.count(header.first))
+            continue;
+        QJsonObject h;
+        h["name"] = QString::fromStdString(header.first);
+        h["value"] = QString::fromStdString(header.second);
+        header_list.append(h);
+    }
+    payload["headers"] = header_list;
+
+    if (format == "full") {
+        QJsonObject text_body;
+        text_body["size"] = static_cast<int>(message.body.size());
+        text_body["data"] = base64url(message.body);
+        if (message.html.empty()) {
+            payload["body"] = text_body;
+        } else {
+            QJsonObject empty;
+            empty["size"] = 0;
+            payload["body"] = empty;
+
+            QJsonObject html_body;
+            html_body["size"] = static_cast<int>(message.html.size());
+            html_body["data"] = base64url(message.html);
+            QJsonArray parts;
+            const char *types[] = { "text/plain", "text/html" };
+            QJsonObject bodies[] = { text_body, html_body };
+            for (int i = 0; i < 2; i++) {
+                QJsonObject part;
+                part["partId"] = QString::number(i);
+                part["mimeType"] = QString(types[i]);
+                part["filename"] = QString("");
+                QJsonObject content_type;
+                content_type["name"] = QString("Content-Type");
+                content_type["value"] = QString(types[i]) + "; charset=UTF-8";
+                QJsonArray part_headers;
+                part_headers.append(content_type);
+                part["headers"] = part_headers;
+                part["body"] = bodies[i];
+                parts.append(part);
+            }
+            payload["parts"] = parts;
+        }
+    } else {
+        QJsonObject empty;
+        empty["size"] = 0;
+        payload["body"] = empty;
+    }
+    item["payload"] = payload;
+    return item;
+}
+
+QJsonObject Mailbox::message_json(const std::string &id, const std::string &format,
+                                  const std::set<std::string> &headers) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = messages_.find(id);
+    if (iter == messages_.end())
+        return QJsonObject();
+    return message_json_locked(iter->second, format, headers);
+}
+
+QJsonObject Mailbox::thread_json(const std::string &id, const std::string &format,
+                                 const std::set<std::string> &headers) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::deque<const Message*> thread;
+    for (const Message *message : sorted()) {
+        if (message->threadId == id)
+            thread.push_front(message);
+    }
+    if (thread.empty())
+        return QJsonObject();
+
+    QJsonObject item;
+    item["id"] = QString::fromStdString(id);
+    std::uint64_t history = 0;
+    QJsonArray messages;
+    for (const Message *message : thread) {
+        history = std::max(history, message->historyId);
+        messages.append(message_json_locked(*message, format, headers));
+    }
+    item["historyId"] = QString::number(history);
+    item["messages"] = messages;
+    return item;
+}
+
+QJsonObject Mailbox::thread_summary_json(const std::string &id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Message *latest = nullptr;
+    std::uint64_t history = 0;
+    for (const auto &pair : messages_) {
+        const Message &message = pair.second;
+        if (message.threadId != id)
+            continue;
+        history = std::max(history, message.historyId);
+        if (latest == nullptr || message.internalDate > latest->internalDate)
+            latest = &message;
+    }
+    QJsonObject item;
+    item["id"] = QString::fromStdString(id);
+    item["snippet"] = QString::fromStdString(latest ? latest->snippet : "");
+    item["historyId"] = QString::number(history);
+    return item;
+}
+
+QJsonObject Mailbox::labels_json() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QJsonArray labels;
+    for (const Label &label : labels_) {
+        QJsonObject item;
+        item["id"] = QString::fromStdString(label.id);
+        item["name"] = QString::fromStdString(label.name);
+        item["type"] = QString(label.visible ? "user" : "system");
+        if (label.visible) {
+            item["messageListVisibility"] = QString("show");
+            item["labelListVisibility"] = QString("labelShow");
+        }
+        labels.append(item);
+    }
+    QJsonObject root;
+    root["labels"] = labels;
+    return root;
+}
+
+QJsonObject Mailbox::profile_json() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::set<std::string> threads;
+    for (const auto &pair : messages_)
+        threads.insert(pair.second.threadId);
+    QJsonObject root;
+    root["emailAddress"] = QString::fromStdString(address_);
+    root["messagesTotal"] = static_cast<int>(messages_.size());
+    root["threadsTotal"] = static_cast<int>(threads.size());
+    root["historyId"] = QString::number(history_id_);
+    return root;
+}
+
+QJsonObject Mailbox::history_json(const std::string &start, const std::string &token,
+                                  std::size_t max_results) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::uint64_t start_id = std::strtoull(start.c_str(), nullptr, 10);
+    if (start_id < history_start_ || start_id > history_id_)
+        return QJsonObject();
+
+    std::size_t offset = token.empty() ? 0 : std::stoul(token);
+    std::size_t skipped = 0;
+    QJsonArray history;
+    bool more = false;
+    for (const Change &change : history_) {
+        if (change.historyId <= start_id)
+            continue;
+        if (skipped++ < offset)
+            continue;
+        if (static_cast<std::size_t>(history.size()) == max_results) {
+            more = true;
+            break;
+        }
+
+        QJsonObject message;
+        message["id"] = QString::fromStdString(change.id);
+        message["threadId"] = QString::fromStdString(change.threadId);
+        QJsonArray messages;
+        messages.append(message);
+        message["labelIds"] = string_array(change.labels);
+
+        QJsonObject item;
+        item["id"] = QString::number(change.historyId);
+        item["messages"] = messages;
+        if (change.added) {
+            QJsonObject added;
+            added["message"] = message;
+            QJsonArray list;
+            list.append(added);
+            item["messagesAdded"] = list;
+        }
+        const char *keys[] = { "labelsAdded", "labelsRemoved" };
+        const std::set<std::string> *labels[] = { &change.labels_added, &change.labels_removed };
+        for (int i = 0; i < 2; i++) {
+            if (labels[i]->empty())
+                continue;
+            QJsonObject changed;
+            changed["message"] = message;
+            changed["labelIds"] = string_array(*labels[i]);
+            QJsonArray list;
+            list.append(changed);
+            item[keys[i]] = list;
+        }
+        history.append(item);
+    }
+
+    QJsonObject root;
+    if (!history.isEmpty())
+        root["history"] = history;
+    if (more)
+        root["nextPageToken"] = QString::number(offset + history.size());
+    root["historyId"] = QString::number(history_id_);
+    return root;
+}
+
+QJsonObject Mailbox::modify(const std::string &id, const std::set<std::string> &add,
+                            const std::set<std::string> &remove) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = messages_.find(id);
+    if (iter == messages_.end())
+        return QJsonObject();
+    Message &message = iter->second;
+    Change change { ++history_id_, message.id, message.threadId, {}, false, {}, {} };
+    for (const std::string &label : remove) {
+        if (message.labels.erase(label))
+            change.labels_removed.insert(label);
+    }
+    for (const std::string &label : add) {
+        if (message.labels.insert(label).second)
+            change.labels_added.insert(label);
+    }
+    message.historyId = change.historyId;
+    change.labels = message.labels;
+    history_.push_back(change);
+    return message_json_locked(message, "minimal", {});
+}
+
+QJsonObject Mailbox::send(const std::string &raw, const std::string &thread_id) {
+    QByteArray rfc822 = QByteArray::fromBase64(QByteArray(raw.data(), raw.size()),
+                                               QByteArray::Base64UrlEncoding);
+    Message message;
+    int split = rfc822.indexOf("\r\n\r\n");
+    for (const QByteArray &line : rfc822.left(split).split('\n')) {
+        int colon = line.indexOf(':');
+        if (colon > 0)
+            message.headers.emplace_back(line.left(colon).trimmed().toStdString(),
+                                         line.mid(colon + 1).trimmed().toStdString());
+    }
+    message.body = rfc822.mid(split + 4).toStdString();
+    message.snippet = make_snippet(message.body);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    char id[17];
+    snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(next_id_++));
+    message.id = id;
+    message.threadId = thread_id.empty() ? message.id : thread_id;
+    message.labels = { "SENT" };
+    message.internalDate = QDateTime::currentMSecsSinceEpoch();
+    message.historyId = ++history_id_;
+    if (header_value(message.headers, "From").empty())
+        message.headers.emplace_front("From", address_);
+    messages_[message.id] = message;
+    history_.push_back({ message.historyId, message.id, message.threadId, message.labels, true, {}, {} });
+    return message_json_locked(message, "minimal", {});
+}
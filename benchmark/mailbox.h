@@ -0,0 +1,173 @@
+#ifndef BENCHMARK_MAILBOX_H_
+#define BENCHMARK_MAILBOX_H_
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <QJsonObject>
+
+namespace bench {
+
+/**
+ * Parameters for a synthetic mailbox.  The same seed always gives the same mailbox.
+ */
+struct MailboxOptions {
+    MailboxOptions() :
+        messages(2000), labels(8), max_thread_length(8), max_quote_depth(4),
+        max_recipients(12), seed(1) {
+    }
+
+    std::size_t messages;
+    std::size_t labels;
+    std::size_t max_thread_length;
+    std::size_t max_quote_depth;
+    std::size_t max_recipients;
+    unsigned seed;
+};
+
+/**
+ * An in-memory stand-in for a Gmail account, which renders itself in the same JSON
+ * shapes as the Gmail API.  All methods are thread-safe.
+ */
+class Mailbox {
+public:
+    typedef std::shared_ptr<Mailbox> Ptr;
+
+    typedef std::deque<std::pair<std::string, std::string>> Headers;
+
+    struct Message {
+        std::string id;
+        std::string threadId;
+        std::set<std::string> labels;
+        std::int64_t internalDate;
+        std::uint64_t historyId;
+        Headers headers;
+        std::string snippet;
+        std::string body;
+        std::string html;
+    };
+
+    struct Label {
+        std::string id;
+        std::string name;
+        bool visible;
+    };
+
+    /**
+     * A page of ids, in the order the API returns them
+     */
+    typedef std::pair<std::deque<std::string>, std::string> Page;
+
+    Mailbox();
+
+    static Ptr generate(const MailboxOptions &options);
+
+    /**
+     * Load a mailbox previously written by save(), so that recorded or hand-edited
+     * data can be replayed.
+     */
+    static Ptr load(const std::string &path);
+
+    void save(const std::string &path) const;
+
+    std::string address() const;
+
+    std::size_t size() const;
+
+    /**
+     * List messages or threads matching a Gmail-style query and label.  The page
+     * token is simply the offset of the page.
+     */
+    Page list_messages(const std::string &query, const std::string &label_id,
+                       const std::string &token, std::size_t max_results) const;
+
+    Page list_threads(const std::string &query, const std::string &label_id,
+                      const std::string &token, std::size_t max_results) const;
+
+    /**
+     * JSON renderings of the API resources.  Format is "full", "metadata", or
+     * "minimal"; the metadata format only includes the named headers, if any
+     * are given.  These return an empty object if there is no such resource.
+     */
+    QJsonObject message_json(const std::string &id, const std::string &format,
+                             const std::set<std::string> &headers) const;
+
+    QJsonObject thread_json(const std::string &id, const std::string &format,
+                            const std::set<std::string> &headers) const;
+
+    QJsonObject thread_summary_json(const std::string &id) const;
+
+    QJsonObject labels_json() const;
+
+    QJsonObject profile_json() const;
+
+    /**
+     * The changes after a history id, as users/me/history gives them, or an empty
+     * object if that history id is older than the mailbox
+     */
+    QJsonObject history_json(const std::string &start, const std::string &token,
+                             std::size_t max_results) const;
+
+    /**
+     * Mutations, which return the new state of the message, or an empty object
+     */
+    QJsonObject modify(const std::string &id, const std::set<std::string> &add,
+                       const std::set<std::string> &remove);
+
+    QJsonObject send(const std::string &raw, const std::string &thread_id);
+
+private:
+    /**
+     * One entry in the history: a new message, or a change to its labels
+     */
+    struct Change {
+        std::uint64_t historyId;
+        std::string id;
+        std::string threadId;
+        std::set<std::string> labels;
+        bool added;
+        std::set<std::string> labels_added;
+        std::set<std::string> labels_removed;
+    };
+
+    QJsonObject message_json_locked(const Message &message, const std::string &format,
+                                    const std::set<std::string> &headers) const;
+
+    bool matches(const Message &message, const std::string &query,
+                 const std::string &label_id) const;
+
+    /**
+     * Messages, newest first
+     */
+    std::deque<const Message*> sorted() const;
+
+    mutable std::mutex mutex_;
+
+    std::string address_;
+
+    std::map<std::string, Message> messages_;
+
+    std::deque<Label> labels_;
+
+    std::uint64_t history_id_;
+
+    /**
+     * The history id the mailbox was created or loaded at; there is no history
+     * from before it
+     */
+    std::uint64_t history_start_;
+
+    std::deque<Change> history_;
+
+    std::uint64_t next_id_;
+};
+
+}
+
+#endif // BENCHMARK_MAILBOX_H_
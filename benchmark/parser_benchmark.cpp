@@ -0,0 +1,301 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+/*
+ * Microbenchmarks of the parsing and encoding functions that every message
+ * goes through.
+ *
+ * The fixtures come from synthetic mailboxes with short, long, and deeply
+ * quoted bodies, in the JSON shapes the Gmail API returns, along with RFC 2047
+ * encoded words in several charsets.
+ */
+
+#include "mailbox.h"
+
+#include <api/parser.h>
+#include <trojita/Encoders.h>
+#include <trojita/kcodecs.h>
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QVariantMap>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace bench;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * One message, in each of the forms that the functions under test take
+ */
+struct Fixture {
+    QByteArray full_json;
+    QByteArray metadata_json;
+    QVariant full;
+    QVariant metadata;
+    QVariant headers;
+    QVariant payload;
+    QVariant data;
+    QString recipients;
+    std::string date;
+    QString subject;
+    QByteArray body;
+    QByteArray quoted_printable;
+    QByteArray encoded_subject;
+};
+
+struct Corpus {
+    std::string name;
+    std::vector<Fixture> fixtures;
+    std::size_t body_bytes;
+};
+
+/**
+ * Encoded words as other mailers send them, in charsets other than UTF-8
+ */
+const char *ENCODED_WORDS[] = {
+    "=?ISO-8859-1?Q?Andr=E9_Pirard?= <pirard@example.org>",
+    "=?KOI8-R?B?8NLJ18XU?= =?KOI8-R?B?8NLJ18XU?=",
+    "=?ISO-2022-JP?B?GyRCRnxLXDhsGyhC?= meeting",
+    "=?windows-1252?Q?=93quoted=94_r=E9sum=E9?=",
+    "=?UTF-8?B?w5xiZXJwcsO8ZnVuZw==?= of the =?UTF-8?Q?r=C3=A9union?=",
+    "Plain ASCII subject with no encoded words at all"
+};
+
+static std::string header_value(const QVariant &headers, const QString &name) {
+    for (const QVariant &header : headers.toList()) {
+        QVariantMap item = header.toMap();
+        if (item["name"].toString() == name)
+            return item["value"].toString().toStdString();
+    }
+    return "";
+}
+
+static Corpus make_corpus(const std::string &name, const MailboxOptions &options,
+                          std::size_t min_body, std::size_t max_body) {
+    Corpus corpus;
+    corpus.name = name;
+    corpus.body_bytes = 0;
+
+    Mailbox::Ptr mailbox = Mailbox::generate(options);
+    Mailbox::Page page = mailbox->list_messages("", "", "", mailbox->size());
+    std::set<std::string> headers = {
+        "Date", "From", "To", "Cc", "Reply-To", "Subject", "Message-ID", "Message-Id"
+    };
+    for (const std::string &id : page.first) {
+        Fixture fixture;
+        QJsonObject full = mailbox->message_json(id, "full", {});
+        fixture.full_json = QJsonDocument(full).toJson(QJsonDocument::Compact);
+        fixture.full = full.toVariantMap();
+        QVariantMap payload = fixture.full.toMap()["payload"].toMap();
+        fixture.payload = payload;
+        fixture.headers = payload["headers"];
+
+        // The text/plain body is either the payload's, or that of its first part
+        QVariantMap text = payload["body"].toMap();
+        if (payload.contains("parts"))
+            text = payload["parts"].toList().first().toMap()["body"].toMap();
+        fixture.data = text["data"];
+        fixture.body = QByteArray::fromBase64(fixture.data.toByteArray(),
+                                              QByteArray::Base64UrlEncoding);
+        if (static_cast<std::size_t>(fixture.body.size()) < min_body ||
+                static_cast<std::size_t>(fixture.body.size()) >= max_body)
+            continue;
+
+        QJsonObject metadata = mailbox->message_json(id, "metadata", headers);
+        fixture.metadata_json = QJsonDocument(metadata).toJson(QJsonDocument::Compact);
+        fixture.metadata = metadata.toVariantMap();
+        fixture.recipients = QString::fromStdString(header_value(fixture.headers, "To"));
+        fixture.date = header_value(fixture.headers, "Date");
+        fixture.quoted_printable = KCodecs::quotedPrintableEncode(fixture.body);
+        fixture.subject = QString::fromStdString(header_value(fixture.headers, "Subject"));
+        fixture.encoded_subject = Imap::encodeRFC2047StringWithAsciiPrefix(fixture.subject);
+        corpus.body_bytes += fixture.body.size();
+        corpus.fixtures.push_back(fixture);
+    }
+    return corpus;
+}
+
+/**
+ * Call the function on every fixture, over and over, for at least min_time, and
+ * report the time per call and the throughput over the message bodies.
+ */
+static void measure(const std::string &function, const Corpus &corpus,
+                    std::chrono::milliseconds min_time,
+                    const std::function<std::size_t(const Fixture&)> &call,
+                    bool count_bytes = true) {
+    if (corpus.fixtures.empty())
+        return;
+
+    // The sizes of the results are summed, so that no call can be optimized away
+    std::size_t sink = 0;
+    std::size_t calls = 0;
+    std::size_t rounds = 0;
+    Clock::time_point start = Clock::now();
+    Clock::duration elapsed;
+    do {
+        for (const Fixture &fixture : corpus.fixtures)
+            sink += call(fixture);
+        calls += corpus.fixtures.size();
+        rounds += 1;
+        elapsed = Clock::now() - start;
+    } while (elapsed < min_time);
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::left << std::setw(34) << function << std::setw(10) << corpus.name
+              << std::right << std::fixed << std::setprecision(0)
+              << std::setw(12) << seconds * 1e9 / calls;
+    if (count_bytes)
+        std::cout << std::setprecision(1) << std::setw(12)
+                  << corpus.body_bytes * rounds / seconds / 1e6;
+    else
+        std::cout << std::setw(12) << "-";
+    std::cout << std::setw(10) << calls << (sink == 0 ? " !" : "") << std::endl;
+}
+
+}
+
+
+int main(int argc, char **argv) {
+    std::chrono::milliseconds min_time(500);
+    std::size_t messages = 400;
+    std::string filter;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--min-time" && i + 1 < argc) {
+            min_time = std::chrono::milliseconds(std::atoi(argv[++i]));
+        } else if (arg == "--messages" && i + 1 < argc) {
+            messages = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--min-time MS] [--messages N] "
+                      << "[--filter FUNCTION]" << std::endl;
+            return 1;
+        }
+    }
+
+    MailboxOptions unquoted;
+    unquoted.messages = messages;
+    unquoted.max_quote_depth = 0;
+    MailboxOptions quoted = unquoted;
+    quoted.max_quote_depth = 8;
+    quoted.seed = 2;
+
+    std::vector<Corpus> corpora = {
+        make_corpus("small", unquoted, 0, 2048),
+        make_corpus("large", unquoted, 2048, std::size_t(-1)),
+        make_corpus("quoted", quoted, 0, std::size_t(-1)),
+    };
+
+    Corpus charsets;
+    charsets.name = "charsets";
+    charsets.body_bytes = 0;
+    for (const char *word : ENCODED_WORDS) {
+        Fixture fixture;
+        fixture.encoded_subject = word;
+        charsets.body_bytes += fixture.encoded_subject.size();
+        charsets.fixtures.push_back(fixture);
+    }
+
+    std::cout << std::left << std::setw(34) << "function" << std::setw(10) << "corpus"
+              << std::right << std::setw(12) << "ns/call" << std::setw(12) << "MB/s"
+              << std::setw(10) << "calls" << std::endl;
+
+    typedef std::function<std::size_t(const Fixture&)> Call;
+    struct Case {
+        std::string name;
+        Call call;
+        bool count_bytes;
+    };
+    std::vector<Case> cases = {
+        { "parse_email(full)", [](const Fixture &f) {
+            return api::parser::parse_email(f.full).body.size();
+        }, true },
+        { "parse_email(metadata)", [](const Fixture &f) {
+            return api::parser::parse_email(f.metadata).id.size();
+        }, false },
+        // From the response body, as the client gets it
+        { "fromJson+parse_email(full)", [](const Fixture &f) {
+            return api::parser::parse_email(QJsonDocument::fromJson(f.full_json).toVariant()).body.size();
+        }, true },
+        { "parse_email(full json)", [](const Fixture &f) {
+            return api::parser::parse_email(f.full_json).body.size();
+        }, true },
+        { "fromJson+parse_email(metadata)", [](const Fixture &f) {
+            return api::parser::parse_email(QJsonDocument::fromJson(f.metadata_json).toVariant()).id.size();
+        }, false },
+        { "parse_email(metadata json)", [](const Fixture &f) {
+            return api::parser::parse_email(f.metadata_json).id.size();
+        }, false },
+        { "parse_header", [](const Fixture &f) {
+            return api::parser::parse_header(f.headers).to.size();
+        }, false },
+        { "parse_contact_list", [](const Fixture &f) {
+            return api::parser::parse_contact_list(f.recipients).size();
+        }, false },
+        { "parse_date", [](const Fixture &f) {
+            std::int64_t date = 0;
+            int offset = 0;
+            api::parser::parse_date(f.date, date, offset);
+            return static_cast<std::size_t>(date);
+        }, false },
+        { "decode", [](const Fixture &f) {
+            return api::parser::decode(f.data).size();
+        }, true },
+        { "parse_payload", [](const Fixture &f) {
+            return api::parser::parse_payload(f.payload).size();
+        }, true },
+        { "metadata_params", [](const Fixture &) {
+            return api::parser::metadata_params().size();
+        }, false },
+        { "KCodecs::quotedPrintableEncode", [](const Fixture &f) {
+            return static_cast<std::size_t>(KCodecs::quotedPrintableEncode(f.body).size());
+        }, true },
+        { "KCodecs::quotedPrintableDecode", [](const Fixture &f) {
+            return static_cast<std::size_t>(KCodecs::quotedPrintableDecode(f.quoted_printable).size());
+        }, true },
+        { "Imap::wrapFormatFlowed", [](const Fixture &f) {
+            return static_cast<std::size_t>(Imap::wrapFormatFlowed(QString::fromUtf8(f.body)).size());
+        }, true },
+        { "Imap::encodeRFC2047String", [](const Fixture &f) {
+            return static_cast<std::size_t>(Imap::encodeRFC2047StringWithAsciiPrefix(f.subject).size());
+        }, false },
+        { "Imap::encodeRFC2047Phrase", [](const Fixture &f) {
+            return static_cast<std::size_t>(Imap::encodeRFC2047Phrase(f.recipients).size()) + 1;
+        }, false },
+    };
+
+    for (const Case &c : cases) {
+        if (c.name.find(filter) == std::string::npos)
+            continue;
+        for (const Corpus &corpus : corpora)
+            measure(c.name, corpus, min_time, c.call, c.count_bytes);
+    }
+
+    // Encoded words come from headers, so they get their own corpus
+    if (std::string("Imap::decodeRFC2047String").find(filter) != std::string::npos) {
+        for (const Corpus &corpus : corpora) {
+            measure("Imap::decodeRFC2047String", corpus, min_time, [](const Fixture &f) {
+                return static_cast<std::size_t>(Imap::decodeRFC2047String(f.encoded_subject).size());
+            }, false);
+        }
+        measure("Imap::decodeRFC2047String", charsets, min_time, [](const Fixture &f) {
+            return static_cast<std::size_t>(Imap::decodeRFC2047String(f.encoded_subject).size());
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+/*
+ * End-to-end latency of the scope's queries, previews, and activations.
+ *
+ * Each scenario runs the real scope::Query, scope::Preview, or scope::Activation
+ * against mock reply objects and the fake Gmail server, and records when the
+ * first and last results were pushed.
+ */
+
+#include "fake_server.h"
+#include "mailbox.h"
+
+#include <api/config.h>
+#include <api/email_cache.h>
+#include <api/services.h>
+#include <api/token_provider.h>
+#include <scope/activation.h>
+#include <scope/preview.h>
+#include <scope/query.h>
+
+#include <unity/scopes/ActionMetadata.h>
+#include <unity/scopes/CannedQuery.h>
+#include <unity/scopes/CategorisedResult.h>
+#include <unity/scopes/SearchMetadata.h>
+#include <unity/scopes/testing/Category.h>
+#include <unity/scopes/testing/MockPreviewReply.h>
+#include <unity/scopes/testing/MockSearchReply.h>
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace sc = unity::scopes;
+
+using namespace bench;
+using ::testing::_;
+using ::testing::An;
+using ::testing::Invoke;
+using ::testing::NiceMock;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * The fake server doesn't check tokens, so skip Online Accounts
+ */
+class StaticTokens : public api::TokenProvider {
+public:
+    StaticTokens() : api::TokenProvider(std::chrono::seconds(3600), std::chrono::seconds(60)) {
+    }
+
+protected:
+    std::string fetch() override {
+        return "benchmark-token";
+    }
+};
+
+/**
+ * A query whose settings are given directly, rather than read from the registry
+ */
+class BenchmarkQuery : public scope::Query {
+public:
+    BenchmarkQuery(const sc::CannedQuery &query, const sc::SearchMetadata &metadata,
+                   api::Config::Ptr config, int view, bool skeleton) :
+        scope::Query(query, metadata, config), view_(view), skeleton_(skeleton),
+        prefetch_(config->prefetch_count) {
+    }
+
+protected:
+    void init_scope() override {
+        // The same meanings as the messageView setting
+        thread_messages = (view_ == 0);
+        show_snippets = (view_ != 1);
+        show_skeletons = skeleton_;
+        prefetch_count = prefetch_;
+        prefetch_pages = true;
+    }
+
+private:
+    int view_;
+
+    bool skeleton_;
+
+    std::size_t prefetch_;
+};
+
+struct Options {
+    Options() : iterations(20), messages(2000), cold(false), skeleton(false),
+        profile(NetworkProfile::named("wifi")) {
+    }
+
+    std::size_t iterations;
+    std::size_t messages;
+    bool cold;
+    bool skeleton;
+    NetworkProfile profile;
+    std::string filter;
+    std::string store;
+};
+
+struct Sample {
+    double first;
+    double last;
+    std::size_t pushes;
+};
+
+/**
+ * Build the shared state as Scope::start does, but pointed at the fake server.
+ * With a store path, the metadata store is reopened each time, as when the scope
+ * restarts.
+ */
+static api::Config::Ptr make_config(const FakeServer &server, const std::string &store) {
+    api::Config::Ptr config = std::make_shared<api::Config>();
+    config->apidomain = server.url();
+    api::start_services(config, std::make_shared<StaticTokens>(), store);
+    return config;
+}
+
+static double milliseconds(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static double percentile(std::vector<double> values, double fraction) {
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    std::size_t rank = static_cast<std::size_t>(std::ceil(fraction * values.size()));
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+static void report(const std::string &name, const std::vector<Sample> &samples) {
+    std::vector<double> first, last;
+    std::size_t pushes = 0;
+    for (const Sample &sample : samples) {
+        first.push_back(sample.first);
+        last.push_back(sample.last);
+        pushes += sample.pushes;
+    }
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setprecision(1);
+    for (const auto &values : { first, last }) {
+        for (double fraction : { 0.5, 0.95, 0.99 })
+            std::cout << std::setw(9) << percentile(values, fraction);
+        std::cout << "  ";
+    }
+    std::cout << std::setw(7) << (samples.empty() ? 0 : pushes / samples.size()) << std::endl;
+}
+
+/**
+ * Run one query, returning the results it pushed
+ */
+static Sample run_query(api::Config::Ptr config, const std::string &query_string,
+                        const std::string &department, int view, bool skeleton,
+                        std::vector<sc::CategorisedResult> *results = nullptr) {
+    NiceMock<sc::testing::MockSearchReply> reply;
+    Sample sample { 0, 0, 0 };
+    Clock::time_point start = Clock::now();
+
+    ON_CALL(reply, register_category(_, _, _, _))
+            .WillByDefault(Invoke([](const std::string &id, const std::string &title,
+                                     const std::string &icon, const sc::CategoryRenderer &renderer) {
+        return std::make_shared<sc::testing::Category>(id, title, icon, renderer);
+    }));
+    ON_CALL(reply, push(An<const sc::CategorisedResult&>()))
+            .WillByDefault(Invoke([&](const sc::CategorisedResult &result) {
+        double now = milliseconds(start, Clock::now());
+        if (sample.pushes == 0)
+            sample.first = now;
+        sample.pushes += 1;
+        if (results)
+            results->push_back(result);
+        return true;
+    }));
+
+    sc::CannedQuery query(SCOPE_NAME, query_string, department);
+    BenchmarkQuery q(query, sc::SearchMetadata("en_US", "phone"), config, view, skeleton);
+    sc::SearchReplyProxy proxy(&reply, [](sc::SearchReply*) {});
+    q.run(proxy);
+    sample.last = milliseconds(start, Clock::now());
+    return sample;
+}
+
+static Sample run_preview(api::Config::Ptr config, const sc::Result &result) {
+    NiceMock<sc::testing::MockPreviewReply> reply;
+    Sample sample { 0, 0, 0 };
+    Clock::time_point start = Clock::now();
+
+    ON_CALL(reply, push(An<const sc::PreviewWidgetList&>()))
+            .WillByDefault(Invoke([&](const sc::PreviewWidgetList &) {
+        double now = milliseconds(start, Clock::now());
+        if (sample.pushes == 0)
+            sample.first = now;
+        sample.pushes += 1;
+        return true;
+    }));
+
+    scope::Preview preview(result, sc::ActionMetadata("en_US", "phone"), config);
+    sc::PreviewReplyProxy proxy(&reply, [](sc::PreviewReply*) {});
+    preview.run(proxy);
+    sample.last = milliseconds(start, Clock::now());
+    return sample;
+}
+
+static Sample run_activation(api::Config::Ptr config, const sc::Result &result,
+                             const std::string &action) {
+    Clock::time_point start = Clock::now();
+    scope::Activation activation(result, sc::ActionMetadata("en_US", "phone"), "modifiers",
+                                 action, config);
+    activation.activate();
+    double elapsed = milliseconds(start, Clock::now());
+    return { elapsed, elapsed, 1 };
+}
+
+}
+
+
+int main(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--cold") {
+            options.cold = true;
+        } else if (arg == "--skeleton") {
+            options.skeleton = true;
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            options.iterations = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--messages" && i + 1 < argc) {
+            options.messages = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--profile" && i + 1 < argc) {
+            options.profile = NetworkProfile::named(argv[++i]);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--store" && i + 1 < argc) {
+            options.store = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--iterations N] [--messages N] "
+                      << "[--profile lan|wifi|4g|3g|edge] [--cold] [--skeleton] [--filter NAME] "
+                      << "[--store FILE]" << std::endl;
+            return 1;
+        }
+    }
+
+    MailboxOptions mailbox_options;
+    mailbox_options.messages = options.messages;
+    Mailbox::Ptr mailbox = Mailbox::generate(mailbox_options);
+    FakeServer server(mailbox, options.profile);
+    server.set_shuffle_batches(true);
+    server.start();
+
+    // Things to look at in the later scenarios
+    std::string thread_id = mailbox->list_threads("", "INBOX", "", 1).first.front();
+    std::string from = "from:user1";
+
+    struct Scenario {
+        std::string name;
+        std::string query;
+        std::string department;
+        int view;
+    };
+    std::vector<Scenario> scenarios = {
+        { "inbox/threads", "", "", 0 },
+        { "inbox/messages", "", "", 1 },
+        { "inbox/snippets", "", "", 2 },
+        { "label/threads", "", "Label_1", 0 },
+        { "label/messages", "", "Label_1", 1 },
+        { "all-mail/messages", "", "ALL_MAIL", 1 },
+        { "search/threads", from, "", 0 },
+        { "search/messages", from, "", 1 },
+        { "more/threads", "more:~~~~12", "", 0 },
+        { "more/messages", "more:~~~~50", "", 1 },
+        { "threadid", "threadid:" + thread_id, "", 1 },
+    };
+
+    std::cout << "Profile " << options.profile.name << ", " << options.iterations
+              << " iterations" << (options.cold ? ", cold" : ", warm") << "; times in ms"
+              << std::endl;
+    std::cout << std::left << std::setw(28) << "scenario" << std::right
+              << std::setw(29) << "first result p50/p95/p99"
+              << std::setw(29) << "last result p50/p95/p99" << std::setw(9) << "pushes"
+              << std::endl;
+
+    api::Config::Ptr config = make_config(server, options.store);
+    std::vector<sc::CategorisedResult> results;
+    for (const Scenario &scenario : scenarios) {
+        if (scenario.name.find(options.filter) == std::string::npos)
+            continue;
+        std::vector<Sample> samples;
+        for (std::size_t i = 0; i < options.iterations; i++) {
+            if (options.cold) {
+                api::stop_services(config);
+                config = make_config(server, options.store);
+            }
+            results.clear();
+            samples.push_back(run_query(config, scenario.query, scenario.department,
+                                        scenario.view, options.skeleton, &results));
+        }
+        report(scenario.name, samples);
+    }
+
+    // Previews and activations of the first message in the inbox
+    results.clear();
+    run_query(config, "", "", 1, false, &results);
+    if (!results.empty() && std::string("preview").find(options.filter) != std::string::npos) {
+        std::vector<Sample> previews, activations;
+        for (std::size_t i = 0; i < options.iterations; i++) {
+            if (options.cold) {
+                api::stop_services(config);
+                config = make_config(server, options.store);
+            }
+            previews.push_back(run_preview(config, results.front()));
+            activations.push_back(run_activation(config, results.front(),
+                                                 i % 2 ? "mark unread" : "mark read"));
+        }
+        report("preview", previews);
+        report("activation/modify", activations);
+    }
+
+    std::cout << server.requests() << " requests over " << server.connections()
+              << " connections" << std::endl;
+    std::cout << "Email cache: " << config->emails->hits() << " hits, "
+              << config->emails->misses() << " misses, " << config->emails->bytes()
+              << " bytes" << std::endl;
+    std::cout << "Body cache: " << config->bodies->hits() << " hits, "
+              << config->bodies->misses() << " misses, " << config->bodies->bytes()
+              << " bytes" << std::endl;
+    api::stop_services(config);
+    server.stop();
+    return 0;
+}
@@ -2,21 +2,35 @@
 #define API_CLIENT_H_
 
 #include <api/config.h>
+#include <api/connection_pool.h>
+#include <api/executor.h>
+#include <api/single_flight.h>
+#include <api/token_provider.h>
 
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <future>
 #include <map>
+#include <mutex>
 #include <string>
 #include <core/net/http/request.h>
+#include <core/net/http/response.h>
 #include <core/net/uri.h>
 
+#include <QByteArray>
 #include <QJsonDocument>
-#include <QVariantList>
-
-#include <unity/scopes/OnlineAccountClient.h>
 
 namespace api {
 
+class BodyCache;
+class EmailCache;
+class MetadataStore;
+class PageCache;
+class ResultCache;
+
 const std::string TIME_FMT = "MMMM d, yyyy HH:mm";
 
 /**
@@ -40,7 +54,12 @@ public:
     typedef std::deque<Contact> ContactList;
 
     struct Header {
-        std::string date;
+        /**
+         * When the message was sent, in seconds since the epoch, or 0 if we
+         * couldn't tell; and the sender's offset from UTC, in minutes
+         */
+        std::int64_t date { 0 };
+        int date_offset { 0 };
         Contact from;
         ContactList to;
         ContactList cc;
@@ -62,21 +81,63 @@ public:
 
     typedef std::deque<Email> EmailList;
 
+    /**
+     * Called with each message as soon as it's available.  Returning false stops
+     * the calls, and cancels the rest of the request.
+     */
+    typedef std::function<bool(const Email&)> EmailHandler;
+
     typedef std::pair<EmailList, std::string> EmailListRes;
 
     typedef std::deque<std::pair<std::string, std::string>> LabelList;
 
-    typedef std::deque<std::string> ThreadList;
+    struct Thread {
+        std::string id;
+        std::string historyId;
+        std::string snippet;
+    };
+
+    typedef std::deque<Thread> ThreadList;
 
     typedef std::pair<ThreadList, std::string> ThreadListRes;
 
+    /**
+     * One page of a listing of messages or threads, as kept between queries
+     */
+    struct Page {
+        EmailList messages;
+        ThreadList threads;
+        std::string next;
+    };
+
+    /**
+     * One change to a message from the mailbox's history.  The labels are all of
+     * the message's labels after the change.
+     */
+    struct Change {
+        std::string id;
+        std::string threadId;
+        Labels labels;
+        bool added;
+        bool deleted;
+        Labels labels_added;
+        Labels labels_removed;
+    };
+
+    typedef std::deque<Change> ChangeList;
+
     /**
      * Constructor / destructor
      */
 
+    /**
+     * The config's pool, token provider, single flight and executor are
+     * shared, as set up by start_services(); throws std::logic_error if any
+     * is missing.
+     */
     Client(Config::Ptr config);
 
-    virtual ~Client() = default;
+    virtual ~Client();
 
     /**
      * Public methods
@@ -87,7 +148,26 @@ public:
 
     virtual Email messages_get(const std::string &id, bool body);
 
-    virtual EmailList messages_get_batch(const EmailList &messages);
+    /**
+     * Get the metadata of the messages, in order.  Each is also handed to on_email,
+     * in order, as soon as it and all the messages before it have arrived.
+     */
+    virtual EmailList messages_get_batch(const EmailList &messages,
+                                         const EmailHandler &on_email = EmailHandler());
+
+    /**
+     * Look up a message's metadata or a thread's messages in memory or in the
+     * store, without going to the network.  Threads are newest first.
+     */
+    virtual bool message_cached(const std::string &id, Email &message);
+
+    virtual bool thread_cached(const Thread &thread, EmailList &messages);
+
+    /**
+     * Fetch the bodies of messages into the body cache, skipping those that are
+     * already there.  Does nothing without a body cache.
+     */
+    virtual void messages_prefetch(const std::deque<std::string> &ids);
 
     virtual Email messages_set_unread(const std::string& id, bool unread);
 
@@ -100,7 +180,12 @@ public:
 
     virtual EmailList threads_get(const std::string& id);
 
-    virtual EmailList threads_get_batch(const ThreadList& threads);
+    /**
+     * Get the messages of the threads, newest first within each thread.  As with
+     * messages_get_batch, they are handed to on_email as they arrive.
+     */
+    virtual EmailList threads_get_batch(const ThreadList& threads,
+                                        const EmailHandler &on_email = EmailHandler());
 
     virtual Email send_message(const Contact& to, const std::string& subject,
                                const std::string& body, const std::string &from_name,
@@ -110,30 +195,185 @@ public:
 
     virtual LabelList get_labels();
 
+    /**
+     * Asynchronous versions of the above, which run on the shared executor and
+     * return futures for their results, so that callers can overlap them.  Any
+     * exception comes out of the future.  Calls that haven't started when the
+     * client is cancelled return empty results.  Destroying the client cancels it and
+     * waits for those still running, since they refer to it, so a future dropped
+     * by an exception can't leave one running on.
+     */
+    std::future<EmailListRes> messages_list_async(const std::string &query,
+                                                  const std::string &label_id,
+                                                  const std::string &token);
+
+    std::future<Email> messages_get_async(const std::string &id, bool body);
+
+    std::future<EmailList> messages_get_batch_async(const EmailList &messages,
+                                                    const EmailHandler &on_email = EmailHandler());
+
+    std::future<Email> messages_set_unread_async(const std::string &id, bool unread);
+
+    std::future<Email> messages_trash_async(const std::string &id);
+
+    std::future<Email> messages_untrash_async(const std::string &id);
+
+    std::future<ThreadListRes> threads_list_async(const std::string &query,
+                                                  const std::string &label_id,
+                                                  const std::string &token);
+
+    std::future<EmailList> threads_get_async(const std::string &id);
+
+    std::future<EmailList> threads_get_batch_async(const ThreadList &threads,
+                                                   const EmailHandler &on_email = EmailHandler());
+
+    std::future<Email> send_message_async(const Contact &to, const std::string &subject,
+                                          const std::string &body, const std::string &from_name,
+                                          const std::string &ref_id, const std::string &thread_id);
+
+    std::future<std::string> users_address_async();
+
+    std::future<LabelList> get_labels_async();
+
     /**
      * Cancel any pending queries (this method can be called from a different thread)
      */
     virtual void cancel();
 
+    /**
+     * Whether we've been cancelled, in which case results may be incomplete
+     */
+    virtual bool cancelled() const;
+
+    /**
+     * Whether a request has come back with nothing, as when the network dropped,
+     * in which case results may be incomplete
+     */
+    virtual bool failed() const;
+
     virtual Config::Ptr config();
 
+    /**
+     * Where the asynchronous calls run; callers may run their own work there too
+     */
+    virtual Executor::Ptr executor();
+
 protected:
+    /**
+     * Make an authorized request, retrying once with a fresh token if the server
+     * rejects ours.  Without a content type, this is a GET; otherwise a POST.
+     */
+    core::net::http::Response execute(const std::string &uri, const std::string &payload,
+                                      const std::string &content_type,
+                                      const ConnectionPool::ProgressHandler &progress);
+
+    /**
+     * Get the JSON at path, unparsed, or nothing if the request was cancelled
+     */
+    void get(const core::net::Uri::Path &path,
+             const core::net::Uri::QueryParameters &parameters,
+             QByteArray &json);
+
     void get(const core::net::Uri::Path &path,
              const core::net::Uri::QueryParameters &parameters,
              QJsonDocument &root);
 
+    void post(const core::net::Uri::Path &path,
+              const core::net::Uri::QueryParameters &parameters,
+              const std::string& payload,
+              QByteArray &json);
+
     void post(const core::net::Uri::Path &path,
               const core::net::Uri::QueryParameters &parameters,
               const std::string& payload,
               QJsonDocument &root);
 
+    /**
+     * Get the resources at path/id for each of the ids, in sub-batches that are
+     * sent concurrently.  Ids that another client is already getting are not
+     * requested again.
+     *
+     * Each resource's JSON, or nothing if it couldn't be fetched, is parsed as
+     * soon as it arrives, on the parser threads if we have them.  The results are
+     * handed to on_result in the order of the ids, each as soon as it and all
+     * those before it are ready.
+     */
+    template<typename T>
     void batch_get(const core::net::Uri::Path &path,
                    const core::net::Uri::QueryParameters &parameters,
                    const std::deque<std::string> &ids,
-                   QVariantList &results);
+                   const std::function<T(const QByteArray&)> &parse,
+                   const std::function<void(const std::string&, const T&)> &on_result);
+
+    /**
+     * Get one sub-batch, as a single multipart request, publishing each part to
+     * the ticket for its id.
+     */
+    void batch_get_part(const core::net::Uri::Path &path,
+                        const core::net::Uri::QueryParameters &parameters,
+                        const std::deque<std::string> &ids,
+                        const std::deque<SingleFlight::Ticket*> &tickets);
 
     virtual std::string access_token();
 
+    /**
+     * Fetch the cached values and publish them to the configuration
+     */
+    void fetch_users_address();
+
+    void fetch_labels();
+
+    /**
+     * Fetch a stale cached value on the executor, unless another client is already
+     * doing so.  The refresh doesn't use or outlive this client.
+     */
+    template<typename T>
+    void refresh(Snapshot<T> &snapshot, void (Client::*fetch)());
+
+    /**
+     * Call one of our methods on the executor, with copies of the arguments
+     */
+    template<typename R, typename... Params, typename... Args>
+    std::future<R> run_async(R (Client::*method)(Params...), Args&&... args);
+
+    /**
+     * Counts one of our asynchronous calls as finished once it goes out of scope,
+     * however the call ends
+     */
+    class Finished {
+    public:
+        explicit Finished(Client &client);
+
+        ~Finished();
+
+    private:
+        Client &client_;
+    };
+
+    /**
+     * Bring the metadata store up to date with the mailbox's history, or start
+     * following it.  Returns whether the store's lists can be trusted.
+     */
+    bool sync();
+
+    /**
+     * Keep the store's copy of a message we've just modified up to date
+     */
+    Email stored_labels(const Email &message);
+
+    /**
+     * Keep parsed messages and threads in memory for the other clients
+     */
+    void cache_message(const Email &message);
+
+    void cache_thread(const std::string &id, const std::string &history_id,
+                      const EmailList &thread);
+
+    /**
+     * Give a message in the body cache its new labels
+     */
+    void relabel_body(const std::string &id, const Labels &labels);
+
     /**
      * Progress callback that allows the query to cancel pending HTTP requests.
      */
@@ -145,10 +385,75 @@ protected:
      */
     Config::Ptr config_;
 
+    /**
+     * Where our HTTP requests are made; normally shared with all other clients
+     */
+    ConnectionPool::Ptr pool_;
+
+    /**
+     * Our source of access tokens; normally shared with all other clients
+     */
+    TokenProvider::Ptr tokens_;
+
+    /**
+     * Requests in flight; normally shared with all other clients
+     */
+    SingleFlight::Ptr flights_;
+
+    /**
+     * Where asynchronous calls run; normally shared with all other clients
+     */
+    Executor::Ptr executor_;
+
+    /**
+     * Where batches are parsed, if the scope has threads for it
+     */
+    Executor::Ptr parsers_;
+
+    /**
+     * Metadata kept from earlier queries, if the scope has a store
+     */
+    std::shared_ptr<MetadataStore> metadata_;
+
+    /**
+     * Parsed messages and threads in memory, if the scope has a cache
+     */
+    std::shared_ptr<EmailCache> emails_;
+
+    /**
+     * Messages with bodies, if the scope has a cache for them
+     */
+    std::shared_ptr<BodyCache> bodies_;
+
+    /**
+     * Later pages of listings, if the scope has a cache for them
+     */
+    std::shared_ptr<PageCache> pages_;
+
+    /**
+     * What queries have shown, if the scope keeps them; these are forgotten when
+     * messages change
+     */
+    std::shared_ptr<ResultCache> results_;
+
     /**
      * Thread-safe cancelled flag
      */
     std::atomic<bool> cancelled_;
+
+    /**
+     * Thread-safe failed flag
+     */
+    std::atomic<bool> failed_;
+
+    /**
+     * How many of our asynchronous calls are waiting or running
+     */
+    std::size_t jobs_;
+
+    std::mutex jobs_mutex_;
+
+    std::condition_variable jobs_done_;
 };
 
 }
@@ -1,12 +1,27 @@
 #ifndef API_CONFIG_H_
 #define API_CONFIG_H_
 
+#include <api/snapshot.h>
+
+#include <chrono>
 #include <memory>
 #include <string>
 #include <deque>
+#include <thread>
 
 namespace api {
 
+class BodyCache;
+class ConnectionPool;
+class EmailCache;
+class Executor;
+class MetadataStore;
+class PageCache;
+class Prefetcher;
+class ResultCache;
+class SingleFlight;
+class TokenProvider;
+
 struct Config {
     typedef std::shared_ptr<Config> Ptr;
 
@@ -22,10 +37,110 @@ struct Config {
     std::string user_agent { "Gmail Scope (Ubuntu) " VERSION };
 
     /*
-     * Cached values
+     * Connection pooling
+     */
+    std::size_t max_connections_per_host { 6 };
+    std::chrono::seconds connection_idle_timeout { 60 };
+
+    /*
+     * Batch requests are split into sub-batches of this many ids, which are
+     * sent concurrently
+     */
+    std::size_t batch_size { 10 };
+
+    /*
+     * Asynchronous client calls share this many threads
+     */
+    std::size_t executor_threads { 8 };
+
+    /*
+     * The parts of a batch response are parsed on this many threads of their
+     * own.  Nothing else runs there, so parsing never waits behind a request.
+     */
+    std::size_t parse_threads { std::thread::hardware_concurrency() };
+
+    /*
+     * Access tokens are assumed to be good for this long, and are refreshed
+     * this far ahead of their expiry
+     */
+    std::chrono::seconds token_lifetime { 1800 };
+    std::chrono::seconds token_refresh_margin { 120 };
+
+    /*
+     * Stored message metadata is trusted for this long, and dropped from the
+     * store when it is this old
+     */
+    std::chrono::seconds metadata_ttl { 900 };
+    std::chrono::seconds metadata_max_age { 30 * 24 * 3600 };
+
+    /*
+     * Memory for parsed messages and threads shared between queries, which are
+     * trusted for the metadata time to live
+     */
+    std::size_t email_cache_bytes { 4 * 1024 * 1024 };
+
+    /*
+     * The bodies of this many of each query's top results are fetched in the
+     * background, so that previewing them doesn't wait on the network.  Fewer
+     * are fetched when the user says the connection is metered.
+     */
+    std::size_t prefetch_count { 5 };
+    std::size_t prefetch_count_metered { 1 };
+    std::size_t body_cache_bytes { 4 * 1024 * 1024 };
+
+    /*
+     * The page behind each "More results" card is fetched while no query is
+     * running, and kept for this long
+     */
+    std::size_t page_cache_bytes { 1024 * 1024 };
+    std::chrono::seconds page_ttl { 120 };
+
+    /*
+     * What each query showed is shown again straight away for this long, while
+     * it's fetched again in the background
+     */
+    std::size_t result_cache_bytes { 1024 * 1024 };
+    std::chrono::seconds result_ttl { 300 };
+
+    /*
+     * Those fetches run on this many threads of their own, so that they never
+     * hold up the requests of the queries being shown
+     */
+    std::size_t revalidate_threads { 1 };
+
+    /*
+     * A search typed into the dash waits this long for the next keystroke
+     * before going to the network
+     */
+    std::chrono::milliseconds search_debounce { 250 };
+
+    /*
+     * Shared by all clients; owned by the scope.  A client needs the pool,
+     * tokens, flights and executor.  Without a metadata store or email cache,
+     * nothing is kept between queries; without a body cache and prefetcher,
+     * previews always fetch their bodies; without parsers, batches are parsed
+     * on the thread that asked for them; without a revalidator, shown results
+     * are fetched again on the executor.
+     */
+    std::shared_ptr<ConnectionPool> pool { };
+    std::shared_ptr<TokenProvider> tokens { };
+    std::shared_ptr<SingleFlight> flights { };
+    std::shared_ptr<Executor> executor { };
+    std::shared_ptr<Executor> parsers { };
+    std::shared_ptr<Executor> revalidator { };
+    std::shared_ptr<MetadataStore> metadata { };
+    std::shared_ptr<EmailCache> emails { };
+    std::shared_ptr<BodyCache> bodies { };
+    std::shared_ptr<PageCache> pages { };
+    std::shared_ptr<ResultCache> results { };
+    std::shared_ptr<Prefetcher> prefetcher { };
+
+    /*
+     * Cached values, shared by all clients.  Once they are older than their time
+     * to live, they are still used while a new copy is fetched in the background.
      */
-    std::string users_address { };
-    std::deque<std::pair<std::string, std::string>> labels { };
+    Snapshot<std::string> users_address { std::chrono::seconds(24 * 3600) };
+    Snapshot<std::deque<std::pair<std::string, std::string>>> labels { std::chrono::seconds(600) };
 };
 
 }
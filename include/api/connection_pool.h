@@ -0,0 +1,120 @@
+#ifndef API_CONNECTION_POOL_H_
+#define API_CONNECTION_POOL_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <core/net/http/client.h>
+#include <core/net/http/request.h>
+#include <core/net/http/response.h>
+#include <core/net/uri.h>
+
+namespace api {
+
+/**
+ * A process-wide pool of persistent HTTP connections.
+ *
+ * All requests are run through a single net-cpp client, whose curl multi handle
+ * keeps connections alive between requests.  Consecutive requests to the same host
+ * therefore skip the TCP and TLS handshakes.  The number of requests in flight to
+ * any one host is limited, and the connections are closed once they have been idle
+ * for longer than the idle timeout.
+ *
+ * All methods are thread-safe.
+ */
+class ConnectionPool {
+public:
+    typedef std::shared_ptr<ConnectionPool> Ptr;
+
+    typedef std::function<core::net::http::Request::Progress::Next(
+            const core::net::http::Request::Progress&)> ProgressHandler;
+
+    ConnectionPool(std::size_t max_per_host, std::chrono::seconds idle_timeout);
+
+    ~ConnectionPool();
+
+    /**
+     * Synchronously perform a GET request over a pooled connection.
+     *
+     * Throws core::net::Error if the request fails or is aborted by the progress
+     * handler.
+     */
+    core::net::http::Response get(core::net::http::Request::Configuration configuration,
+                                  const ProgressHandler &progress);
+
+    /**
+     * Synchronously perform a POST request over a pooled connection.
+     */
+    core::net::http::Response post(core::net::http::Request::Configuration configuration,
+                                   const std::string &payload, const std::string &type,
+                                   const ProgressHandler &progress);
+
+    /**
+     * Format a URI, with its components escaped.  This doesn't need a connection,
+     * so it never starts the client that runs the requests.
+     */
+    std::string uri_to_string(const core::net::Uri &uri);
+
+    /**
+     * Close all connections and stop the worker threads.  Any further requests
+     * will throw std::domain_error.
+     */
+    void shutdown();
+
+private:
+    typedef std::function<std::shared_ptr<core::net::http::Request>(
+            core::net::http::Client&)> RequestBuilder;
+
+    core::net::http::Response perform(const std::string &uri, const RequestBuilder &build,
+                                      const ProgressHandler &progress);
+
+    std::shared_ptr<core::net::http::Client> running_client();
+
+    void stop_client(std::unique_lock<std::mutex> &lock);
+
+    void reap();
+
+    const std::size_t max_per_host_;
+
+    const std::chrono::seconds idle_timeout_;
+
+    std::mutex mutex_;
+
+    std::condition_variable cv_;
+
+    /**
+     * The client shared by all requests, and the thread running its event loop
+     */
+    std::shared_ptr<core::net::http::Client> client_;
+
+    std::thread worker_;
+
+    /**
+     * A client that only formats URIs, and is never run
+     */
+    std::shared_ptr<core::net::http::Client> formatter_;
+
+    /**
+     * Requests in flight, per host and in total
+     */
+    std::map<std::string, std::size_t> in_flight_;
+
+    std::size_t active_;
+
+    std::chrono::steady_clock::time_point last_used_;
+
+    std::atomic<bool> stopped_;
+
+    std::thread reaper_;
+};
+
+}
+
+#endif // API_CONNECTION_POOL_H_
@@ -0,0 +1,85 @@
+#ifndef API_EMAIL_CACHE_H_
+#define API_EMAIL_CACHE_H_
+
+#include <api/client.h>
+#include <api/lru_cache.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace api {
+
+/**
+ * Parsed messages and threads, shared by every query, preview, and activation in
+ * the scope, so that looking at something we've just listed doesn't mean fetching
+ * and parsing it again.
+ *
+ * A message is kept under message_key(id) as a list of one.  A thread is kept under
+ * thread_key(id, history_id), so that changes to the thread make it miss.
+ */
+class EmailCache : public LruCache<Client::EmailList> {
+public:
+    typedef std::shared_ptr<EmailCache> Ptr;
+
+    EmailCache(std::size_t budget, std::chrono::seconds ttl);
+
+    static std::string message_key(const std::string &id);
+
+    static std::string thread_key(const std::string &id, const std::string &history_id);
+
+    /**
+     * An estimate of the memory used by a list of messages
+     */
+    static std::size_t size_of(const Client::EmailList &emails);
+};
+
+/**
+ * Messages with their bodies, by id, as fetched for previews.  The prefetcher
+ * fills this ahead of time for the top results of each query.  Bodies never change,
+ * but the labels that come with them do, so clients keep those up to date.
+ */
+class BodyCache : public LruCache<Client::Email> {
+public:
+    typedef std::shared_ptr<BodyCache> Ptr;
+
+    BodyCache(std::size_t budget, std::chrono::seconds ttl);
+
+    static std::size_t size_of(const Client::Email &email);
+};
+
+/**
+ * Later pages of listings, by what was listed and the page token, so that the
+ * prefetcher can fetch the page behind a "More results" card before it's opened.
+ * The first pages aren't kept here, since they change with every new message.
+ */
+class PageCache : public LruCache<Client::Page> {
+public:
+    typedef std::shared_ptr<PageCache> Ptr;
+
+    PageCache(std::size_t budget, std::chrono::seconds ttl);
+
+    static std::string key(bool threads, const std::string &query, const std::string &label_id,
+                           const std::string &token);
+
+    static std::size_t size_of(const Client::Page &page);
+};
+
+/**
+ * What each query last showed, so that going back to it can show the same again
+ * straight away.  The results are kept as a page of messages, by the query, label,
+ * page token, and the view they were shown in.
+ */
+class ResultCache : public LruCache<Client::Page> {
+public:
+    typedef std::shared_ptr<ResultCache> Ptr;
+
+    ResultCache(std::size_t budget, std::chrono::seconds ttl);
+
+    static std::string key(const std::string &query, const std::string &label_id,
+                           const std::string &token, bool threads, bool snippets);
+};
+
+}
+
+#endif // API_EMAIL_CACHE_H_
@@ -0,0 +1,95 @@
+#ifndef API_EXECUTOR_H_
+#define API_EXECUTOR_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace api {
+
+/**
+ * A fixed-size pool of threads for running blocking API calls, shared by all
+ * clients, so that queries can overlap their requests without starting a thread
+ * for each one.
+ *
+ * Threads are started as they're needed, up to the limit; beyond that, jobs wait
+ * their turn.  A job should not wait for another job, since with every thread
+ * waiting, nothing would be left to run what they're waiting for.
+ *
+ * All methods are thread-safe.
+ */
+class Executor {
+public:
+    typedef std::shared_ptr<Executor> Ptr;
+
+    explicit Executor(std::size_t threads);
+
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor &operator=(const Executor&) = delete;
+
+    /**
+     * Run the task on one of our threads, returning a future for its result.  Any
+     * exception the task throws comes out of the future.
+     */
+    template<typename F>
+    std::future<typename std::result_of<F()>::type> submit(F task) {
+        typedef typename std::result_of<F()>::type Result;
+        auto job = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+        std::future<Result> result = job->get_future();
+        post([job]() { (*job)(); });
+        return result;
+    }
+
+    /**
+     * Run the job on one of our threads.  Once we have been shut down, the job
+     * is run right away on the caller's thread.
+     */
+    void post(const std::function<void()> &job);
+
+    /**
+     * Finish the jobs already waiting, and stop the threads.  Called from one of
+     * our own jobs, that job's thread stops once the job returns.
+     */
+    void shutdown();
+
+private:
+    /**
+     * What the threads share with the executor.  A job may drop the last
+     * reference to the executor, so the threads mustn't rely on it outliving
+     * their jobs.
+     */
+    struct State {
+        std::mutex mutex;
+
+        std::condition_variable cv;
+
+        std::deque<std::function<void()>> jobs;
+
+        std::size_t idle;
+
+        bool stopped;
+    };
+
+    static void run(std::shared_ptr<State> state);
+
+    const std::size_t max_threads_;
+
+    std::shared_ptr<State> state_;
+
+    /**
+     * Guarded by the state's mutex
+     */
+    std::vector<std::thread> threads_;
+};
+
+}
+
+#endif // API_EXECUTOR_H_
@@ -0,0 +1,91 @@
+#ifndef API_JSON_READER_H_
+#define API_JSON_READER_H_
+
+#include <cstddef>
+#include <string>
+
+namespace api {
+
+/**
+ * Reads JSON one value at a time, straight out of a response body.
+ *
+ * Instead of building a document, the caller walks through it, reading the
+ * values it wants and skipping the rest without looking inside them.  Objects
+ * are read as
+ *
+ *     if (reader.begin_object())
+ *         while (reader.next_key(key))
+ *             key == "id" ? id = reader.read_string() : reader.skip();
+ *
+ * and arrays likewise with begin_array and next_element.  Each value must be
+ * read or skipped before moving on to the next key or element.
+ *
+ * Malformed input never throws: the reader stops, as if everything it had
+ * yet to read were missing, and reports that it failed.
+ */
+class JsonReader {
+public:
+    JsonReader(const char *data, std::size_t length);
+
+    /**
+     * Enter an object, or skip the value and return false if it isn't one
+     */
+    bool begin_object();
+
+    /**
+     * Read the next key of the object, or leave it and return false at its end
+     */
+    bool next_key(std::string &key);
+
+    /**
+     * Enter an array, or skip the value and return false if it isn't one
+     */
+    bool begin_array();
+
+    /**
+     * Move on to the next element of the array, or leave it and return false
+     * at its end
+     */
+    bool next_element();
+
+    /**
+     * Read a string, unescaped into UTF-8.  Anything else is skipped, and reads
+     * as empty.
+     */
+    std::string read_string();
+
+    void skip();
+
+    bool failed() const;
+
+private:
+    /**
+     * Move past whitespace, returning the next character, or 0 at the end
+     */
+    char peek();
+
+    /**
+     * Consume the given character, if it's next
+     */
+    bool consume(char c);
+
+    /**
+     * Consume the end of an object or array, with any comma before the next
+     * member or element
+     */
+    bool next(char close);
+
+    void read_string(std::string *out);
+
+    void fail();
+
+    const char *pos_;
+
+    const char *end_;
+
+    bool failed_;
+};
+
+}
+
+#endif // API_JSON_READER_H_
@@ -0,0 +1,161 @@
+#ifndef API_LRU_CACHE_H_
+#define API_LRU_CACHE_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace api {
+
+/**
+ * A thread-safe least-recently-used cache with a memory budget.
+ *
+ * The size of each value is estimated by the sizer given to the constructor.
+ * Once the estimates add up to more than the budget, the least recently used
+ * values are dropped.  Values older than the time to live are never returned.
+ */
+template<typename Value>
+class LruCache {
+public:
+    typedef std::function<std::size_t(const Value&)> Sizer;
+
+    LruCache(std::size_t budget, std::chrono::seconds ttl, const Sizer &sizer) :
+        budget_(budget), ttl_(ttl), sizer_(sizer), bytes_(0), hits_(0), misses_(0) {
+    }
+
+    virtual ~LruCache() = default;
+
+    LruCache(const LruCache&) = delete;
+    LruCache &operator=(const LruCache&) = delete;
+
+    /**
+     * Look up a value, marking it as recently used
+     */
+    bool get(const std::string &key, Value &value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = index_.find(key);
+        if (iter == index_.end()) {
+            misses_ += 1;
+            return false;
+        }
+        if (Clock::now() - iter->second->stored > ttl_) {
+            remove(iter);
+            misses_ += 1;
+            return false;
+        }
+        order_.splice(order_.begin(), order_, iter->second);
+        value = iter->second->value;
+        hits_ += 1;
+        return true;
+    }
+
+    /**
+     * Whether a fresh value is there, without counting as a use of it
+     */
+    bool contains(const std::string &key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = index_.find(key);
+        return iter != index_.end() && Clock::now() - iter->second->stored <= ttl_;
+    }
+
+    void put(const std::string &key, const Value &value) {
+        std::size_t bytes = sizer_(value) + key.size();
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = index_.find(key);
+        if (iter != index_.end())
+            remove(iter);
+        // Something that would push everything else out isn't worth keeping
+        if (bytes > budget_)
+            return;
+        order_.push_front({ key, value, bytes, Clock::now() });
+        index_[key] = order_.begin();
+        bytes_ += bytes;
+        while (bytes_ > budget_)
+            remove(index_.find(order_.back().key));
+    }
+
+    void erase(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = index_.find(key);
+        if (iter != index_.end())
+            remove(iter);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        order_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+    /**
+     * Statistics
+     */
+    std::size_t hits() const {
+        return hits_;
+    }
+
+    std::size_t misses() const {
+        return misses_;
+    }
+
+    std::size_t bytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return index_.size();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Node {
+        std::string key;
+        Value value;
+        std::size_t bytes;
+        Clock::time_point stored;
+    };
+
+    typedef std::list<Node> Order;
+
+    typedef std::unordered_map<std::string, typename Order::iterator> Index;
+
+    void remove(typename Index::iterator iter) {
+        bytes_ -= iter->second->bytes;
+        order_.erase(iter->second);
+        index_.erase(iter);
+    }
+
+    mutable std::mutex mutex_;
+
+    std::size_t budget_;
+
+    std::chrono::seconds ttl_;
+
+    Sizer sizer_;
+
+    /**
+     * Most recently used first
+     */
+    Order order_;
+
+    Index index_;
+
+    std::size_t bytes_;
+
+    std::atomic<std::size_t> hits_;
+
+    std::atomic<std::size_t> misses_;
+};
+
+}
+
+#endif // API_LRU_CACHE_H_
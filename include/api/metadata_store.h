@@ -0,0 +1,215 @@
+#ifndef API_METADATA_STORE_H_
+#define API_METADATA_STORE_H_
+
+#include <api/client.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <QByteArray>
+#include <QFile>
+
+namespace api {
+
+/**
+ * A persistent cache of message and thread metadata, so that reopening the scope
+ * doesn't mean fetching everything again.
+ *
+ * Records are appended to a single file, which is memory-mapped for reading.  The
+ * map is only renewed once a megabyte or so has been appended, and records newer
+ * than the map are read from the file.  An in-memory index points at the latest
+ * record for each message and thread.  When the file holds too many superseded or
+ * expired records, it is compacted the next time it is opened.
+ *
+ * Messages are trusted for the time to live, since the only way to find out
+ * whether their labels have changed is to fetch them again.  Threads are trusted
+ * as long as their history id matches the one the list gave.
+ *
+ * Once the store is following the mailbox's history, it also keeps the first
+ * page of each label's listing, and applies the changes from each history delta
+ * to those listings and to the stored messages.  Anything stored while the store
+ * has been following the history is then trusted, for as long as it keeps up.
+ * All methods are thread-safe.
+ */
+class MetadataStore {
+public:
+    typedef std::shared_ptr<MetadataStore> Ptr;
+
+    /**
+     * Open the store at path, creating it if necessary.  If the file can't be used,
+     * the store works, but holds nothing.
+     */
+    MetadataStore(const std::string &path, std::chrono::seconds ttl,
+                  std::chrono::seconds max_age);
+
+    ~MetadataStore();
+
+    MetadataStore(const MetadataStore&) = delete;
+    MetadataStore &operator=(const MetadataStore&) = delete;
+
+    /**
+     * Look up a message, returning false if we don't have a fresh copy
+     */
+    bool get_message(const std::string &id, Client::Email &email);
+
+    void put_messages(const Client::EmailList &emails);
+
+    /**
+     * Look up the messages of a thread, in the order they were stored.  With an
+     * empty history id, the thread is fresh if it was stored within the time to
+     * live.
+     */
+    bool get_thread(const std::string &id, const std::string &history_id,
+                    Client::EmailList &messages);
+
+    void put_thread(const std::string &id, const std::string &history_id,
+                    const Client::EmailList &messages);
+
+    /**
+     * Record new labels for a message we already have, as after modifying it
+     */
+    void set_labels(const std::string &id, const Client::Labels &labels);
+
+    /**
+     * The mailbox history id the store is up to date with, or empty if it isn't
+     * following the history
+     */
+    std::string history_id() const;
+
+    /**
+     * Start following the history from the given history id, forgetting all
+     * listings
+     */
+    void start_sync(const std::string &history_id);
+
+    /**
+     * Apply a history delta from start, which brings us up to the given history
+     * id.  Returns false, dropping the delta, if the store is no longer at start,
+     * as when another client has applied a delta in the meantime.
+     */
+    bool apply(const Client::ChangeList &changes, const std::string &start,
+               const std::string &history_id);
+
+    /**
+     * Stop following the history, as when it has gone too long unfollowed
+     */
+    void stop_sync();
+
+    /**
+     * Look up the ids on the first page of a label's messages or threads, along
+     * with the token for the next page.  These are only kept while following the
+     * history.
+     */
+    bool get_listing(bool threads, const std::string &label_id,
+                     std::deque<std::string> &ids, std::string &next);
+
+    void put_listing(bool threads, const std::string &label_id,
+                     const std::deque<std::string> &ids, const std::string &next);
+
+    std::size_t size() const;
+
+private:
+    struct Entry {
+        qint64 offset;
+        quint32 length;
+        qint64 stored;
+        std::string history_id;
+    };
+
+    typedef std::map<std::string, Entry> Index;
+
+    struct Record {
+        char kind;
+        std::string id;
+        std::string history_id;
+        QByteArray payload;
+        bool deleted;
+    };
+
+    struct Listing {
+        bool threads;
+        std::string label_id;
+        std::deque<std::string> ids;
+        std::string next;
+    };
+
+    /**
+     * Where we are in following the history
+     */
+    struct Sync {
+        std::string history_id;
+        qint64 since;
+        qint64 synced;
+    };
+
+    /**
+     * Open and map the file, and read its records into the index
+     */
+    bool load();
+
+    /**
+     * Rewrite the file with only the records in the index
+     */
+    void compact();
+
+    /**
+     * Write the records to the end of the file, and point the index at them
+     */
+    void append(const std::deque<Record> &records);
+
+    void index(char kind, const std::string &id, const Entry &entry);
+
+    void forget(char kind, const std::string &id);
+
+    Record sync_record() const;
+
+    Record listing_record(const std::string &key, const Listing &listing) const;
+
+    static std::string listing_key(bool threads, const std::string &label_id);
+
+    void remap();
+
+    /**
+     * The payload of a record, from the map if it's covered, or else from the file
+     */
+    QByteArray read(const Entry &entry);
+
+    bool fresh(const Entry &entry, qint64 now) const;
+
+    static qint64 now();
+
+    mutable std::mutex mutex_;
+
+    std::string path_;
+
+    std::chrono::seconds ttl_;
+
+    std::chrono::seconds max_age_;
+
+    QFile file_;
+
+    uchar *map_;
+
+    qint64 mapped_;
+
+    Index messages_;
+
+    Index threads_;
+
+    std::map<std::string, Listing> listings_;
+
+    Sync sync_;
+
+    /**
+     * Bytes in the file belonging to records that are still in the index
+     */
+    qint64 live_;
+};
+
+}
+
+#endif // API_METADATA_STORE_H_
@@ -0,0 +1,73 @@
+#ifndef API_MULTIPART_H_
+#define API_MULTIPART_H_
+
+#include <functional>
+#include <string>
+
+namespace api {
+
+/**
+ * A streaming parser for multipart/mixed batch responses.
+ *
+ * Each part of a batch response wraps an HTTP response, and carries a Content-ID
+ * of the form "<response-N:...>", where N is the index we gave the part in the
+ * request.  The parser works directly on the bytes it is fed, and hands each part
+ * to the handler as soon as the boundary that ends it has been seen.
+ */
+class MultipartParser {
+public:
+    /**
+     * Called with the index from the part's Content-ID (or -1 if it has none), the
+     * HTTP status of the wrapped response, and its body.  The body is only valid
+     * for the duration of the call.
+     */
+    typedef std::function<void(int index, int status, const char *body,
+                               std::size_t length)> PartHandler;
+
+    MultipartParser(const std::string &boundary, const PartHandler &handler);
+
+    /**
+     * Extract the boundary parameter from a Content-Type header value, or return an
+     * empty string if there isn't one.
+     */
+    static std::string boundary_from(const std::string &content_type);
+
+    /**
+     * Feed the next chunk of the response body to the parser.
+     */
+    void feed(const char *data, std::size_t length);
+
+    /**
+     * Signal that the whole body has been fed.
+     */
+    void finish();
+
+private:
+    /**
+     * Dispatch all complete parts in [data, data + length), returning the number of
+     * bytes consumed.
+     */
+    std::size_t consume(const char *data, std::size_t length, bool last);
+
+    void dispatch(const char *data, std::size_t length);
+
+    std::string delimiter_;
+
+    PartHandler handler_;
+
+    /**
+     * Bytes of an incomplete part, held over until the next feed
+     */
+    std::string pending_;
+
+    /**
+     * Whether we've passed the first delimiter, or the closing one
+     */
+    bool started_;
+
+    bool done_;
+};
+
+}
+
+#endif // API_MULTIPART_H_
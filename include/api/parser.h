@@ -0,0 +1,107 @@
+#ifndef API_PARSER_H_
+#define API_PARSER_H_
+
+#include <api/client.h>
+
+#include <cstdint>
+#include <string>
+#include <core/net/uri.h>
+
+#include <QByteArray>
+#include <QString>
+#include <QVariant>
+
+namespace api {
+
+/**
+ * Turning the API's JSON responses into Client data structures.
+ *
+ * These are used by the Client, and are kept apart from it so that they can be
+ * benchmarked on their own.
+ */
+namespace parser {
+
+/**
+ * Undo the HTML escaping that Gmail applies to snippets
+ */
+QString unescape(QString input);
+
+/**
+ * Read an RFC 2822 date into seconds since the epoch and the offset of its time
+ * zone from UTC, in minutes.  Returns false, leaving them alone, if it can't.
+ */
+bool parse_date(const std::string &input, std::int64_t &date, int &offset);
+
+/**
+ * The first mailbox of an address header
+ */
+Client::Contact parse_contact(const QString &contact_string);
+
+/**
+ * The mailboxes of an RFC 5322 address list, with quoted names, comments, groups,
+ * and RFC 2047 encoded words taken into account
+ */
+Client::ContactList parse_contact_list(const QString &contact_string);
+
+/**
+ * Pick the headers we show out of a payload's list of headers
+ */
+Client::Header parse_header(const QVariant &headers);
+
+/**
+ * Decode a base64url text/plain body into HTML, coloring quoted lines
+ */
+std::string decode(const QVariant &encoded);
+
+std::string decode(const QByteArray &encoded);
+
+/**
+ * The first text/plain part of a payload, decoded
+ */
+std::string parse_payload(const QVariant &p);
+
+Client::Labels parse_labels(const QVariant &l);
+
+Client::Email parse_email(const QVariant &i);
+
+/*
+ * These read the JSON of a response directly, without building a document,
+ * and skip everything we don't use.  A malformed or truncated response reads
+ * as an empty message or list.
+ */
+Client::Email parse_email(const QByteArray &json);
+
+/**
+ * The messages of a list, with their ids and thread ids, and the token for the
+ * next page
+ */
+Client::EmailList parse_email_list(const QByteArray &json, std::string &next);
+
+Client::ThreadList parse_thread_list(const QByteArray &json, std::string &next);
+
+/**
+ * The messages of a thread, oldest first, and the thread's history id
+ */
+Client::EmailList parse_thread(const QByteArray &json, std::string &history_id);
+
+/**
+ * Flatten the records of a history response into one change per message
+ */
+Client::ChangeList parse_history(const QVariant &h);
+
+/**
+ * Query parameters asking for just the headers that parse_header looks at
+ */
+core::net::Uri::QueryParameters metadata_params();
+
+/**
+ * Query parameters asking for a message's body and labels.  Previews and the
+ * prefetcher must ask in the same way, so that they can share a request.
+ */
+core::net::Uri::QueryParameters body_params();
+
+}
+
+}
+
+#endif // API_PARSER_H_
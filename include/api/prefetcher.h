@@ -0,0 +1,125 @@
+#ifndef API_PREFETCHER_H_
+#define API_PREFETCHER_H_
+
+#include <api/client.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace api {
+
+/**
+ * Fetches things the user is likely to look at next, in the background.
+ *
+ * Once a query has pushed its results, it hands the ids of the top few to the
+ * prefetcher, so that their previews can show the body straight away.  It also
+ * hands over the page behind its "More results" card, whose listing and metadata
+ * are fetched into the caches, but only while no query or preview is running.  If
+ * one starts, the page is abandoned, and tried again once things are quiet.
+ *
+ * Only the latest query's work is worth doing, so each call replaces whatever of
+ * the same kind is still waiting.  The work is done on a worker thread, with a
+ * client of our own for each job, so that cancelling a query doesn't cancel its
+ * prefetch.
+ */
+class Prefetcher {
+public:
+    typedef std::shared_ptr<Prefetcher> Ptr;
+
+    /**
+     * Marks foreground work, for as long as it exists
+     */
+    class Foreground {
+    public:
+        explicit Foreground(Ptr prefetcher);
+
+        ~Foreground();
+
+        Foreground(const Foreground&) = delete;
+        Foreground &operator=(const Foreground&) = delete;
+
+    private:
+        Ptr prefetcher_;
+    };
+
+    /**
+     * The configuration is copied, without the prefetcher, so that we don't keep
+     * it alive ourselves.
+     */
+    Prefetcher(Config::Ptr config);
+
+    ~Prefetcher();
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher &operator=(const Prefetcher&) = delete;
+
+    /**
+     * Fetch the bodies of these messages, instead of any still waiting
+     */
+    void prefetch(const std::deque<std::string> &ids);
+
+    /**
+     * Fetch a later page of a listing, and the metadata of what's on it, instead
+     * of any page still waiting
+     */
+    void prefetch_page(bool threads, const std::string &query, const std::string &label_id,
+                       const std::string &token);
+
+    /**
+     * Abandon the fetch in progress and stop the worker
+     */
+    void shutdown();
+
+private:
+    struct Page {
+        bool threads;
+        std::string query;
+        std::string label_id;
+        std::string token;
+    };
+
+    void run();
+
+    void fetch_page(Client &client, const Page &page);
+
+    void foreground_started();
+
+    void foreground_finished();
+
+    Config::Ptr config_;
+
+    std::mutex mutex_;
+
+    std::condition_variable cv_;
+
+    std::deque<std::string> pending_;
+
+    std::unique_ptr<Page> page_;
+
+    /**
+     * The client of the job in progress, so that it can be cancelled
+     */
+    std::shared_ptr<Client> current_;
+
+    /**
+     * Whether the job in progress is a page, and whether foreground work has
+     * interrupted it
+     */
+    bool paging_;
+
+    bool interrupted_;
+
+    std::size_t foreground_;
+
+    bool stopped_;
+
+    std::thread worker_;
+};
+
+}
+
+#endif // API_PREFETCHER_H_
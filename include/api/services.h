@@ -0,0 +1,32 @@
+#ifndef API_SERVICES_H_
+#define API_SERVICES_H_
+
+#include <api/config.h>
+
+#include <memory>
+#include <string>
+
+namespace api {
+
+/**
+ * Give the configuration everything its clients share: the connection pool,
+ * access tokens, executors, in-flight requests, caches, metadata store and
+ * prefetcher.  The scope is wired up this way when it starts, and the
+ * benchmarks wire themselves up the same way.
+ *
+ * Access tokens come from the given provider, or from Online Accounts if it is
+ * null.  The metadata store is kept at store_path; with an empty path, or one
+ * that can't be opened, there is no store.
+ */
+void start_services(Config::Ptr config, std::shared_ptr<TokenProvider> tokens,
+                    const std::string &store_path);
+
+/**
+ * Shut down and let go of everything start_services made, starting with what
+ * may be using the rest
+ */
+void stop_services(Config::Ptr config);
+
+}
+
+#endif // API_SERVICES_H_
@@ -0,0 +1,105 @@
+#ifndef API_SINGLE_FLIGHT_H_
+#define API_SINGLE_FLIGHT_H_
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <QByteArray>
+
+namespace api {
+
+/**
+ * Coalesces concurrent fetches of the same resource.
+ *
+ * Overlapping queries and previews often ask for the same thing at the same time.
+ * Each caller takes a Ticket for the canonical URI of what it wants.  The first
+ * caller for a URI becomes the leader: it makes the request and publishes the
+ * body of the response, unparsed.  Everyone else who asks before it is done just
+ * waits for that.  Each caller can still be cancelled on its own, and the leader
+ * should only abort the shared request once every caller has been cancelled.
+ */
+class SingleFlight {
+    struct Flight;
+
+public:
+    typedef std::shared_ptr<SingleFlight> Ptr;
+
+    class Ticket {
+    public:
+        Ticket(SingleFlight &flights, const std::string &key, const std::atomic<bool> &cancelled);
+
+        ~Ticket();
+
+        Ticket(const Ticket&) = delete;
+        Ticket &operator=(const Ticket&) = delete;
+
+        /**
+         * Whether we must make the request ourselves
+         */
+        bool leader() const;
+
+        /**
+         * Whether everyone waiting for this result has been cancelled
+         */
+        bool abandoned() const;
+
+        /**
+         * Hand the result of the request to everyone waiting for it (leader only)
+         */
+        void publish(const QByteArray &result);
+
+        void fail(std::exception_ptr error);
+
+        /**
+         * Whether the result is in, so that waiting for it won't block
+         */
+        bool ready() const;
+
+        /**
+         * Wait for the result, unless we are cancelled first, in which case this
+         * returns false.  Rethrows any exception the leader failed with.
+         */
+        bool wait(QByteArray &result);
+
+    private:
+        SingleFlight &flights_;
+
+        std::string key_;
+
+        const std::atomic<bool> &cancelled_;
+
+        std::shared_ptr<Flight> flight_;
+
+        bool leader_;
+
+        bool done_;
+    };
+
+private:
+    struct Flight {
+        std::promise<QByteArray> promise;
+
+        std::shared_future<QByteArray> result;
+
+        /**
+         * The cancelled flags of everyone waiting on this flight
+         */
+        std::deque<const std::atomic<bool>*> waiters;
+    };
+
+    void land(const std::string &key, const std::shared_ptr<Flight> &flight);
+
+    mutable std::mutex mutex_;
+
+    std::map<std::string, std::shared_ptr<Flight>> flights_;
+};
+
+}
+
+#endif // API_SINGLE_FLIGHT_H_
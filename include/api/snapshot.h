@@ -0,0 +1,97 @@
+#ifndef API_SNAPSHOT_H_
+#define API_SNAPSHOT_H_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+namespace api {
+
+/**
+ * A value shared between threads, which is replaced whole rather than modified.
+ *
+ * Each new version is built privately and then published with an atomic pointer
+ * swap, so readers never wait for a refresh and never see a half-built value.
+ * Anyone still holding an old version keeps it until they let go.  A version older
+ * than the time to live is stale: it can still be used, but somebody should claim
+ * the refresh and publish a new one.
+ *
+ * Copies share the same value, so a copied Config still sees what's published.
+ */
+template<typename T>
+class Snapshot {
+public:
+    typedef std::shared_ptr<const T> Ptr;
+
+    explicit Snapshot(std::chrono::seconds ttl) : state_(std::make_shared<State>(ttl)) {
+    }
+
+    /**
+     * The latest version, or null if nothing has been published
+     */
+    Ptr get() const {
+        std::shared_ptr<const Version> version = std::atomic_load(&state_->current);
+        if (!version)
+            return Ptr();
+        return Ptr(version, &version->value);
+    }
+
+    /**
+     * Whether there is no version, or it is older than the time to live
+     */
+    bool stale() const {
+        std::shared_ptr<const Version> version = std::atomic_load(&state_->current);
+        return !version || Clock::now() - version->published > state_->ttl;
+    }
+
+    void publish(const T &value) {
+        std::shared_ptr<const Version> version =
+                std::make_shared<const Version>(Version { value, Clock::now() });
+        std::atomic_store(&state_->current, version);
+    }
+
+    /**
+     * Drop the current version, so that the next reader fetches a new one
+     */
+    void clear() {
+        std::atomic_store(&state_->current, std::shared_ptr<const Version>());
+    }
+
+    /**
+     * Claim the job of refreshing the value, returning false if somebody else
+     * already has it.  Whoever claims it must release it.
+     */
+    bool claim() {
+        bool expected = false;
+        return state_->refreshing.compare_exchange_strong(expected, true);
+    }
+
+    void release() {
+        state_->refreshing = false;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Version {
+        T value;
+        Clock::time_point published;
+    };
+
+    struct State {
+        explicit State(std::chrono::seconds ttl) : ttl(ttl), refreshing(false) {
+        }
+
+        const std::chrono::seconds ttl;
+
+        std::shared_ptr<const Version> current;
+
+        std::atomic<bool> refreshing;
+    };
+
+    std::shared_ptr<State> state_;
+};
+
+}
+
+#endif // API_SNAPSHOT_H_
@@ -0,0 +1,92 @@
+#ifndef API_TOKEN_PROVIDER_H_
+#define API_TOKEN_PROVIDER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace api {
+
+/**
+ * A thread-safe cache of the OAuth access token.
+ *
+ * Looking up the token goes through Online Accounts over D-Bus, so we only do it
+ * when the cached token is about to expire, or when the server has told us, with a
+ * 401, that it is no longer good.  Online Accounts doesn't tell us how long the
+ * token is valid for, so we assume a conservative lifetime from when we first see
+ * it.  While the token is in use, a background thread fetches a new one shortly
+ * before the old one expires, so requests should never have to wait for one.
+ */
+class TokenProvider {
+public:
+    typedef std::shared_ptr<TokenProvider> Ptr;
+
+    TokenProvider(std::chrono::seconds lifetime, std::chrono::seconds refresh_margin);
+
+    virtual ~TokenProvider();
+
+    /**
+     * Return a valid access token, blocking only if we don't have one.
+     *
+     * Throws std::runtime_error if there is no authenticated account.
+     */
+    std::string token();
+
+    /**
+     * Forget the given token, if it's still the one we have.
+     */
+    void invalidate(const std::string &token);
+
+protected:
+    /**
+     * Get a fresh token from Online Accounts.
+     */
+    virtual std::string fetch();
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    void update(std::unique_lock<std::mutex> &lock);
+
+    void run();
+
+    const std::chrono::seconds lifetime_;
+
+    const std::chrono::seconds refresh_margin_;
+
+    std::mutex mutex_;
+
+    std::condition_variable cv_;
+
+    std::string token_;
+
+    /**
+     * The token we last fetched, even if it has since been invalidated
+     */
+    std::string fetched_;
+
+    clock::time_point expires_;
+
+    /**
+     * When the background thread next fetches the token
+     */
+    clock::time_point refresh_;
+
+    /**
+     * Whether the token has been handed out since the last background fetch
+     */
+    bool used_;
+
+    bool fetching_;
+
+    bool stopped_;
+
+    std::thread refresher_;
+};
+
+}
+
+#endif // API_TOKEN_PROVIDER_H_
@@ -2,6 +2,7 @@
 #define SCOPE_QUERY_H_
 
 #include <api/client.h>
+#include <scope/scheduler.h>
 
 #include <unity/scopes/SearchQueryBase.h>
 #include <unity/scopes/ReplyProxyFwd.h>
@@ -18,20 +19,57 @@ namespace scope {
 class Query: public unity::scopes::SearchQueryBase {
 public:
     Query(const unity::scopes::CannedQuery &query,
-          const unity::scopes::SearchMetadata &metadata, api::Config::Ptr config);
+          const unity::scopes::SearchMetadata &metadata, api::Config::Ptr config,
+          Scheduler::Ptr scheduler = Scheduler::Ptr());
 
-    ~Query() = default;
+    ~Query();
 
     void cancelled() override;
 
     void run(const unity::scopes::SearchReplyProxy &reply) override;
 
-private:
-    void init_scope();
+protected:
+    /**
+     * Read the user's settings; the benchmarks override this to set them directly.
+     */
+    virtual void init_scope();
 
     bool thread_messages;
     bool show_snippets;
+
+    /**
+     * Push placeholders for results whose details we don't have yet, instead of
+     * waiting for them
+     */
+    bool show_skeletons;
+
+    /**
+     * While a search waits for the user to stop typing, show what the last search
+     * found that also matches this one.  Since results can't be taken back once
+     * pushed, these may include messages the server wouldn't have matched.
+     */
+    bool show_refined;
+
+    /**
+     * How many of the top results to fetch the bodies of in the background
+     */
+    std::size_t prefetch_count;
+
+    /**
+     * Whether to fetch the next page in the background
+     */
+    bool prefetch_pages;
+
+private:
+    void register_departments(const unity::scopes::SearchReplyProxy &reply,
+                              const api::Client::LabelList &labels);
+
     api::Client client_;
+
+    /**
+     * Set only for searches typed into the dash
+     */
+    Scheduler::Ptr scheduler_;
 };
 
 }
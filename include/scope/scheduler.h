@@ -0,0 +1,122 @@
+#ifndef SCOPE_SCHEDULER_H_
+#define SCOPE_SCHEDULER_H_
+
+#include <api/client.h>
+
+#include <unity/scopes/CannedQuery.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace scope {
+
+class Query;
+
+/**
+ * Keeps the searches typed into the dash from piling up.
+ *
+ * Each keystroke makes a new search.  When one arrives, the searches before it
+ * are cancelled, which aborts their requests straight away.  A search that comes
+ * within the debounce delay of the one before it is part of a burst of typing, so
+ * it waits out the delay before going to the network, and gives up if another
+ * keystroke comes in meanwhile.  Any other search, like the first keystroke or
+ * one opened from a preview, goes straight ahead.  While it waits, a search can
+ * show those results of the last finished search that also match what has been
+ * typed since.
+ *
+ * Only searches are scheduled; browsing departments, threads, and further pages
+ * is left alone.  All methods are thread-safe.
+ */
+class Scheduler {
+public:
+    typedef std::shared_ptr<Scheduler> Ptr;
+
+    Scheduler(std::chrono::milliseconds debounce);
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler &operator=(const Scheduler&) = delete;
+
+    /**
+     * Whether a query is a search typed by the user
+     */
+    static bool is_search(const unity::scopes::CannedQuery &query);
+
+    /**
+     * Start scheduling a search, cancelling the ones it supersedes
+     */
+    void add(Query *query);
+
+    /**
+     * Stop scheduling a search, as when it is destroyed
+     */
+    void remove(Query *query);
+
+    /**
+     * Wait out the debounce delay, if the search came in the middle of typing.
+     * Returns false if a newer search came in, in which case this one shouldn't
+     * bother with the network.
+     */
+    bool settle(Query *query);
+
+    /**
+     * Remember what a search found, for the searches that refine it
+     */
+    void remember(const std::string &query, const std::string &label_id, bool threads,
+                  const api::Client::EmailList &messages);
+
+    /**
+     * Those results of the last search that match a query which extends it, or
+     * nothing if it doesn't.  This only checks the text the results show, so the
+     * server may not agree on all of them.
+     */
+    api::Client::EmailList refine(const std::string &query, const std::string &label_id,
+                                  bool threads) const;
+
+private:
+    /**
+     * Whether a newer search has been added since this one
+     */
+    bool superseded(Query *query) const;
+
+    struct Search {
+        Query *query;
+
+        /**
+         * Whether it came within the debounce delay of the search before it
+         */
+        bool typing;
+    };
+
+    struct Last {
+        std::string query;
+        std::string label_id;
+        bool threads;
+        api::Client::EmailList messages;
+    };
+
+    mutable std::mutex mutex_;
+
+    std::condition_variable changed_;
+
+    std::chrono::milliseconds debounce_;
+
+    /**
+     * The searches in the order they came in
+     */
+    std::deque<Search> searches_;
+
+    /**
+     * When the last search came in
+     */
+    std::chrono::steady_clock::time_point added_;
+
+    Last last_;
+};
+
+}
+
+#endif // SCOPE_SCHEDULER_H_
@@ -2,6 +2,7 @@
 #define SCOPE_SCOPE_H_
 
 #include <api/config.h>
+#include <scope/scheduler.h>
 
 #include <unity/scopes/ScopeBase.h>
 #include <unity/scopes/QueryBase.h>
@@ -58,6 +59,11 @@ public:
 
 protected:
     api::Config::Ptr config_;
+
+    /**
+     * Debounces the searches typed into the dash
+     */
+    Scheduler::Ptr scheduler_;
 };
 
 }
@@ -5,177 +5,88 @@
  */
 
 #include <api/client.h>
+#include <api/email_cache.h>
+#include <api/metadata_store.h>
+#include <api/multipart.h>
+#include <api/parser.h>
 #include <trojita/Encoders.h>
 
-#include <unity/scopes/OnlineAccountClient.h>
-
 #include <core/net/error.h>
-#include <core/net/http/client.h>
 #include <core/net/http/content_type.h>
+#include <core/net/http/header.h>
 #include <core/net/http/response.h>
 #include <QVariantMap>
-#include <QRegularExpression>
-#include <QCryptographicHash>
-#include <QDateTime>
 
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <strings.h>
 
 namespace http = core::net::http;
 namespace net = core::net;
-namespace sc = unity::scopes;
 
 using namespace api;
+using namespace api::parser;
+
+namespace {
 
 /**
- * Utility functions for parsing the JSON response
+ * Give up following the history when a delta runs to more pages than this
  */
-namespace {
+const int MAX_HISTORY_PAGES = 4;
 
-static QString unescape(QString input) {
-    return input.replace("&quot;", "\"").replace("&#39;", "'").replace("&gt;", ">")
-            .replace("&lt;", "<").replace("&amp;", "&");
-}
-
-static QString parse_time(QString input) {
-    QDateTime email = QDateTime::fromString(input, Qt::RFC2822Date).toLocalTime();
-    if (!email.isValid())
-        return input;
-    return email.toString(TIME_FMT.c_str());
-}
-
-static Client::Contact parse_contact(const QString &contact_string) {
-    Client::Contact contact;
-    QString address;
-    QRegularExpression regex("\"?(.*?)\"? <(.*)>");
-    QRegularExpressionMatch match = regex.match(contact_string);
-    if (match.hasMatch()) {
-        contact.name = match.captured(1).toStdString();
-        address = match.captured(2);
-    } else {
-        contact.name = contact_string.toStdString();
-        address = contact_string;
-    }
-    contact.address = address.toStdString();
-    std::string hash = QCryptographicHash::hash(address.trimmed().toLower().toUtf8(),
-                                                QCryptographicHash::Algorithm::Md5).toHex().constData();
-    contact.gravatar = "https://secure.gravatar.com/avatar/" + hash + "?d=identicon";
-    return contact;
-}
-
-static Client::ContactList parse_contact_list(const QString &contact_string) {
-    Client::ContactList contacts;
-    for (const QString &contact : contact_string.split(", "))
-        contacts.emplace_back(parse_contact(contact));
-    return contacts;
-}
-
-static Client::Header parse_header(const QVariant &headers) {
-    QVariantList header_list = headers.toList();
-    Client::Header header;
-    for (const QVariant &i : header_list) {
-        QVariantMap item = i.toMap();
-        std::string name = item["name"].toString().toStdString();
-        QString value = item["value"].toString();
-
-        if (name == "Date")
-            header.date = parse_time(value).toStdString();
-        else if (name == "From")
-            header.from = parse_contact(value);
-        else if (name == "To")
-            header.to = parse_contact_list(value);
-        else if (name == "Cc")
-            header.cc = parse_contact_list(value);
-        else if (name == "Reply-To")
-            header.replyto = parse_contact(value);
-        else if (name == "Subject")
-            header.subject = value.toStdString();
-        else if (name == "Message-ID" || name == "Message-Id")
-            header.messageId = value.toStdString();
-    }
-    return header;
-}
-
-static std::string decode(const QVariant &encoded) {
-    QByteArray decoded = QByteArray::fromBase64(encoded.toByteArray(), QByteArray::Base64UrlEncoding);
-    QList<QByteArray> lines = decoded.replace("\r\n", "\n").split('\n');
-    std::stringstream ss;
-    bool continued = false;
-    int quote_level = 0;
-    const std::string colors[] = { "#9a5d9a", "#7474a7", "#3f8c8c", "#4c914c", "#818115", "#9f6666" };
-    for (QByteArray &line : lines) {
-        int i = 0;
-        while (i < line.length() && line.at(i) == '>')
-            i += 1;
-        if (continued && quote_level != i)
-            ss << "<br>";
-        while (quote_level < i) {
-            ss << "<font color='" << colors[quote_level % 6] << "'>";
-            quote_level += 1;
-        }
-        while (quote_level > i) {
-            ss << "</font>";
-            quote_level -= 1;
-        }
-        if (i < line.length() && line.at(i) == ' ')
-            i += 1;
-        ss << line.remove(0, i).constData();
-        continued = (line.endsWith(" ") && line != "-- ");
-        if (!continued)
-            ss << "<br>";
-    }
-    while (quote_level > 0) {
-        ss << "</font>";
-        quote_level -= 1;
-    }
-
-    // Remove extra blank lines from end
-    std::string value = ss.str();
-    size_t n = value.length();
-    while (n > 4 && value.substr(n - 4, 4) == "<br>")
-        n -= 4;
-    return value.substr(0, n);
-}
-
-static std::string parse_payload(const QVariant &p) {
-    QVariantMap payload = p.toMap();
-    if (payload["mimeType"].toString().startsWith("multipart")) {
-        QVariantList parts = payload["parts"].toList();
-        for (const QVariant &part : parts) {
-            std::string body = parse_payload(part);
-            if (body != "")
-                return body;
-        }
-    } else if (payload["mimeType"] == "text/plain") {
-        return decode(payload["body"].toMap()["data"]);
-    }
-    return "";
+/**
+ * The services every client shares.  Making its own would start threads of
+ * its own, so a client without them is a mistake.
+ */
+template<typename T>
+static std::shared_ptr<T> require(const std::shared_ptr<T> &service, const char *name) {
+    if (!service)
+        throw std::logic_error(std::string("Client needs a shared ") + name);
+    return service;
 }
 
-static Client::Labels parse_labels(const QVariant &l) {
-    QVariantList labelids = l.toList();
-    Client::Labels labels;
-    for (const QVariant &i : labelids)
-        labels.emplace_back(i.toString().toStdString());
-    return labels;
+/**
+ * How the parts of a batch are parsed
+ */
+static Client::Email parse_message(const QByteArray &json) {
+    return parse_email(json);
 }
 
-static Client::Email parse_email(const QVariant &i) {
-    QVariantMap item = i.toMap();
-    Client::Email message;
-    message.id = item["id"].toString().toStdString();
-    message.threadId = item["threadId"].toString().toStdString();
-    message.snippet = unescape(item["snippet"].toString()).toStdString();
-    message.header = parse_header(item["payload"].toMap()["headers"]);
-    message.body = parse_payload(item["payload"]);
-    message.labels = parse_labels(item["labelIds"]);
-    return message;
+/**
+ * A thread's history id and messages
+ */
+typedef std::pair<std::string, Client::EmailList> ParsedThread;
+
+static ParsedThread parse_thread_history(const QByteArray &json) {
+    ParsedThread parsed;
+    parsed.second = parse_thread(json, parsed.first);
+    return parsed;
 }
 
-static net::Uri::QueryParameters metadata_params() {
-    net::Uri::QueryParameters params = { { "format", "metadata" } };
-    for (std::string header : { "Date", "From", "To", "Cc", "Reply-To", "Subject", "Message-ID", "Message-Id" })
-        params.emplace_back("metadataHeaders", header);
-    return params;
+/**
+ * The boundary of a multipart response, from its Content-Type header if we can find
+ * it, and otherwise from its first line.
+ */
+static std::string response_boundary(const http::Response &response) {
+    std::string boundary;
+    response.header.enumerate([&boundary](const std::string &key,
+                                          const std::set<std::string> &values) {
+        if (strcasecmp(key.c_str(), "Content-Type") == 0 && !values.empty())
+            boundary = MultipartParser::boundary_from(*values.begin());
+    });
+    if (boundary.empty()) {
+        const std::string &body = response.body;
+        size_t eol = body.find_first_of("\r\n");
+        if (body.compare(0, 2, "--") == 0 && eol != std::string::npos)
+            boundary = body.substr(2, eol - 2);
+    }
+    return boundary;
 }
 
 /**
@@ -217,97 +128,218 @@ void add_rfc822_body(QByteArray& message, const std::string body){
  * Client class
  */
 Client::Client(Config::Ptr config) :
-    config_(config), cancelled_(false) {
+    config_(config),
+    pool_(require(config->pool, "connection pool")),
+    tokens_(require(config->tokens, "token provider")),
+    flights_(require(config->flights, "single flight")),
+    executor_(require(config->executor, "executor")),
+    parsers_(config->parsers),
+    metadata_(config->metadata),
+    emails_(config->emails),
+    bodies_(config->bodies),
+    pages_(config->pages),
+    results_(config->results),
+    cancelled_(false),
+    failed_(false),
+    jobs_(0) {
 }
 
-void Client::get(const net::Uri::Path &path,
-                 const net::Uri::QueryParameters &parameters, QJsonDocument &root) {
-    // Create a new HTTP client
-    auto client = http::make_client();
+Client::~Client() {
+    // Those that haven't started yet give up straight away
+    cancel();
+    std::unique_lock<std::mutex> lock(jobs_mutex_);
+    jobs_done_.wait(lock, [this]() { return jobs_ == 0; });
+}
 
-    // Start building the request configuration
-    http::Request::Configuration configuration;
+http::Response Client::execute(const std::string &uri, const std::string &payload,
+                               const std::string &content_type,
+                               const ConnectionPool::ProgressHandler &progress) {
+    for (int attempt = 0; ; attempt++) {
+        // Start building the request configuration
+        http::Request::Configuration configuration;
+        configuration.uri = uri;
+
+        std::string token = access_token();
+        configuration.header.add("Authorization", "Bearer " + token);
+        configuration.header.add("User-Agent", config_->user_agent);
+
+        // Synchronously make the HTTP request over a pooled connection
+        http::Response response;
+        if (content_type.empty()) {
+            response = pool_->get(configuration, progress);
+        } else {
+            configuration.header.add("Content-Type", content_type);
+            response = pool_->post(configuration, payload,
+                                   content_type.substr(0, content_type.find(';')), progress);
+        }
 
-    // Build the URI from its components
-    net::Uri uri = net::make_uri(config_->apidomain + config_->apiroot, path, parameters);
-    configuration.uri = client->uri_to_string(uri);
+        std::cerr << configuration.uri << std::endl;
 
-    configuration.header.add("Authorization", "Bearer " + access_token());
-    configuration.header.add("User-Agent", config_->user_agent);
+        // The token was revoked or expired early, so get a new one and try once more
+        if (response.status == http::Status::unauthorized && attempt == 0) {
+            tokens_->invalidate(token);
+            continue;
+        }
+        return response;
+    }
+}
 
-    // Build a HTTP request object from our configuration
-    auto request = client->head(configuration);
+void Client::get(const net::Uri::Path &path,
+                 const net::Uri::QueryParameters &parameters, QByteArray &json) {
+    // Build the URI from its components
+    net::Uri uri = net::make_uri(config_->apidomain + config_->apiroot, path, parameters);
+    std::string uri_string = pool_->uri_to_string(uri);
+
+    // If somebody is already getting this, wait for their result instead
+    SingleFlight::Ticket ticket(*flights_, uri_string, cancelled_);
+    if (!ticket.leader()) {
+        ticket.wait(json);
+        if (json.isEmpty())
+            failed_ = true;
+        return;
+    }
 
     try {
-        // Synchronously make the HTTP request
-        // We bind the cancellable callback to #progress_report
-        auto response = request->execute(
-                    std::bind(&Client::progress_report, this, std::placeholders::_1));
-
-        std::cerr << configuration.uri << std::endl;
+        // Only give up on the request once everyone waiting for it has been cancelled
+        auto response = execute(uri_string, "", "",
+                                [&ticket](const http::Request::Progress&) {
+            return ticket.abandoned() ? http::Request::Progress::Next::abort_operation :
+                                        http::Request::Progress::Next::continue_operation;
+        });
 
         // Check that we got a sensible HTTP status code
         if (response.status != http::Status::ok) {
             throw std::domain_error(response.body);
         }
-        // Parse the JSON from the response
-        root = QJsonDocument::fromJson(response.body.c_str());
+        json = QByteArray(response.body.data(), response.body.size());
 
     } catch (net::Error &) {
+        failed_ = true;
+    } catch (...) {
+        ticket.fail(std::current_exception());
+        throw;
     }
+    ticket.publish(json);
 }
 
-void Client::post(const net::Uri::Path& path, const net::Uri::QueryParameters& parameters,
-                  const std::string& payload, QJsonDocument& root) {
-    // Create a new HTTP client
-    auto client = http::make_client();
-
-    // Start building the request configuration
-    http::Request::Configuration configuration;
+void Client::get(const net::Uri::Path &path,
+                 const net::Uri::QueryParameters &parameters, QJsonDocument &root) {
+    QByteArray json;
+    get(path, parameters, json);
+    root = QJsonDocument::fromJson(json);
+}
 
+void Client::post(const net::Uri::Path& path, const net::Uri::QueryParameters& parameters,
+                  const std::string& payload, QByteArray& json) {
     // Build the URI from its components
     net::Uri uri = net::make_uri(config_->apidomain + config_->apiroot, path, parameters);
-    configuration.uri = client->uri_to_string(uri);
-
-    configuration.header.add("Authorization", "Bearer " + access_token());
-    configuration.header.add("User-Agent", config_->user_agent);
-    configuration.header.add("Content-Type", "application/json");
-
-    // Build a HTTP request object from our configuration
-    auto request = client->post(configuration, payload, "application/json");
 
     try {
-        // Synchronously make the HTTP request
         // We bind the cancellable callback to #progress_report
-        auto response = request->execute(
-                    std::bind(&Client::progress_report, this, std::placeholders::_1));
-
-        std::cerr << configuration.uri << std::endl;
+        auto response = execute(pool_->uri_to_string(uri), payload, "application/json",
+                                std::bind(&Client::progress_report, this, std::placeholders::_1));
 
         // Check that we got a sensible HTTP status code
         if (response.status != http::Status::ok) {
             throw std::domain_error(response.body);
         }
-        // Parse the JSON from the response
-        root = QJsonDocument::fromJson(response.body.c_str());
+        json = QByteArray(response.body.data(), response.body.size());
 
     } catch (net::Error &) {
+        failed_ = true;
     }
 }
 
+void Client::post(const net::Uri::Path& path, const net::Uri::QueryParameters& parameters,
+                  const std::string& payload, QJsonDocument& root) {
+    QByteArray json;
+    post(path, parameters, payload, json);
+    root = QJsonDocument::fromJson(json);
+}
+
+template<typename T>
 void Client::batch_get(const net::Uri::Path &path, const net::Uri::QueryParameters &parameters,
-                       const std::deque<std::string> &ids, QVariantList &results) {
-    // Create a new HTTP client
-    auto client = http::make_client();
+                       const std::deque<std::string> &ids,
+                       const std::function<T(const QByteArray&)> &parse,
+                       const std::function<void(const std::string&, const T&)> &on_result) {
+    // Each id is coalesced with any other request for the same resource, so we only
+    // need to fetch those nobody else is already getting.
+    std::deque<std::unique_ptr<SingleFlight::Ticket>> tickets;
+    std::deque<std::string> leading_ids;
+    std::deque<SingleFlight::Ticket*> leading_tickets;
+    for (const std::string &id : ids) {
+        net::Uri::Path p(path);
+        p.emplace_back(id);
+        net::Uri uri = net::make_uri(config_->apidomain + config_->apiroot, p, parameters);
+        tickets.emplace_back(new SingleFlight::Ticket(*flights_, pool_->uri_to_string(uri),
+                                                      cancelled_));
+        if (tickets.back()->leader()) {
+            leading_ids.emplace_back(id);
+            leading_tickets.emplace_back(tickets.back().get());
+        }
+    }
 
-    // Start building the request configuration
-    http::Request::Configuration configuration;
-    configuration.uri = config_->apidomain + "/batch";
+    // Split the rest into sub-batches, and send them off all at once.  The connection
+    // pool limits how many of them are actually in flight at a time.
+    std::size_t batch_size = config_->batch_size > 0 ? config_->batch_size : ids.size();
+    std::deque<std::future<void>> parts;
+    for (std::size_t start = 0; start < leading_ids.size(); start += batch_size) {
+        std::size_t stop = std::min(start + batch_size, leading_ids.size());
+        std::deque<std::string> sub_ids(leading_ids.begin() + start, leading_ids.begin() + stop);
+        std::deque<SingleFlight::Ticket*> sub_tickets(leading_tickets.begin() + start,
+                                                      leading_tickets.begin() + stop);
+        parts.emplace_back(std::async(std::launch::async,
+                                      [this, &path, &parameters, sub_ids, sub_tickets]() {
+            batch_get_part(path, parameters, sub_ids, sub_tickets);
+        }));
+    }
+    // Parse each result, ours or others', once it has arrived.  The parse jobs only
+    // get a copy of the JSON, so they never wait on anything, and may outlive us.
+    std::vector<std::future<T>> parsed(tickets.size());
+    auto start = [&](std::size_t i) {
+        QByteArray json;
+        if (!tickets[i]->wait(json) || json.isEmpty()) {
+            json.clear();
+            failed_ = true;
+        }
+        if (parsers_) {
+            parsed[i] = parsers_->submit([parse, json]() {
+                return parse(json);
+            });
+        } else {
+            std::promise<T> result;
+            result.set_value(parse(json));
+            parsed[i] = result.get_future();
+        }
+    };
+
+    // Hand over the results in the original order.  Each ticket is published as soon
+    // as its sub-batch has arrived, so the first results go out while the later
+    // sub-batches are still on their way.  If a handler throws, the futures'
+    // destructors still wait for the sub-batches, which refer to our arguments.
+    for (std::size_t i = 0; i < tickets.size(); i++) {
+        // Let the parsers work ahead on everything that's in, while we wait
+        if (parsers_) {
+            for (std::size_t j = i; j < tickets.size(); j++) {
+                if (!parsed[j].valid() && tickets[j]->ready())
+                    start(j);
+            }
+        }
+        if (!parsed[i].valid())
+            start(i);
+        on_result(ids[i], parsed[i].get());
+    }
 
+    // Any errors have been passed on to their tickets
+    for (std::future<void> &part : parts)
+        part.wait();
+}
+
+void Client::batch_get_part(const net::Uri::Path &path,
+                            const net::Uri::QueryParameters &parameters,
+                            const std::deque<std::string> &ids,
+                            const std::deque<SingleFlight::Ticket*> &tickets) {
     std::string boundary = "batch_boundary_fnord";
-    configuration.header.add("Authorization", "Bearer " + access_token());
-    configuration.header.add("User-Agent", config_->user_agent);
-    configuration.header.add("Content-Type", "multipart/mixed; boundary=" + boundary);
 
     std::stringstream ss;
     int i = 0;
@@ -318,153 +350,354 @@ void Client::batch_get(const net::Uri::Path &path, const net::Uri::QueryParamete
         net::Uri::Path p(path);
         p.emplace_back(id);
         net::Uri uri = net::make_uri(config_->apiroot, p, parameters);
-        ss << "GET " << client->uri_to_string(uri) << "\n\n";
+        ss << "GET " << pool_->uri_to_string(uri) << "\n\n";
         i += 1;
     }
     ss << "--" << boundary << "--\n";
 
-    // Build a HTTP request object from our configuration
-    auto request = client->post(configuration, ss.str(), "multipart/mixed");
-
     try {
-        // Synchronously make the HTTP request
-        // We bind the cancellable callback to #progress_report
-        auto response = request->execute(
-                    std::bind(&Client::progress_report, this, std::placeholders::_1));
-
-        std::cerr << configuration.uri << std::endl;
+        // Only give up on the request once everyone waiting for any of its parts has
+        // been cancelled
+        auto response = execute(config_->apidomain + "/batch", ss.str(),
+                                "multipart/mixed; boundary=" + boundary,
+                                [&tickets](const http::Request::Progress&)
+                                        -> http::Request::Progress::Next {
+            for (SingleFlight::Ticket *ticket : tickets) {
+                if (!ticket->abandoned())
+                    return http::Request::Progress::Next::continue_operation;
+            }
+            return http::Request::Progress::Next::abort_operation;
+        });
 
         // Check that we got a sensible HTTP status code
         if (response.status != http::Status::ok) {
             throw std::domain_error(response.body);
         }
 
-        QString response_body(response.body.c_str());
-        // Is there no way to inspect the header?  We assume that the first line is a boundary marker.
-        QString boundary = response_body.section("\r\n", 0, 0);
-        QStringList response_parts = response_body.split(boundary);
-        // We assume the parts come back in the same order.  This isn't guaranteed.  We could look
-        // at the Content-ID of each part, in which is embedded the index of the original message.
-        // But for right now, this seems to work.
-        for (const QString part : response_parts) {
-            QString payload = part.section("\r\n\r\n", 2, -1);
-            if (payload != "") {
-                QJsonDocument root = QJsonDocument::fromJson(payload.toUtf8());
-                results.append(root.toVariant());
-            }
-        }
+        // The parts may come back in any order, so we match each one to its ticket by
+        // the index embedded in its Content-ID.
+        MultipartParser parser(response_boundary(response),
+                               [&tickets](int index, int status, const char *body, std::size_t length) {
+            if (index < 0 || static_cast<std::size_t>(index) >= tickets.size() ||
+                    status != static_cast<int>(http::Status::ok))
+                return;
+            // Copied, since the response goes away before the waiters parse it
+            tickets[index]->publish(QByteArray(body, length));
+        });
+        parser.feed(response.body.data(), response.body.size());
+        parser.finish();
 
     } catch (net::Error &) {
+    } catch (...) {
+        for (SingleFlight::Ticket *ticket : tickets)
+            ticket->fail(std::current_exception());
     }
+
+    // Anything that didn't come back is published as empty
+    for (SingleFlight::Ticket *ticket : tickets)
+        ticket->publish(QByteArray());
 }
 
 Client::EmailListRes Client::messages_list(const std::string& query, const std::string& label_id,
                                            const std::string& token) {
-    QJsonDocument root;
+    // The first page of each label is kept up to date from the history
+    bool synced = query.empty() && token.empty() && sync();
+    std::deque<std::string> ids;
+    std::string next;
+    if (synced && metadata_->get_listing(false, label_id, ids, next)) {
+        EmailList result;
+        for (const std::string &id : ids) {
+            Email message;
+            message.id = id;
+            result.emplace_back(message);
+        }
+        return std::make_pair(result, next);
+    }
+
+    // Later pages may have been fetched ahead of time
+    Page page;
+    if (pages_ && !token.empty() &&
+            pages_->get(PageCache::key(false, query, label_id, token), page))
+        return std::make_pair(page.messages, page.next);
+
+    QByteArray json;
     net::Uri::QueryParameters params = { { "q", query }, { "maxResults", "50" }, { "pageToken", token } };
     if (label_id != "")
         params.emplace_back("labelIds", label_id);
-    get( { "users", "me", "messages" }, params, root);
+    get( { "users", "me", "messages" }, params, json);
 
-    EmailList result;
-    QVariantMap variant = root.toVariant().toMap();
-    QVariantList messages = variant["messages"].toList();
-
-    for (const QVariant &i : messages) {
-        result.emplace_back(parse_email(i));
-    }
-    return std::make_pair(result, variant["nextPageToken"].toString().toStdString());
+    EmailList result = parse_email_list(json, next);
+    for (const Email &message : result)
+        ids.emplace_back(message.id);
+    // An empty list may just be one we couldn't read
+    if (synced && !result.empty())
+        metadata_->put_listing(false, label_id, ids, next);
+    if (pages_ && !token.empty() && !result.empty())
+        pages_->put(PageCache::key(false, query, label_id, token), { result, { }, next });
+    return std::make_pair(result, next);
 }
 
 Client::Email Client::messages_get(const std::string& id, bool body = false) {
-    QJsonDocument root;
-    net::Uri::QueryParameters params;
-    if (body) {
-        params = { { "format", "full" }, { "fields", "payload,labelIds" } };
-    } else {
-        params = metadata_params();
+    EmailList cached;
+    Email message;
+    if (!body) {
+        if (emails_ && emails_->get(EmailCache::message_key(id), cached) && !cached.empty())
+            return cached.front();
+        if (metadata_ && metadata_->get_message(id, message)) {
+            cache_message(message);
+            return message;
+        }
+    } else if (bodies_ && bodies_->get(id, message)) {
+        return message;
     }
-    get({ "users", "me", "messages", id}, params, root);
 
-    QVariant message = root.toVariant();
-    return parse_email(message);
+    QByteArray json;
+    get({ "users", "me", "messages", id}, body ? body_params() : metadata_params(), json);
+
+    message = parse_email(json);
+    if (!message.id.empty()) {
+        if (body) {
+            if (bodies_)
+                bodies_->put(id, message);
+        } else {
+            if (metadata_)
+                metadata_->put_messages({ message });
+            cache_message(message);
+        }
+    }
+    return message;
 }
 
-Client::EmailList Client::messages_get_batch(const EmailList& messages) {
+Client::EmailList Client::messages_get_batch(const EmailList& messages,
+                                             const EmailHandler &on_email) {
+    // Only fetch what we don't have a fresh copy of, in memory or in the store
+    std::map<std::string, Email> found;
     std::deque<std::string> ids;
-    QVariantList res_array;
-    for (const Client::Email& message : messages)
-        ids.emplace_back(message.id);
-    batch_get({ "users", "me", "messages" }, metadata_params(), ids, res_array);
+    for (const Client::Email& message : messages) {
+        Email stored;
+        if (message_cached(message.id, stored))
+            found.emplace(message.id, stored);
+        else
+            ids.emplace_back(message.id);
+    }
 
+    // Hand over the messages in order, up to the first one we're still waiting for
     Client::EmailList result;
-    for (const QVariant& var : res_array)
-        result.emplace_back(parse_email(var));
+    std::set<std::string> pending(ids.begin(), ids.end());
+    std::size_t next = 0;
+    bool stopped = !on_email;
+    auto emit = [&]() {
+        for (; next < messages.size(); next++) {
+            if (pending.count(messages[next].id))
+                return;
+            auto iter = found.find(messages[next].id);
+            if (iter == found.end())
+                continue;
+            result.emplace_back(iter->second);
+            if (!stopped && !on_email(iter->second)) {
+                stopped = true;
+                cancel();
+            }
+        }
+    };
+    emit();
+
+    if (!ids.empty()) {
+        EmailList fetched;
+        batch_get<Email>({ "users", "me", "messages" }, metadata_params(), ids,
+                         parse_message, [&](const std::string &id, const Email &message) {
+            pending.erase(id);
+            if (!message.id.empty()) {
+                cache_message(message);
+                fetched.emplace_back(message);
+                found.emplace(id, message);
+            }
+            emit();
+        });
+        if (metadata_)
+            metadata_->put_messages(fetched);
+    }
     return result;
 }
 
+bool Client::message_cached(const std::string &id, Email &message) {
+    EmailList cached;
+    if (emails_ && emails_->get(EmailCache::message_key(id), cached) && !cached.empty()) {
+        message = cached.front();
+        return true;
+    }
+    if (metadata_ && metadata_->get_message(id, message)) {
+        cache_message(message);
+        return true;
+    }
+    return false;
+}
+
+bool Client::thread_cached(const Thread &thread, EmailList &messages) {
+    EmailList stored;
+    bool found = emails_ && emails_->get(EmailCache::thread_key(thread.id, thread.historyId),
+                                         stored);
+    if (!found && metadata_ && metadata_->get_thread(thread.id, thread.historyId, stored)) {
+        cache_thread(thread.id, thread.historyId, stored);
+        found = true;
+    }
+    if (!found)
+        return false;
+    // Newest first
+    messages.assign(stored.rbegin(), stored.rend());
+    return true;
+}
+
+void Client::messages_prefetch(const std::deque<std::string> &ids) {
+    if (!bodies_)
+        return;
+    std::deque<std::string> missing;
+    for (const std::string &id : ids) {
+        if (!bodies_->contains(id))
+            missing.emplace_back(id);
+    }
+    if (missing.empty())
+        return;
+
+    // A preview asking for one of these while we're at it waits for our result
+    batch_get<Email>({ "users", "me", "messages" }, body_params(), missing,
+                     parse_message, [this](const std::string &id, const Email &message) {
+        if (!message.id.empty())
+            bodies_->put(id, message);
+    });
+}
+
 Client::Email Client::messages_set_unread(const std::string& id, bool unread) {
     std::string command = unread ? "addLabelIds" : "removeLabelIds";
     std::string payload = "{ \"" + command + "\": [\"UNREAD\"] }";
-    QJsonDocument root;
-    post({ "users", "me", "messages", id, "modify" }, {}, payload, root);
-    return parse_email(root.toVariant());
+    QByteArray json;
+    post({ "users", "me", "messages", id, "modify" }, {}, payload, json);
+    return stored_labels(parse_email(json));
 }
 
 Client::Email Client::messages_trash(const std::string& id) {
-    QJsonDocument root;
-    post({ "users", "me", "messages", id, "trash" }, {}, "", root);
-    return parse_email(root.toVariant());
+    QByteArray json;
+    post({ "users", "me", "messages", id, "trash" }, {}, "", json);
+    return stored_labels(parse_email(json));
 }
 
 Client::Email Client::messages_untrash(const std::string& id) {
-    QJsonDocument root;
-    post({ "users", "me", "messages", id, "untrash" }, {}, "", root);
-    return parse_email(root.toVariant());
+    QByteArray json;
+    post({ "users", "me", "messages", id, "untrash" }, {}, "", json);
+    return stored_labels(parse_email(json));
 }
 
 Client::ThreadListRes Client::threads_list(const std::string& query, const std::string& label_id,
                                            const std::string &token) {
-    QJsonDocument root;
+    bool synced = query.empty() && token.empty() && sync();
+    std::deque<std::string> ids;
+    std::string next;
+    if (synced && metadata_->get_listing(true, label_id, ids, next)) {
+        // Without a history id, the store vouches for the threads it has
+        ThreadList result;
+        for (const std::string &id : ids) {
+            Thread thread;
+            thread.id = id;
+            result.emplace_back(thread);
+        }
+        return std::make_pair(result, next);
+    }
+
+    // Later pages may have been fetched ahead of time
+    Page page;
+    if (pages_ && !token.empty() &&
+            pages_->get(PageCache::key(true, query, label_id, token), page))
+        return std::make_pair(page.threads, page.next);
+
+    QByteArray json;
     net::Uri::QueryParameters params = { { "q", query }, { "maxResults", "12" }, { "pageToken", token } };
     if (label_id != "")
         params.emplace_back("labelIds", label_id);
-    get( { "users", "me", "threads" }, params, root);
-
-    ThreadList result;
-    QVariantMap variant = root.toVariant().toMap();
-    QVariantList threads = variant["threads"].toList();
-
-    for (const QVariant &thread : threads) {
-        result.emplace_back(thread.toMap()["id"].toString().toStdString());
-    }
-    return std::make_pair(result, variant["nextPageToken"].toString().toStdString());
+    get( { "users", "me", "threads" }, params, json);
+
+    ThreadList result = parse_thread_list(json, next);
+    for (const Thread &thread : result)
+        ids.emplace_back(thread.id);
+    // An empty list may just be one we couldn't read
+    if (synced && !result.empty())
+        metadata_->put_listing(true, label_id, ids, next);
+    if (pages_ && !token.empty() && !result.empty())
+        pages_->put(PageCache::key(true, query, label_id, token), { { }, result, next });
+    return std::make_pair(result, next);
 }
 
 Client::EmailList Client::threads_get(const std::string& id) {
-    QJsonDocument root;
-    get({ "users", "me", "threads", id }, metadata_params(), root);
-
-    EmailList result;
-    QVariantMap variant = root.toVariant().toMap();
-    QVariantList messages = variant["messages"].toList();
+    // We don't know the thread's current history id, so take the latest we've seen
+    EmailList thread;
+    if (!emails_ || !emails_->get(EmailCache::thread_key(id, ""), thread)) {
+        QByteArray json;
+        get({ "users", "me", "threads", id }, metadata_params(), json);
+
+        std::string history_id;
+        thread = parse_thread(json, history_id);
+        if (!thread.empty()) {
+            if (metadata_)
+                metadata_->put_thread(id, history_id, thread);
+            cache_thread(id, history_id, thread);
+        }
+    }
 
-    int length = messages.length();
-    for (int i = length-1; i >= 0; i--)
-        result.emplace_back(parse_email(messages[i]));
-    return result;
+    // Newest first
+    return EmailList(thread.rbegin(), thread.rend());
 }
 
-Client::EmailList Client::threads_get_batch(const ThreadList& threads) {
-    QVariantList res_array;
-    batch_get({ "users", "me", "threads" }, metadata_params(), threads, res_array);
+Client::EmailList Client::threads_get_batch(const ThreadList& threads,
+                                            const EmailHandler &on_email) {
+    // Threads whose history id hasn't changed since we stored them are unchanged
+    std::map<std::string, EmailList> found;
+    std::deque<std::string> ids;
+    for (const Thread& thread : threads) {
+        EmailList stored;
+        if (thread_cached(thread, stored))
+            found.emplace(thread.id, stored);
+        else
+            ids.emplace_back(thread.id);
+    }
 
+    // Hand over the threads in order, up to the first one we're still waiting for
     EmailList result;
-    for (const QVariant& var : res_array) {
-        QVariantList messages = var.toMap()["messages"].toList();
-        int length = messages.length();
-        for (int i = length-1; i >= 0; i--)
-            result.emplace_back(parse_email(messages[i]));
+    std::set<std::string> pending(ids.begin(), ids.end());
+    std::size_t next = 0;
+    bool stopped = !on_email;
+    auto emit = [&]() {
+        for (; next < threads.size(); next++) {
+            if (pending.count(threads[next].id))
+                return;
+            auto iter = found.find(threads[next].id);
+            if (iter == found.end())
+                continue;
+            for (auto message = iter->second.begin(); message != iter->second.end(); message++) {
+                result.emplace_back(*message);
+                if (!stopped && !on_email(*message)) {
+                    stopped = true;
+                    cancel();
+                }
+            }
+        }
+    };
+    emit();
+
+    if (!ids.empty()) {
+        batch_get<ParsedThread>({ "users", "me", "threads" }, metadata_params(), ids,
+                                parse_thread_history,
+                                [&](const std::string &id, const ParsedThread &parsed) {
+            pending.erase(id);
+            const std::string &history_id = parsed.first;
+            const EmailList &thread = parsed.second;
+            if (!thread.empty()) {
+                if (metadata_)
+                    metadata_->put_thread(id, history_id, thread);
+                cache_thread(id, history_id, thread);
+                // Newest first
+                found.emplace(id, EmailList(thread.rbegin(), thread.rend()));
+            }
+            emit();
+        });
     }
     return result;
 }
@@ -491,54 +724,297 @@ Client::Email Client::send_message(const Client::Contact& to, const std::string&
             std::string(message.toBase64(QByteArray::Base64UrlEncoding).constData()) +
             "\", \"threadId\": \"" + thread_id + "\" }";
     std::cerr << request_body << std::endl;
-    QJsonDocument root;
-    post({ "users", "me", "messages", "send" }, {}, request_body, root);
-    return parse_email(root.toVariant());
+    QByteArray json;
+    post({ "users", "me", "messages", "send" }, {}, request_body, json);
+    // The thread has a new message
+    if (emails_)
+        emails_->erase(EmailCache::thread_key(thread_id, ""));
+    if (results_)
+        results_->clear();
+    return parse_email(json);
+}
+
+template<typename T>
+void Client::refresh(Snapshot<T> &snapshot, void (Client::*fetch)()) {
+    if (!snapshot.claim())
+        return;
+    // The refresh is done by a client of its own, so that we needn't wait for it.
+    // If the configuration is gone by the time it runs, nobody wants the value.
+    std::weak_ptr<Config> weak_config = config_;
+    executor_->post([weak_config, snapshot, fetch]() mutable {
+        Config::Ptr config = weak_config.lock();
+        if (config) {
+            try {
+                Client client(config);
+                (client.*fetch)();
+            } catch (std::exception &e) {
+                // We still have the old value, and the next reader will try again
+                std::cerr << "Refresh failed: " << e.what() << std::endl;
+            }
+        }
+        snapshot.release();
+    });
 }
 
 std::string Client::users_address() {
-    if (config_->users_address.empty()) {
-        QJsonDocument root;
-        get({ "users", "me", "profile" }, {}, root);
-        config_->users_address = root.toVariant().toMap()["emailAddress"].toString().toStdString();
+    Snapshot<std::string>::Ptr address = config_->users_address.get();
+    if (!address) {
+        fetch_users_address();
+        address = config_->users_address.get();
+        return address ? *address : "";
     }
-    return config_->users_address;
+    if (config_->users_address.stale())
+        refresh(config_->users_address, &Client::fetch_users_address);
+    return *address;
 }
 
 Client::LabelList Client::get_labels() {
-    if (config_->labels.empty()) {
+    Snapshot<LabelList>::Ptr labels = config_->labels.get();
+    if (!labels) {
+        // Nothing to show until we have them.  Other clients asking at the same
+        // time share our request.
+        fetch_labels();
+        labels = config_->labels.get();
+        return labels ? *labels : LabelList();
+    }
+    if (config_->labels.stale())
+        refresh(config_->labels, &Client::fetch_labels);
+    return *labels;
+}
+
+void Client::fetch_users_address() {
+    QJsonDocument root;
+    get({ "users", "me", "profile" }, {}, root);
+    std::string address = root.toVariant().toMap()["emailAddress"].toString().toStdString();
+    if (!address.empty())
+        config_->users_address.publish(address);
+}
+
+void Client::fetch_labels() {
+    QJsonDocument root;
+    get({ "users", "me", "labels" }, {}, root);
+    if (root.isNull())
+        return;
+
+    // Built privately, and only published once it's complete
+    LabelList result;
+    LabelList::iterator iter;
+    QVariantMap variant = root.toVariant().toMap();
+    QVariantList labels = variant["labels"].toList();
+
+    for (const QVariant &i : labels) {
+        QVariantMap label_map = i.toMap();
+        if (label_map["messageListVisibility"] == "show") {
+            iter = result.begin();
+            std::string name = label_map["name"].toString().toStdString();
+            // Sort by names, case insensitively
+            while (iter != result.end() &&
+                   strcasecmp(iter->second.c_str(), name.c_str()) <= 0)
+                iter += 1;
+            result.insert(iter, std::make_pair(label_map["id"].toString().toStdString(),
+                                               name));
+        }
+    }
+    config_->labels.publish(result);
+}
+
+std::string Client::access_token() {
+    return tokens_->token();
+}
+
+bool Client::sync() {
+    if (!metadata_)
+        return false;
+
+    std::string start = metadata_->history_id();
+    if (start.empty()) {
+        // Start following the history from where the mailbox is now.  Anything
+        // listed after this is kept up to date by the deltas that follow.
+        QJsonDocument root;
+        try {
+            get({ "users", "me", "profile" }, {}, root);
+        } catch (std::domain_error &) {
+            return false;
+        }
+        QVariantMap profile = root.toVariant().toMap();
+        std::string history_id = profile["historyId"].toString().toStdString();
+        if (history_id.empty())
+            return false;
+        // The profile tells us the address too, for free
+        std::string address = profile["emailAddress"].toString().toStdString();
+        if (!address.empty())
+            config_->users_address.publish(address);
+        metadata_->start_sync(history_id);
+        return true;
+    }
+
+    ChangeList changes;
+    std::string latest, token;
+    for (int page = 0; page < MAX_HISTORY_PAGES; page++) {
         QJsonDocument root;
-        get({ "users", "me", "labels" }, {}, root);
+        try {
+            get({ "users", "me", "history" },
+                { { "startHistoryId", start }, { "pageToken", token } }, root);
+        } catch (std::domain_error &) {
+            // Most likely, our history id is too old to be kept
+            metadata_->stop_sync();
+            return false;
+        }
+        if (root.isNull())
+            return false;
 
-        LabelList::iterator iter;
         QVariantMap variant = root.toVariant().toMap();
-        QVariantList labels = variant["labels"].toList();
-
-        for (const QVariant &i : labels) {
-            QVariantMap label_map = i.toMap();
-            if (label_map["messageListVisibility"] == "show") {
-                iter = config_->labels.begin();
-                std::string name = label_map["name"].toString().toStdString();
-                // Sort by names, case insensitively
-                while (iter != config_->labels.end() &&
-                       strcasecmp(iter->second.c_str(), name.c_str()) <= 0)
-                    iter += 1;
-                config_->labels.insert(iter,
-                                       std::make_pair(label_map["id"].toString().toStdString(),
-                                       name));
-            }
+        ChangeList page_changes = parse_history(variant["history"]);
+        changes.insert(changes.end(), page_changes.begin(), page_changes.end());
+        latest = variant["historyId"].toString().toStdString();
+        token = variant["nextPageToken"].toString().toStdString();
+        if (token.empty())
+            break;
+    }
+    // When this much has changed, listing again is cheaper
+    if (!token.empty() || latest.empty()) {
+        metadata_->stop_sync();
+        return false;
+    }
+    // Another sync that got there first has brought the store further than ours
+    if (!metadata_->apply(changes, start, latest))
+        return !metadata_->history_id().empty();
+    if (results_ && !changes.empty())
+        results_->clear();
+    for (const Change &change : changes) {
+        if (emails_) {
+            emails_->erase(EmailCache::message_key(change.id));
+            emails_->erase(EmailCache::thread_key(change.threadId, ""));
         }
+        if (bodies_ && change.deleted)
+            bodies_->erase(change.id);
+        else
+            relabel_body(change.id, change.labels);
     }
-    return config_->labels;
+    return true;
 }
 
-std::string Client::access_token() {
-    sc::OnlineAccountClient oa_client(SCOPE_NAME, SCOPE_NAME, "google");
-    for (auto const& status : oa_client.get_service_statuses()) {
-        if (status.service_authenticated)
-            return status.access_token;
+Client::Email Client::stored_labels(const Email &message) {
+    if (metadata_ && !message.id.empty())
+        metadata_->set_labels(message.id, message.labels);
+    if (emails_) {
+        emails_->erase(EmailCache::message_key(message.id));
+        emails_->erase(EmailCache::thread_key(message.threadId, ""));
+    }
+    relabel_body(message.id, message.labels);
+    if (results_)
+        results_->clear();
+    return message;
+}
+
+void Client::cache_message(const Email &message) {
+    if (emails_ && !message.id.empty())
+        emails_->put(EmailCache::message_key(message.id), { message });
+}
+
+void Client::cache_thread(const std::string &id, const std::string &history_id,
+                          const EmailList &thread) {
+    if (!emails_)
+        return;
+    emails_->put(EmailCache::thread_key(id, history_id), thread);
+    // Also as the latest version we've seen
+    if (!history_id.empty())
+        emails_->put(EmailCache::thread_key(id, ""), thread);
+}
+
+void Client::relabel_body(const std::string &id, const Labels &labels) {
+    Email message;
+    if (!bodies_ || id.empty() || !bodies_->get(id, message))
+        return;
+    message.labels = labels;
+    bodies_->put(id, message);
+}
+
+template<typename R, typename... Params, typename... Args>
+std::future<R> Client::run_async(R (Client::*method)(Params...), Args&&... args) {
+    auto call = std::bind(method, this, std::forward<Args>(args)...);
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        jobs_++;
     }
-    throw std::runtime_error("Could not authenticate");
+    return executor_->submit([this, call]() mutable -> R {
+        Finished finished(*this);
+        // Don't bother starting if we were cancelled while waiting our turn
+        if (cancelled_)
+            return R();
+        return call();
+    });
+}
+
+Client::Finished::Finished(Client &client) :
+    client_(client) {
+}
+
+Client::Finished::~Finished() {
+    // Notify while holding the lock, since the client may go away once we let go
+    std::lock_guard<std::mutex> lock(client_.jobs_mutex_);
+    if (--client_.jobs_ == 0)
+        client_.jobs_done_.notify_all();
+}
+
+std::future<Client::EmailListRes> Client::messages_list_async(const std::string &query,
+                                                              const std::string &label_id,
+                                                              const std::string &token) {
+    return run_async(&Client::messages_list, query, label_id, token);
+}
+
+std::future<Client::Email> Client::messages_get_async(const std::string &id, bool body) {
+    return run_async(&Client::messages_get, id, body);
+}
+
+std::future<Client::EmailList> Client::messages_get_batch_async(const EmailList &messages,
+                                                               const EmailHandler &on_email) {
+    return run_async(&Client::messages_get_batch, messages, on_email);
+}
+
+std::future<Client::Email> Client::messages_set_unread_async(const std::string &id,
+                                                             bool unread) {
+    return run_async(&Client::messages_set_unread, id, unread);
+}
+
+std::future<Client::Email> Client::messages_trash_async(const std::string &id) {
+    return run_async(&Client::messages_trash, id);
+}
+
+std::future<Client::Email> Client::messages_untrash_async(const std::string &id) {
+    return run_async(&Client::messages_untrash, id);
+}
+
+std::future<Client::ThreadListRes> Client::threads_list_async(const std::string &query,
+                                                              const std::string &label_id,
+                                                              const std::string &token) {
+    return run_async(&Client::threads_list, query, label_id, token);
+}
+
+std::future<Client::EmailList> Client::threads_get_async(const std::string &id) {
+    return run_async(&Client::threads_get, id);
+}
+
+std::future<Client::EmailList> Client::threads_get_batch_async(const ThreadList &threads,
+                                                              const EmailHandler &on_email) {
+    return run_async(&Client::threads_get_batch, threads, on_email);
+}
+
+std::future<Client::Email> Client::send_message_async(const Contact &to,
+                                                      const std::string &subject,
+                                                      const std::string &body,
+                                                      const std::string &from_name,
+                                                      const std::string &ref_id,
+                                                      const std::string &thread_id) {
+    return run_async(&Client::send_message, to, subject, body, from_name, ref_id, thread_id);
+}
+
+std::future<std::string> Client::users_address_async() {
+    return run_async(&Client::users_address);
+}
+
+std::future<Client::LabelList> Client::get_labels_async() {
+    return run_async(&Client::get_labels);
 }
 
 http::Request::Progress::Next Client::progress_report(
@@ -553,6 +1029,18 @@ void Client::cancel() {
     cancelled_ = true;
 }
 
+bool Client::cancelled() const {
+    return cancelled_;
+}
+
+bool Client::failed() const {
+    return failed_;
+}
+
 Config::Ptr Client::config() {
     return config_;
 }
+
+Executor::Ptr Client::executor() {
+    return executor_;
+}
@@ -0,0 +1,213 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/connection_pool.h>
+
+#include <core/net/error.h>
+
+#include <future>
+#include <stdexcept>
+
+namespace http = core::net::http;
+namespace net = core::net;
+
+using namespace api;
+
+namespace {
+
+/**
+ * Extract the "host[:port]" part of a URI, which is what connections are keyed on.
+ */
+static std::string host_of(const std::string &uri) {
+    size_t start = uri.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    size_t end = uri.find('/', start);
+    return uri.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+/**
+ * Passes progress on to the caller's handler, which refers to things on the
+ * caller's stack.  The event loop may still report progress after the caller
+ * has given up on the request, so once abandoned, this aborts it instead.
+ */
+class ProgressRelay {
+public:
+    explicit ProgressRelay(const ConnectionPool::ProgressHandler &handler) :
+        handler_(handler), abandoned_(false) {
+    }
+
+    http::Request::Progress::Next operator()(const http::Request::Progress &progress) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (abandoned_)
+            return http::Request::Progress::Next::abort_operation;
+        if (!handler_)
+            return http::Request::Progress::Next::continue_operation;
+        return handler_(progress);
+    }
+
+    /**
+     * Stop calling the handler, waiting for any call already under way
+     */
+    void abandon() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        abandoned_ = true;
+        handler_ = nullptr;
+    }
+
+private:
+    std::mutex mutex_;
+
+    ConnectionPool::ProgressHandler handler_;
+
+    bool abandoned_;
+};
+
+}
+
+
+ConnectionPool::ConnectionPool(std::size_t max_per_host, std::chrono::seconds idle_timeout) :
+    max_per_host_(max_per_host > 0 ? max_per_host : 1), idle_timeout_(idle_timeout), active_(0),
+    last_used_(std::chrono::steady_clock::now()), stopped_(false) {
+    reaper_ = std::thread(&ConnectionPool::reap, this);
+}
+
+ConnectionPool::~ConnectionPool() {
+    shutdown();
+}
+
+http::Response ConnectionPool::get(http::Request::Configuration configuration,
+                                   const ProgressHandler &progress) {
+    configuration.header.add("Connection", "keep-alive");
+    return perform(configuration.uri, [&configuration](http::Client &client) {
+        return client.get(configuration);
+    }, progress);
+}
+
+http::Response ConnectionPool::post(http::Request::Configuration configuration,
+                                    const std::string &payload, const std::string &type,
+                                    const ProgressHandler &progress) {
+    configuration.header.add("Connection", "keep-alive");
+    return perform(configuration.uri, [&configuration, &payload, &type](http::Client &client) {
+        return client.post(configuration, payload, type);
+    }, progress);
+}
+
+std::string ConnectionPool::uri_to_string(const net::Uri &uri) {
+    std::shared_ptr<http::Client> formatter;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_)
+            throw std::domain_error("Connection pool has been shut down");
+        // Once the idle connections have been closed, a URI for a request that is
+        // answered by a cache or another request mustn't open them again
+        if (!formatter_)
+            formatter_ = http::make_client();
+        formatter = formatter_;
+    }
+    return formatter->uri_to_string(uri);
+}
+
+http::Response ConnectionPool::perform(const std::string &uri, const RequestBuilder &build,
+                                       const ProgressHandler &progress) {
+    std::string host = host_of(uri);
+    std::shared_ptr<http::Client> client;
+    {
+        // Wait for a free slot for this host
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, &host]() { return stopped_ || in_flight_[host] < max_per_host_; });
+        if (stopped_)
+            throw std::domain_error("Connection pool has been shut down");
+        in_flight_[host] += 1;
+        active_ += 1;
+    }
+
+    // Give the slot back, however we leave this function
+    std::shared_ptr<void> release(nullptr, [this, &host](void*) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_[host] -= 1;
+        active_ -= 1;
+        last_used_ = std::chrono::steady_clock::now();
+        cv_.notify_all();
+    });
+
+    client = running_client();
+    // The handlers only hold on to shared state, since they may be called after
+    // we have thrown
+    auto promise = std::make_shared<std::promise<http::Response>>();
+    auto relay = std::make_shared<ProgressRelay>(progress);
+    std::shared_ptr<void> abandon(nullptr, [relay](void*) {
+        relay->abandon();
+    });
+    http::Request::Handler handler;
+    handler.on_progress([relay](const http::Request::Progress &report) {
+        return (*relay)(report);
+    });
+    handler.on_response([promise](const http::Response &response) {
+        promise->set_value(response);
+    });
+    handler.on_error([promise](const net::Error &e) {
+        promise->set_exception(std::make_exception_ptr(e));
+    });
+
+    // The request has to outlive its execution, so we hold on to it here
+    auto request = build(*client);
+    request->async_execute(handler);
+
+    std::future<http::Response> result = promise->get_future();
+    while (result.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+        // Pending requests are dropped when the event loop stops
+        if (stopped_)
+            throw std::domain_error("Connection pool has been shut down");
+    }
+    return result.get();
+}
+
+std::shared_ptr<http::Client> ConnectionPool::running_client() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_)
+        throw std::domain_error("Connection pool has been shut down");
+    if (!client_) {
+        client_ = http::make_client();
+        std::shared_ptr<http::Client> client = client_;
+        worker_ = std::thread([client]() { client->run(); });
+    }
+    return client_;
+}
+
+void ConnectionPool::stop_client(std::unique_lock<std::mutex> &) {
+    if (!client_)
+        return;
+    // Stopping the event loop lets the curl multi handle, and with it all open
+    // connections, go away with the client.
+    client_->stop();
+    if (worker_.joinable())
+        worker_.join();
+    client_.reset();
+}
+
+void ConnectionPool::reap() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+        cv_.wait_for(lock, idle_timeout_);
+        if (!stopped_ && active_ == 0 &&
+                std::chrono::steady_clock::now() - last_used_ >= idle_timeout_)
+            stop_client(lock);
+    }
+}
+
+void ConnectionPool::shutdown() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_)
+            return;
+        stopped_ = true;
+        stop_client(lock);
+        formatter_.reset();
+        cv_.notify_all();
+    }
+    if (reaper_.joinable())
+        reaper_.join();
+}
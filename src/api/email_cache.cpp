@@ -0,0 +1,95 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/email_cache.h>
+
+using namespace api;
+
+namespace {
+
+static std::size_t contact_size(const Client::Contact &contact) {
+    return sizeof(contact) + contact.name.capacity() + contact.address.capacity() +
+            contact.gravatar.capacity();
+}
+
+static std::size_t email_size(const Client::Email &email) {
+    std::size_t bytes = sizeof(email) + email.id.capacity() + email.threadId.capacity() +
+            email.snippet.capacity() + email.body.capacity() +
+            email.header.subject.capacity() +
+            email.header.messageId.capacity() + contact_size(email.header.from) +
+            contact_size(email.header.replyto);
+    for (const Client::Contact &contact : email.header.to)
+        bytes += contact_size(contact);
+    for (const Client::Contact &contact : email.header.cc)
+        bytes += contact_size(contact);
+    for (const std::string &label : email.labels)
+        bytes += sizeof(label) + label.capacity();
+    return bytes;
+}
+
+}
+
+
+EmailCache::EmailCache(std::size_t budget, std::chrono::seconds ttl) :
+    LruCache<Client::EmailList>(budget, ttl, &EmailCache::size_of) {
+}
+
+std::string EmailCache::message_key(const std::string &id) {
+    return "message/" + id;
+}
+
+std::string EmailCache::thread_key(const std::string &id, const std::string &history_id) {
+    return "thread/" + id + "@" + history_id;
+}
+
+std::size_t EmailCache::size_of(const Client::EmailList &emails) {
+    std::size_t bytes = sizeof(emails);
+    for (const Client::Email &email : emails)
+        bytes += email_size(email);
+    return bytes;
+}
+
+
+BodyCache::BodyCache(std::size_t budget, std::chrono::seconds ttl) :
+    LruCache<Client::Email>(budget, ttl, &BodyCache::size_of) {
+}
+
+std::size_t BodyCache::size_of(const Client::Email &email) {
+    return email_size(email);
+}
+
+
+PageCache::PageCache(std::size_t budget, std::chrono::seconds ttl) :
+    LruCache<Client::Page>(budget, ttl, &PageCache::size_of) {
+}
+
+std::string PageCache::key(bool threads, const std::string &query, const std::string &label_id,
+                           const std::string &token) {
+    // Tokens and label ids never contain a newline, though queries might
+    return std::string(threads ? "threads" : "messages") + "\n" + label_id + "\n" + token +
+            "\n" + query;
+}
+
+std::size_t PageCache::size_of(const Client::Page &page) {
+    std::size_t bytes = sizeof(page) + page.next.capacity();
+    for (const Client::Email &email : page.messages)
+        bytes += email_size(email);
+    for (const Client::Thread &thread : page.threads)
+        bytes += sizeof(thread) + thread.id.capacity() + thread.historyId.capacity() +
+                thread.snippet.capacity();
+    return bytes;
+}
+
+
+ResultCache::ResultCache(std::size_t budget, std::chrono::seconds ttl) :
+    LruCache<Client::Page>(budget, ttl, &PageCache::size_of) {
+}
+
+std::string ResultCache::key(const std::string &query, const std::string &label_id,
+                             const std::string &token, bool threads, bool snippets) {
+    return std::string(threads ? "t" : "-") + (snippets ? "s" : "-") + "\n" + label_id + "\n" +
+            token + "\n" + query;
+}
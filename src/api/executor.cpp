@@ -0,0 +1,73 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/executor.h>
+
+using namespace api;
+
+
+Executor::Executor(std::size_t threads) :
+    max_threads_(threads > 0 ? threads : 1), state_(std::make_shared<State>()) {
+    state_->idle = 0;
+    state_->stopped = false;
+}
+
+Executor::~Executor() {
+    shutdown();
+}
+
+void Executor::post(const std::function<void()> &job) {
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (!state_->stopped) {
+            state_->jobs.push_back(job);
+            // Only start another thread if nobody is free to take the job
+            if (state_->idle < state_->jobs.size() && threads_.size() < max_threads_)
+                threads_.emplace_back(&Executor::run, state_);
+            state_->cv.notify_one();
+            return;
+        }
+    }
+    job();
+}
+
+void Executor::shutdown() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->stopped = true;
+        threads.swap(threads_);
+        state_->cv.notify_all();
+    }
+    for (std::thread &thread : threads) {
+        // A job dropping the last reference to us can't wait for itself
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else if (thread.joinable())
+            thread.join();
+    }
+}
+
+void Executor::run(std::shared_ptr<State> state) {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (true) {
+        if (state->jobs.empty()) {
+            if (state->stopped)
+                return;
+            state->idle += 1;
+            state->cv.wait(lock);
+            state->idle -= 1;
+            continue;
+        }
+        std::function<void()> job = std::move(state->jobs.front());
+        state->jobs.pop_front();
+        lock.unlock();
+        job();
+        // Drop whatever the job held on to before we wait for the next one
+        job = nullptr;
+        lock.lock();
+    }
+}
@@ -0,0 +1,235 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/json_reader.h>
+
+#include <cstring>
+
+using namespace api;
+
+
+namespace {
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * The four hex digits of a \u escape, or -1 if they aren't there
+ */
+static long read_hex4(const char *pos, const char *end) {
+    if (end - pos < 4)
+        return -1;
+    long value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_digit(pos[i]);
+        if (digit < 0)
+            return -1;
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+static void append_utf8(std::string &out, unsigned long code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xc0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        out += static_cast<char>(0xe0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    }
+}
+
+}
+
+JsonReader::JsonReader(const char *data, std::size_t length) :
+    pos_(data), end_(data + length), failed_(false) {
+}
+
+bool JsonReader::begin_object() {
+    if (peek() == '{') {
+        pos_++;
+        return true;
+    }
+    skip();
+    return false;
+}
+
+bool JsonReader::next_key(std::string &key) {
+    if (!next('}'))
+        return false;
+    if (peek() != '"') {
+        fail();
+        return false;
+    }
+    key.clear();
+    read_string(&key);
+    if (!consume(':')) {
+        fail();
+        return false;
+    }
+    return true;
+}
+
+bool JsonReader::begin_array() {
+    if (peek() == '[') {
+        pos_++;
+        return true;
+    }
+    skip();
+    return false;
+}
+
+bool JsonReader::next_element() {
+    return next(']');
+}
+
+std::string JsonReader::read_string() {
+    std::string value;
+    if (peek() == '"')
+        read_string(&value);
+    else
+        skip();
+    return value;
+}
+
+void JsonReader::skip() {
+    char c = peek();
+    if (c == '"') {
+        read_string(nullptr);
+    } else if (c == '{' || c == '[') {
+        // We needn't check that the brackets match, only find where this ends
+        int depth = 0;
+        while (pos_ < end_) {
+            c = *pos_;
+            if (c == '"') {
+                read_string(nullptr);
+                continue;
+            }
+            pos_++;
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0)
+                    return;
+            }
+        }
+        fail();
+    } else if (c == 0 || c == ',' || c == ':' || c == '}' || c == ']') {
+        fail();
+    } else {
+        // A number, true, false, or null
+        while (pos_ < end_ && !std::strchr(",:}] \t\r\n", *pos_))
+            pos_++;
+    }
+}
+
+bool JsonReader::failed() const {
+    return failed_;
+}
+
+char JsonReader::peek() {
+    while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\n' || *pos_ == '\r' || *pos_ == '\t'))
+        pos_++;
+    return pos_ < end_ ? *pos_ : 0;
+}
+
+bool JsonReader::consume(char c) {
+    if (peek() != c)
+        return false;
+    pos_++;
+    return true;
+}
+
+bool JsonReader::next(char close) {
+    consume(',');
+    char c = peek();
+    if (c == close) {
+        pos_++;
+        return false;
+    }
+    if (c == 0) {
+        fail();
+        return false;
+    }
+    return true;
+}
+
+void JsonReader::read_string(std::string *out) {
+    // Past the opening quote
+    pos_++;
+    while (pos_ < end_) {
+        // Copy everything up to the next quote or escape at once
+        const char *run = pos_;
+        while (pos_ < end_ && *pos_ != '"' && *pos_ != '\\')
+            pos_++;
+        if (out)
+            out->append(run, pos_ - run);
+        if (pos_ == end_)
+            break;
+        if (*pos_ == '"') {
+            pos_++;
+            return;
+        }
+
+        // An escape
+        if (end_ - pos_ < 2)
+            break;
+        char c = pos_[1];
+        pos_ += 2;
+        if (!out)
+            continue;
+        switch (c) {
+        case 'b': *out += '\b'; break;
+        case 'f': *out += '\f'; break;
+        case 'n': *out += '\n'; break;
+        case 'r': *out += '\r'; break;
+        case 't': *out += '\t'; break;
+        case 'u': {
+            long code = read_hex4(pos_, end_);
+            if (code < 0) {
+                fail();
+                return;
+            }
+            pos_ += 4;
+            // Characters outside the BMP come as a pair of surrogates
+            if (code >= 0xd800 && code < 0xdc00 && end_ - pos_ >= 6 &&
+                    pos_[0] == '\\' && pos_[1] == 'u') {
+                long low = read_hex4(pos_ + 2, end_);
+                if (low >= 0xdc00 && low < 0xe000) {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    pos_ += 6;
+                }
+            }
+            append_utf8(*out, code);
+            break;
+        }
+        default:
+            // \", \\, and \/ stand for themselves
+            *out += c;
+        }
+    }
+    fail();
+}
+
+void JsonReader::fail() {
+    failed_ = true;
+    pos_ = end_;
+}
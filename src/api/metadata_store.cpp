@@ -0,0 +1,629 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/metadata_store.h>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+using namespace api;
+
+/**
+ * The file starts with MAGIC.  Each record is a 32-bit little-endian length, a
+ * kind byte, and then that many bytes of JSON.  Change MAGIC whenever the
+ * records change, and old files will be discarded.
+ */
+namespace {
+
+const char MAGIC[] = "GMSCMD02";
+const qint64 MAGIC_SIZE = sizeof(MAGIC) - 1;
+const qint64 RECORD_HEADER = 5;
+
+const char MESSAGE = 'm';
+const char THREAD = 't';
+const char LISTING = 'l';
+const char SYNC = 's';
+
+/**
+ * Don't bother compacting until there's at least this much to gain
+ */
+const qint64 COMPACT_SLACK = 256 * 1024;
+
+/**
+ * Records appended since the file was last mapped are read through the file,
+ * until there are this many bytes of them
+ */
+const qint64 REMAP_SLACK = 1024 * 1024;
+
+static QJsonObject contact_to_json(const Client::Contact &contact) {
+    QJsonObject json;
+    json["name"] = QString::fromStdString(contact.name);
+    json["address"] = QString::fromStdString(contact.address);
+    json["gravatar"] = QString::fromStdString(contact.gravatar);
+    return json;
+}
+
+static Client::Contact contact_from_json(const QJsonValue &value) {
+    QJsonObject json = value.toObject();
+    Client::Contact contact;
+    contact.name = json["name"].toString().toStdString();
+    contact.address = json["address"].toString().toStdString();
+    contact.gravatar = json["gravatar"].toString().toStdString();
+    return contact;
+}
+
+static QJsonArray contacts_to_json(const Client::ContactList &contacts) {
+    QJsonArray json;
+    for (const Client::Contact &contact : contacts)
+        json.append(contact_to_json(contact));
+    return json;
+}
+
+static Client::ContactList contacts_from_json(const QJsonValue &value) {
+    Client::ContactList contacts;
+    for (const QJsonValue &contact : value.toArray())
+        contacts.emplace_back(contact_from_json(contact));
+    return contacts;
+}
+
+static QByteArray email_to_json(const Client::Email &email, qint64 stored) {
+    QJsonObject json;
+    json["id"] = QString::fromStdString(email.id);
+    json["threadId"] = QString::fromStdString(email.threadId);
+    json["snippet"] = QString::fromStdString(email.snippet);
+    json["stored"] = static_cast<double>(stored);
+    json["date"] = static_cast<double>(email.header.date);
+    json["offset"] = email.header.date_offset;
+    json["from"] = contact_to_json(email.header.from);
+    json["to"] = contacts_to_json(email.header.to);
+    json["cc"] = contacts_to_json(email.header.cc);
+    json["replyto"] = contact_to_json(email.header.replyto);
+    json["subject"] = QString::fromStdString(email.header.subject);
+    json["messageId"] = QString::fromStdString(email.header.messageId);
+    QJsonArray labels;
+    for (const std::string &label : email.labels)
+        labels.append(QString::fromStdString(label));
+    json["labels"] = labels;
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+static Client::Email email_from_json(const QJsonObject &json) {
+    Client::Email email;
+    email.id = json["id"].toString().toStdString();
+    email.threadId = json["threadId"].toString().toStdString();
+    email.snippet = json["snippet"].toString().toStdString();
+    email.header.date = static_cast<std::int64_t>(json["date"].toDouble());
+    email.header.date_offset = json["offset"].toInt();
+    email.header.from = contact_from_json(json["from"]);
+    email.header.to = contacts_from_json(json["to"]);
+    email.header.cc = contacts_from_json(json["cc"]);
+    email.header.replyto = contact_from_json(json["replyto"]);
+    email.header.subject = json["subject"].toString().toStdString();
+    email.header.messageId = json["messageId"].toString().toStdString();
+    for (const QJsonValue &label : json["labels"].toArray())
+        email.labels.emplace_back(label.toString().toStdString());
+    return email;
+}
+
+static QByteArray thread_to_json(const std::string &id, const std::string &history_id,
+                                 const Client::EmailList &messages, qint64 stored) {
+    QJsonObject json;
+    json["id"] = QString::fromStdString(id);
+    json["historyId"] = QString::fromStdString(history_id);
+    json["stored"] = static_cast<double>(stored);
+    QJsonArray ids;
+    for (const Client::Email &message : messages)
+        ids.append(QString::fromStdString(message.id));
+    json["messages"] = ids;
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+static QByteArray tombstone(const std::string &id, qint64 stored) {
+    QJsonObject json;
+    json["id"] = QString::fromStdString(id);
+    json["stored"] = static_cast<double>(stored);
+    json["deleted"] = true;
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+static QByteArray frame(char kind, const QByteArray &payload) {
+    uchar header[RECORD_HEADER];
+    qToLittleEndian<quint32>(payload.size(), header);
+    header[4] = static_cast<uchar>(kind);
+    return QByteArray(reinterpret_cast<const char*>(header), RECORD_HEADER) + payload;
+}
+
+/**
+ * Whether a message with these labels belongs in the label's listing; the
+ * listing for no label is All Mail
+ */
+static bool in_listing(const Client::Labels &labels, const std::string &label_id) {
+    for (const std::string &label : labels) {
+        if (label_id.empty() ? (label == "TRASH" || label == "SPAM") : label == label_id)
+            return !label_id.empty();
+    }
+    return label_id.empty();
+}
+
+/**
+ * Whether changing these labels could move a message in or out of the listing
+ */
+static bool affects_listing(const Client::Labels &labels, const std::string &label_id) {
+    for (const std::string &label : labels) {
+        if (label_id.empty() ? (label == "TRASH" || label == "SPAM") : label == label_id)
+            return true;
+    }
+    return false;
+}
+
+}
+
+
+MetadataStore::MetadataStore(const std::string &path, std::chrono::seconds ttl,
+                             std::chrono::seconds max_age) :
+    path_(path), ttl_(ttl), max_age_(max_age), map_(nullptr), mapped_(0),
+    sync_ { "", 0, 0 }, live_(0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!load())
+        return;
+    if (file_.size() > 2 * live_ + COMPACT_SLACK) {
+        compact();
+        load();
+    }
+}
+
+MetadataStore::~MetadataStore() {
+    if (map_)
+        file_.unmap(map_);
+    file_.close();
+}
+
+bool MetadataStore::get_message(const std::string &id, Client::Email &email) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = messages_.find(id);
+    if (iter == messages_.end() || !fresh(iter->second, now()))
+        return false;
+    email = email_from_json(QJsonDocument::fromJson(read(iter->second)).object());
+    return true;
+}
+
+void MetadataStore::put_messages(const Client::EmailList &emails) {
+    qint64 stored = now();
+    std::deque<Record> records;
+    for (const Client::Email &email : emails) {
+        if (!email.id.empty())
+            records.push_back({ MESSAGE, email.id, "", email_to_json(email, stored), false });
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(records);
+}
+
+bool MetadataStore::get_thread(const std::string &id, const std::string &history_id,
+                               Client::EmailList &messages) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = threads_.find(id);
+    if (iter == threads_.end())
+        return false;
+    const Entry &thread = iter->second;
+    if (history_id.empty() ? !fresh(thread, now()) : thread.history_id != history_id)
+        return false;
+
+    Client::EmailList result;
+    QJsonObject json = QJsonDocument::fromJson(read(thread)).object();
+    for (const QJsonValue &message_id : json["messages"].toArray()) {
+        auto message = messages_.find(message_id.toString().toStdString());
+        if (message == messages_.end())
+            return false;
+        result.emplace_back(email_from_json(QJsonDocument::fromJson(read(message->second)).object()));
+    }
+    messages.swap(result);
+    return true;
+}
+
+void MetadataStore::put_thread(const std::string &id, const std::string &history_id,
+                               const Client::EmailList &messages) {
+    // A thread missing a message would be trusted as the whole of it
+    for (const Client::Email &email : messages) {
+        if (email.id.empty())
+            return;
+    }
+    qint64 stored = now();
+    std::deque<Record> records;
+    for (const Client::Email &email : messages)
+        records.push_back({ MESSAGE, email.id, "", email_to_json(email, stored), false });
+    // The thread goes last, so that it never refers to messages we failed to write
+    records.push_back({ THREAD, id, history_id, thread_to_json(id, history_id, messages, stored),
+                        false });
+    std::lock_guard<std::mutex> lock(mutex_);
+    append(records);
+}
+
+void MetadataStore::set_labels(const std::string &id, const Client::Labels &labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = messages_.find(id);
+    if (iter == messages_.end())
+        return;
+    Client::Email email = email_from_json(QJsonDocument::fromJson(read(iter->second)).object());
+    email.labels = labels;
+    append({ { MESSAGE, id, "", email_to_json(email, now()), false } });
+}
+
+std::string MetadataStore::history_id() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sync_.history_id;
+}
+
+void MetadataStore::start_sync(const std::string &history_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    qint64 started = now();
+    std::deque<Record> records;
+    for (const auto &pair : listings_)
+        records.push_back({ LISTING, pair.first, "", tombstone(pair.first, started), true });
+    listings_.clear();
+    sync_ = { history_id, started, started };
+    records.push_back(sync_record());
+    append(records);
+}
+
+bool MetadataStore::apply(const Client::ChangeList &changes, const std::string &start,
+                          const std::string &history_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Someone else may have given up on the history, or moved on with it, while we
+    // fetched the delta.  An older delta would take the store back in time.
+    if (sync_.history_id.empty() || sync_.history_id != start)
+        return false;
+
+    qint64 stored = now();
+    std::deque<Record> records;
+    std::set<std::string> changed, dropped;
+    for (const Client::Change &change : changes) {
+        if (messages_.count(change.id)) {
+            if (change.deleted) {
+                records.push_back({ MESSAGE, change.id, "", tombstone(change.id, stored), true });
+            } else {
+                Client::Email email = email_from_json(
+                        QJsonDocument::fromJson(read(messages_[change.id])).object());
+                email.labels = change.labels;
+                records.push_back({ MESSAGE, change.id, "", email_to_json(email, stored), false });
+            }
+        }
+        // The thread has gained or lost a message, so we must fetch it again
+        if ((change.added || change.deleted) && threads_.count(change.threadId))
+            records.push_back({ THREAD, change.threadId, "", tombstone(change.threadId, stored),
+                                true });
+
+        for (auto &pair : listings_) {
+            Listing &listing = pair.second;
+            const std::string &id = listing.threads ? change.threadId : change.id;
+            auto position = std::find(listing.ids.begin(), listing.ids.end(), id);
+            if (change.deleted) {
+                // A thread may still have other messages, so only messages leave
+                if (!listing.threads && position != listing.ids.end()) {
+                    listing.ids.erase(position);
+                    changed.insert(pair.first);
+                }
+            } else if (change.added) {
+                // New messages go at the top.  The page grows rather than pushing its
+                // last item off, since the token for the next page starts after it.
+                if (!in_listing(change.labels, listing.label_id))
+                    continue;
+                if (position != listing.ids.end())
+                    listing.ids.erase(position);
+                listing.ids.push_front(id);
+                changed.insert(pair.first);
+            } else if (affects_listing(change.labels_added, listing.label_id) ||
+                       affects_listing(change.labels_removed, listing.label_id)) {
+                // We can take a message out of the listing, but we don't know where
+                // one should go back in, or whether a thread still belongs
+                if (!listing.threads && !in_listing(change.labels, listing.label_id)) {
+                    if (position != listing.ids.end()) {
+                        listing.ids.erase(position);
+                        changed.insert(pair.first);
+                    }
+                } else {
+                    dropped.insert(pair.first);
+                }
+            }
+        }
+    }
+
+    for (const std::string &key : dropped) {
+        listings_.erase(key);
+        records.push_back({ LISTING, key, "", tombstone(key, stored), true });
+    }
+    for (const std::string &key : changed) {
+        auto iter = listings_.find(key);
+        if (iter != listings_.end())
+            records.push_back(listing_record(key, iter->second));
+    }
+    sync_.history_id = history_id;
+    sync_.synced = stored;
+    records.push_back(sync_record());
+    append(records);
+    return true;
+}
+
+void MetadataStore::stop_sync() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    qint64 stopped = now();
+    std::deque<Record> records;
+    for (const auto &pair : listings_)
+        records.push_back({ LISTING, pair.first, "", tombstone(pair.first, stopped), true });
+    listings_.clear();
+    sync_ = { "", 0, 0 };
+    records.push_back(sync_record());
+    append(records);
+}
+
+bool MetadataStore::get_listing(bool threads, const std::string &label_id,
+                                std::deque<std::string> &ids, std::string &next) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = listings_.find(listing_key(threads, label_id));
+    if (sync_.history_id.empty() || iter == listings_.end())
+        return false;
+    ids = iter->second.ids;
+    next = iter->second.next;
+    return true;
+}
+
+void MetadataStore::put_listing(bool threads, const std::string &label_id,
+                                const std::deque<std::string> &ids, const std::string &next) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sync_.history_id.empty())
+        return;
+    std::string key = listing_key(threads, label_id);
+    Listing &listing = listings_[key];
+    listing = { threads, label_id, ids, next };
+    append({ listing_record(key, listing) });
+}
+
+std::size_t MetadataStore::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return messages_.size();
+}
+
+bool MetadataStore::load() {
+    if (map_)
+        file_.unmap(map_);
+    map_ = nullptr;
+    mapped_ = 0;
+    file_.close();
+    messages_.clear();
+    threads_.clear();
+    listings_.clear();
+    sync_ = { "", 0, 0 };
+    live_ = 0;
+
+    QDir().mkpath(QFileInfo(QString::fromStdString(path_)).absolutePath());
+    file_.setFileName(QString::fromStdString(path_));
+    if (!file_.open(QIODevice::ReadWrite)) {
+        std::cerr << "Could not open metadata store " << path_ << ": "
+                  << file_.errorString().toStdString() << std::endl;
+        return false;
+    }
+    remap();
+
+    // Start over with any file that isn't ours, or is from an older version
+    if (mapped_ < MAGIC_SIZE || std::memcmp(map_, MAGIC, MAGIC_SIZE) != 0) {
+        file_.resize(0);
+        file_.seek(0);
+        file_.write(MAGIC, MAGIC_SIZE);
+        file_.flush();
+        remap();
+        return true;
+    }
+
+    qint64 oldest = now() - max_age_.count();
+    qint64 offset = MAGIC_SIZE;
+    while (offset + RECORD_HEADER <= mapped_) {
+        quint32 length = qFromLittleEndian<quint32>(map_ + offset);
+        char kind = static_cast<char>(map_[offset + 4]);
+        if (offset + RECORD_HEADER + length > mapped_)
+            break;
+        QJsonObject json = QJsonDocument::fromJson(QByteArray::fromRawData(
+                reinterpret_cast<const char*>(map_ + offset + RECORD_HEADER), length)).object();
+        if (json.isEmpty())
+            break;
+
+        std::string id = json["id"].toString().toStdString();
+        Entry entry { offset, length, static_cast<qint64>(json["stored"].toDouble()),
+                      json["historyId"].toString().toStdString() };
+        if (kind == SYNC) {
+            sync_ = { entry.history_id, static_cast<qint64>(json["since"].toDouble()),
+                      static_cast<qint64>(json["synced"].toDouble()) };
+        } else if (kind == LISTING) {
+            if (json["deleted"].toBool()) {
+                listings_.erase(id);
+            } else {
+                Listing &listing = listings_[id];
+                listing = { json["threads"].toBool(), json["labelId"].toString().toStdString(),
+                            {}, json["next"].toString().toStdString() };
+                for (const QJsonValue &item : json["ids"].toArray())
+                    listing.ids.emplace_back(item.toString().toStdString());
+            }
+        } else if (json["deleted"].toBool()) {
+            forget(kind, id);
+        } else if (entry.stored >= oldest) {
+            index(kind, id, entry);
+        }
+        offset += RECORD_HEADER + length;
+    }
+
+    // Drop anything left half-written by a crash
+    if (offset < mapped_) {
+        file_.resize(offset);
+        remap();
+    }
+    return true;
+}
+
+void MetadataStore::compact() {
+    QString path = QString::fromStdString(path_);
+    QFile compacted(path + ".new");
+    if (!compacted.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return;
+
+    // Records written since the last remap are copied from the map too
+    remap();
+    compacted.write(MAGIC, MAGIC_SIZE);
+    for (const Index *table : { &messages_, &threads_ }) {
+        for (const auto &pair : *table) {
+            const Entry &entry = pair.second;
+            compacted.write(reinterpret_cast<const char*>(map_ + entry.offset),
+                            RECORD_HEADER + entry.length);
+        }
+    }
+    for (const auto &pair : listings_) {
+        Record record = listing_record(pair.first, pair.second);
+        compacted.write(frame(record.kind, record.payload));
+    }
+    Record sync = sync_record();
+    compacted.write(frame(sync.kind, sync.payload));
+    if (!compacted.flush()) {
+        compacted.remove();
+        return;
+    }
+    compacted.close();
+
+    if (map_)
+        file_.unmap(map_);
+    map_ = nullptr;
+    mapped_ = 0;
+    file_.close();
+    // rename() won't replace an existing file
+    QFile::remove(path);
+    QFile::rename(path + ".new", path);
+}
+
+void MetadataStore::append(const std::deque<Record> &records) {
+    if (!file_.isOpen() || records.empty())
+        return;
+
+    qint64 offset = file_.size();
+    QByteArray data;
+    std::deque<std::pair<const Record*, Entry>> entries;
+    qint64 stored = now();
+    for (const Record &record : records) {
+        data.append(frame(record.kind, record.payload));
+        Entry entry { offset, static_cast<quint32>(record.payload.size()), stored, record.history_id };
+        entries.emplace_back(&record, entry);
+        offset += RECORD_HEADER + record.payload.size();
+    }
+
+    if (!file_.seek(file_.size()) || file_.write(data) != data.size() || !file_.flush()) {
+        std::cerr << "Could not write metadata store " << path_ << ": "
+                  << file_.errorString().toStdString() << std::endl;
+        return;
+    }
+    // Mapping the whole file again for every batch would cost more than the reads
+    // it saves, so only do so once enough has been written
+    if (file_.size() - mapped_ >= REMAP_SLACK)
+        remap();
+    // Listings and the sync state are kept in memory by the callers
+    for (const auto &pair : entries) {
+        const Record &record = *pair.first;
+        if (record.kind != MESSAGE && record.kind != THREAD)
+            continue;
+        if (record.deleted)
+            forget(record.kind, record.id);
+        else
+            index(record.kind, record.id, pair.second);
+    }
+}
+
+void MetadataStore::index(char kind, const std::string &id, const Entry &entry) {
+    Index &table = (kind == THREAD) ? threads_ : messages_;
+    auto iter = table.find(id);
+    if (iter != table.end()) {
+        live_ -= RECORD_HEADER + iter->second.length;
+        iter->second = entry;
+    } else {
+        table.emplace(id, entry);
+    }
+    live_ += RECORD_HEADER + entry.length;
+}
+
+void MetadataStore::forget(char kind, const std::string &id) {
+    Index &table = (kind == THREAD) ? threads_ : messages_;
+    auto iter = table.find(id);
+    if (iter == table.end())
+        return;
+    live_ -= RECORD_HEADER + iter->second.length;
+    table.erase(iter);
+}
+
+MetadataStore::Record MetadataStore::sync_record() const {
+    QJsonObject json;
+    json["historyId"] = QString::fromStdString(sync_.history_id);
+    json["since"] = static_cast<double>(sync_.since);
+    json["synced"] = static_cast<double>(sync_.synced);
+    return { SYNC, "", sync_.history_id, QJsonDocument(json).toJson(QJsonDocument::Compact), false };
+}
+
+MetadataStore::Record MetadataStore::listing_record(const std::string &key,
+                                                    const Listing &listing) const {
+    QJsonObject json;
+    json["id"] = QString::fromStdString(key);
+    json["threads"] = listing.threads;
+    json["labelId"] = QString::fromStdString(listing.label_id);
+    json["next"] = QString::fromStdString(listing.next);
+    QJsonArray ids;
+    for (const std::string &id : listing.ids)
+        ids.append(QString::fromStdString(id));
+    json["ids"] = ids;
+    return { LISTING, key, "", QJsonDocument(json).toJson(QJsonDocument::Compact), false };
+}
+
+std::string MetadataStore::listing_key(bool threads, const std::string &label_id) {
+    return (threads ? "threads/" : "messages/") + label_id;
+}
+
+void MetadataStore::remap() {
+    if (map_)
+        file_.unmap(map_);
+    map_ = nullptr;
+    mapped_ = file_.size();
+    if (mapped_ > 0)
+        map_ = file_.map(0, mapped_);
+    if (!map_)
+        mapped_ = 0;
+}
+
+QByteArray MetadataStore::read(const Entry &entry) {
+    if (entry.offset + RECORD_HEADER + entry.length <= mapped_)
+        return QByteArray(reinterpret_cast<const char*>(map_ + entry.offset + RECORD_HEADER),
+                          entry.length);
+    // Written since the last remap
+    if (!file_.seek(entry.offset + RECORD_HEADER))
+        return QByteArray();
+    QByteArray payload = file_.read(entry.length);
+    if (payload.size() != static_cast<int>(entry.length))
+        return QByteArray();
+    return payload;
+}
+
+bool MetadataStore::fresh(const Entry &entry, qint64 now) const {
+    if (now - entry.stored < ttl_.count())
+        return true;
+    // Everything stored since we started following the history has been kept up to
+    // date, as long as we keep following it
+    return !sync_.history_id.empty() && entry.stored >= sync_.since &&
+            now - sync_.synced < ttl_.count();
+}
+
+qint64 MetadataStore::now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,180 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/multipart.h>
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+using namespace api;
+
+namespace {
+
+/**
+ * Find the end of the line starting at p, not counting the line break.  Returns the
+ * start of the following line.
+ */
+static const char *next_line(const char *p, const char *end, const char **line_end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+        *line_end = end;
+        return end;
+    }
+    *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+    return eol + 1;
+}
+
+/**
+ * Skip over a block of header lines, calling on_header for each one.  Returns the
+ * start of whatever follows the blank line.
+ */
+template<typename F>
+static const char *skip_headers(const char *p, const char *end, F on_header) {
+    while (p < end) {
+        const char *line_end;
+        const char *next = next_line(p, end, &line_end);
+        if (line_end == p)
+            return next;
+        on_header(p, line_end);
+        p = next;
+    }
+    return end;
+}
+
+static bool has_prefix(const char *p, const char *end, const char *prefix) {
+    std::size_t length = strlen(prefix);
+    return static_cast<std::size_t>(end - p) >= length && strncasecmp(p, prefix, length) == 0;
+}
+
+/**
+ * Pull the index out of a Content-ID such as "<response-3:1234abcd@example.com>".
+ */
+static int content_id_index(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '<'))
+        p++;
+    if (has_prefix(p, end, "response-"))
+        p += strlen("response-");
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    int index = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        index = index * 10 + (*p++ - '0');
+    return index;
+}
+
+}
+
+
+MultipartParser::MultipartParser(const std::string &boundary, const PartHandler &handler) :
+    delimiter_("--" + boundary), handler_(handler), started_(false), done_(false) {
+}
+
+std::string MultipartParser::boundary_from(const std::string &content_type) {
+    const char *start = content_type.c_str();
+    const char *end = start + content_type.size();
+    for (const char *p = start; p < end; p++) {
+        if (has_prefix(p, end, "boundary=") && (p == start || p[-1] == ';' || p[-1] == ' ')) {
+            p += strlen("boundary=");
+            bool quoted = (p < end && *p == '"');
+            if (quoted)
+                p++;
+            const char *q = p;
+            while (q < end && (quoted ? *q != '"' : (*q != ';' && *q != ' ')))
+                q++;
+            return std::string(p, q);
+        }
+    }
+    return "";
+}
+
+void MultipartParser::feed(const char *data, std::size_t length) {
+    if (done_)
+        return;
+    if (pending_.empty()) {
+        // The usual case; work straight off the caller's buffer
+        std::size_t used = consume(data, length, false);
+        pending_.assign(data + used, length - used);
+    } else {
+        pending_.append(data, length);
+        std::size_t used = consume(pending_.data(), pending_.size(), false);
+        pending_.erase(0, used);
+    }
+}
+
+void MultipartParser::finish() {
+    if (done_)
+        return;
+    consume(pending_.data(), pending_.size(), true);
+    pending_.clear();
+    done_ = true;
+}
+
+std::size_t MultipartParser::consume(const char *data, std::size_t length, bool last) {
+    const char *end = data + length;
+    const char *pos = data;
+    while (!done_) {
+        // A delimiter only counts at the start of a line, so that a body can mention
+        // the boundary.  We're always left at the start of a line, so the start of
+        // the data is one.
+        const char *found = pos;
+        while ((found = std::search(found, end, delimiter_.begin(), delimiter_.end())) != end &&
+               found != data && found[-1] != '\n')
+            found++;
+        if (found == end) {
+            if (!last)
+                return pos - data;
+            // A truncated response; whatever we have is the last part.
+            if (started_ && pos < end)
+                dispatch(pos, end - pos);
+            return end - data;
+        }
+
+        // Wait until we know what follows the delimiter, unless there is nothing more
+        const char *after = found + delimiter_.size();
+        bool closing = (end - after >= 2 && after[0] == '-' && after[1] == '-');
+        const char *line_end;
+        const char *next = closing ? end : next_line(after, end, &line_end);
+        if (!closing && next == end && !last)
+            return pos - data;
+
+        if (started_)
+            dispatch(pos, found - pos);
+        started_ = true;
+        done_ = closing;
+        pos = next;
+    }
+    return end - data;
+}
+
+void MultipartParser::dispatch(const char *data, std::size_t length) {
+    const char *end = data + length;
+    // The line break before the delimiter belongs to the delimiter
+    if (end > data && end[-1] == '\n')
+        end--;
+    if (end > data && end[-1] == '\r')
+        end--;
+
+    // The part's own headers, which give us its index
+    int index = -1;
+    const char *p = skip_headers(data, end, [&index](const char *line, const char *line_end) {
+        if (has_prefix(line, line_end, "Content-ID:"))
+            index = content_id_index(line + strlen("Content-ID:"), line_end);
+    });
+
+    // Then the wrapped HTTP response: a status line, its headers, and the body
+    int status = 0;
+    const char *line_end;
+    const char *next = next_line(p, end, &line_end);
+    if (has_prefix(p, line_end, "HTTP/")) {
+        const char *digit = static_cast<const char *>(memchr(p, ' ', line_end - p));
+        while (digit != nullptr && ++digit < line_end && *digit >= '0' && *digit <= '9')
+            status = status * 10 + (*digit - '0');
+        p = skip_headers(next, end, [](const char *, const char *) {});
+    }
+
+    handler_(index, status, p, end - p);
+}
@@ -0,0 +1,824 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/json_reader.h>
+#include <api/parser.h>
+#include <trojita/Encoders.h>
+
+#include <QVariantMap>
+#include <QCryptographicHash>
+
+#include <array>
+
+namespace net = core::net;
+
+namespace api {
+namespace parser {
+
+QString unescape(QString input) {
+    return input.replace("&quot;", "\"").replace("&#39;", "'").replace("&gt;", ">")
+            .replace("&lt;", "<").replace("&amp;", "&");
+}
+
+namespace {
+
+/**
+ * Characters that end an unquoted word in an address list
+ */
+static bool is_special(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '"' || c == '(' ||
+            c == ')' || c == '<' || c == ',' || c == ';' || c == ':';
+}
+
+static void append_word(std::string &phrase, const char *begin, const char *end) {
+    if (!phrase.empty())
+        phrase += ' ';
+    phrase.append(begin, end - begin);
+}
+
+/**
+ * Find the closing parenthesis of the comment opened at p, or the end.  Comments
+ * nest, and may escape their parentheses.
+ */
+static const char *comment_end(const char *p, const char *end) {
+    int depth = 0;
+    for (; p < end; p++) {
+        if (*p == '\\' && p + 1 < end)
+            p++;
+        else if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p;
+    }
+    return end;
+}
+
+/**
+ * Split an RFC 5322 address list into its mailboxes, in a single pass, calling
+ * on_mailbox with the display name and address of each.
+ *
+ * Quoted strings may hold commas, comments are dropped (though a comment stands
+ * in for a missing display name, as in "joe@example.com (Joe)"), and groups are
+ * flattened into their members.  Anything malformed is taken as it comes, rather
+ * than rejected.
+ */
+template<typename F>
+static void tokenize_addresses(const char *p, const char *end, F on_mailbox) {
+    // The words of the display name, separated by single spaces
+    std::string phrase;
+    // Everything outside of comments and angle brackets, without whitespace, which
+    // is the address when there are no angle brackets
+    std::string spec;
+    std::string address;
+    std::string comment;
+    bool angle = false;
+
+    auto finish = [&]() {
+        if (angle)
+            on_mailbox(!phrase.empty() ? phrase : !comment.empty() ? comment : address, address);
+        else if (!spec.empty())
+            on_mailbox(!comment.empty() ? comment : spec, spec);
+        phrase.clear();
+        spec.clear();
+        address.clear();
+        comment.clear();
+        angle = false;
+    };
+
+    while (p < end) {
+        char c = *p;
+        if (c == '"') {
+            const char *begin = ++p;
+            if (!phrase.empty())
+                phrase += ' ';
+            while (p < end && *p != '"') {
+                if (*p == '\\' && p + 1 < end)
+                    p++;
+                phrase += *p++;
+            }
+            if (p < end)
+                p++;
+            spec += '"';
+            spec.append(begin, p - begin);
+        } else if (c == '(') {
+            const char *close = comment_end(p, end);
+            if (comment.empty())
+                append_word(comment, p + 1, close);
+            p = close < end ? close + 1 : end;
+        } else if (c == '<') {
+            // The address itself may have comments and folding whitespace in it
+            address.clear();
+            for (p++; p < end && *p != '>'; p++) {
+                if (*p == '(') {
+                    p = comment_end(p, end);
+                    if (p == end)
+                        break;
+                } else if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                    address += *p;
+                }
+            }
+            angle = true;
+            if (p < end)
+                p++;
+        } else if (c == ',' || c == ';') {
+            finish();
+            p++;
+        } else if (c == ':') {
+            // What came before was the name of a group, whose members follow
+            phrase.clear();
+            spec.clear();
+            comment.clear();
+            p++;
+        } else if (is_special(c)) {
+            p++;
+        } else {
+            const char *begin = p;
+            while (p < end && !is_special(*p))
+                p++;
+            append_word(phrase, begin, p);
+            spec.append(begin, p - begin);
+        }
+    }
+    finish();
+}
+
+/**
+ * Move past whitespace and comments
+ */
+static const char *skip_cfws(const char *p, const char *end) {
+    while (p < end) {
+        if (*p == '(')
+            p = comment_end(p, end);
+        else if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            break;
+        if (p < end)
+            p++;
+    }
+    return p;
+}
+
+static bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/**
+ * Read up to max_digits decimal digits, returning how many there were
+ */
+static int read_number(const char *&p, const char *end, int max_digits, int &value) {
+    int digits = 0;
+    value = 0;
+    while (p < end && digits < max_digits && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+        digits++;
+    }
+    return digits;
+}
+
+/**
+ * Read a word, lower-cased, into a short buffer
+ */
+static std::string read_word(const char *&p, const char *end) {
+    std::string word;
+    while (p < end && is_alpha(*p)) {
+        word += static_cast<char>(*p | 0x20);
+        p++;
+    }
+    return word;
+}
+
+/**
+ * Days from 1970-01-01 to the given date in the proleptic Gregorian calendar
+ */
+static std::int64_t days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int year_of_era = year - era * 400;
+    int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return static_cast<std::int64_t>(era) * 146097 + day_of_era - 719468;
+}
+
+/**
+ * Add a contact, decoding any RFC 2047 encoded words in the name
+ */
+static void add_contact(Client::ContactList &contacts, const std::string &name,
+                        const std::string &address) {
+    contacts.emplace_back();
+    Client::Contact &contact = contacts.back();
+    if (name.find("=?") != std::string::npos)
+        contact.name = Imap::decodeRFC2047String(QByteArray(name.data(), name.size())).toStdString();
+    else
+        contact.name = name;
+    contact.address = address;
+
+    std::string key = address;
+    for (char &c : key) {
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+    }
+    std::string hash = QCryptographicHash::hash(QByteArray(key.data(), key.size()),
+                                                QCryptographicHash::Algorithm::Md5).toHex().constData();
+    contact.gravatar = "https://secure.gravatar.com/avatar/" + hash + "?d=identicon";
+}
+
+static Client::ContactList read_contacts(const char *begin, const char *end) {
+    Client::ContactList contacts;
+    tokenize_addresses(begin, end, [&contacts](const std::string &name,
+                                               const std::string &address) {
+        add_contact(contacts, name, address);
+    });
+    return contacts;
+}
+
+static Client::Contact read_contact(const char *begin, const char *end) {
+    Client::ContactList contacts = read_contacts(begin, end);
+    if (contacts.empty())
+        add_contact(contacts, "", "");
+    return contacts.front();
+}
+
+}
+
+bool parse_date(const std::string &input, std::int64_t &date, int &offset) {
+    static const char *MONTHS[] = {
+        "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"
+    };
+    // The obsolete zone names; the military ones are meaningless, and count as UTC
+    static const struct { const char *name; int offset; } ZONES[] = {
+        { "ut", 0 }, { "gmt", 0 }, { "edt", -4 * 60 }, { "est", -5 * 60 },
+        { "cdt", -5 * 60 }, { "cst", -6 * 60 }, { "mdt", -6 * 60 }, { "mst", -7 * 60 },
+        { "pdt", -7 * 60 }, { "pst", -8 * 60 }
+    };
+
+    const char *p = input.data();
+    const char *end = p + input.size();
+
+    // The day of the week is optional, and tells us nothing new
+    p = skip_cfws(p, end);
+    if (p < end && is_alpha(*p)) {
+        read_word(p, end);
+        p = skip_cfws(p, end);
+        if (p < end && *p == ',')
+            p = skip_cfws(p + 1, end);
+    }
+
+    int day, year, hour, minute, second = 0;
+    if (read_number(p, end, 2, day) == 0)
+        return false;
+    p = skip_cfws(p, end);
+    std::string name = read_word(p, end);
+    int month = 0;
+    while (month < 12 && name.compare(0, 3, MONTHS[month]) != 0)
+        month++;
+    if (month == 12 || name.size() < 3)
+        return false;
+    month += 1;
+    p = skip_cfws(p, end);
+    int digits = read_number(p, end, 4, year);
+    if (digits < 2)
+        return false;
+    // Two- and three-digit years are obsolete, but still turn up
+    if (digits == 2)
+        year += year < 50 ? 2000 : 1900;
+    else if (digits == 3)
+        year += 1900;
+
+    p = skip_cfws(p, end);
+    if (read_number(p, end, 2, hour) == 0)
+        return false;
+    p = skip_cfws(p, end);
+    if (p == end || *p != ':')
+        return false;
+    p = skip_cfws(p + 1, end);
+    if (read_number(p, end, 2, minute) == 0)
+        return false;
+    p = skip_cfws(p, end);
+    if (p < end && *p == ':') {
+        p = skip_cfws(p + 1, end);
+        if (read_number(p, end, 2, second) == 0)
+            return false;
+        p = skip_cfws(p, end);
+    }
+    if (day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return false;
+
+    // A missing or unknown zone is taken as UTC, as RFC 2822 says for "-0000"
+    offset = 0;
+    if (p < end && (*p == '+' || *p == '-')) {
+        int sign = *p++ == '-' ? -1 : 1;
+        int zone;
+        if (read_number(p, end, 4, zone) == 4)
+            offset = sign * (zone / 100 * 60 + zone % 100);
+    } else if (p < end && is_alpha(*p)) {
+        name = read_word(p, end);
+        for (const auto &zone : ZONES) {
+            if (name == zone.name)
+                offset = zone.offset;
+        }
+    }
+
+    date = (days_from_civil(year, month, day) * 24 + hour) * 3600 + minute * 60 + second -
+            offset * 60;
+    return true;
+}
+
+Client::Contact parse_contact(const QString &contact_string) {
+    QByteArray utf8 = contact_string.toUtf8();
+    return read_contact(utf8.constData(), utf8.constData() + utf8.size());
+}
+
+Client::ContactList parse_contact_list(const QString &contact_string) {
+    QByteArray utf8 = contact_string.toUtf8();
+    return read_contacts(utf8.constData(), utf8.constData() + utf8.size());
+}
+
+namespace {
+
+/**
+ * Turns a base64url text/plain body into HTML in one pass, with no copy of the
+ * decoded text or of its lines.
+ *
+ * Lines are joined with <br>, except where a line ends in a space, as in format=
+ * flowed text; quoted lines are colored by their depth; and blank lines at the
+ * end are dropped.
+ */
+class BodyWriter {
+public:
+    explicit BodyWriter(std::size_t encoded_size) :
+        quote_level_(0), depth_(0), length_(0), prefix_(true), signature_(true),
+        continued_(false), pending_cr_(false), last_(0) {
+        // Enough for the text and a little markup, so that we rarely grow
+        std::size_t decoded_size = encoded_size / 4 * 3;
+        html_.reserve(decoded_size + decoded_size / 8 + 64);
+    }
+
+    void decode(const char *data, std::size_t length) {
+        static const std::array<signed char, 256> VALUES = base64_values();
+        unsigned long bits = 0;
+        int count = 0;
+        for (const char *p = data, *end = data + length; p < end; p++) {
+            // Padding and anything else out of place is skipped
+            signed char value = VALUES[static_cast<unsigned char>(*p)];
+            if (value < 0)
+                continue;
+            bits = (bits << 6) | value;
+            count += 6;
+            if (count >= 8) {
+                count -= 8;
+                put(static_cast<char>((bits >> count) & 0xff));
+            }
+        }
+    }
+
+    std::string finish() {
+        if (pending_cr_)
+            text('\r');
+        end_line();
+        while (quote_level_ > 0) {
+            html_ += "</font>";
+            quote_level_ -= 1;
+        }
+        // Remove extra blank lines from end
+        std::size_t n = html_.size();
+        while (n > 4 && html_.compare(n - 4, 4, "<br>") == 0)
+            n -= 4;
+        html_.resize(n);
+        return std::move(html_);
+    }
+
+private:
+    static std::array<signed char, 256> base64_values() {
+        std::array<signed char, 256> values;
+        values.fill(-1);
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+        for (int i = 0; i < 62; i++)
+            values[static_cast<unsigned char>(alphabet[i])] = i;
+        // Both the URL-safe characters and the standard ones
+        values['-'] = values['+'] = 62;
+        values['_'] = values['/'] = 63;
+        return values;
+    }
+
+    /**
+     * Take the next decoded byte, treating CRLF as a single line break
+     */
+    void put(char c) {
+        if (pending_cr_) {
+            pending_cr_ = false;
+            if (c == '\n') {
+                end_line();
+                return;
+            }
+            text('\r');
+        }
+        if (c == '\r')
+            pending_cr_ = true;
+        else if (c == '\n')
+            end_line();
+        else
+            text(c);
+    }
+
+    void text(char c) {
+        if (prefix_) {
+            if (c == '>') {
+                depth_ += 1;
+                return;
+            }
+            start_text();
+            // One space after the quote marks belongs to them
+            if (c == ' ')
+                return;
+        }
+        html_ += c;
+        if (length_ >= 3 || c != "-- "[length_])
+            signature_ = false;
+        length_ += 1;
+        last_ = c;
+    }
+
+    /**
+     * Open or close fonts to match the depth of the quote marks we've just read
+     */
+    void start_text() {
+        prefix_ = false;
+        if (continued_ && quote_level_ != depth_)
+            html_ += "<br>";
+        while (quote_level_ < depth_) {
+            html_ += "<font color='";
+            html_ += COLORS[quote_level_ % 6];
+            html_ += "'>";
+            quote_level_ += 1;
+        }
+        while (quote_level_ > depth_) {
+            html_ += "</font>";
+            quote_level_ -= 1;
+        }
+    }
+
+    void end_line() {
+        if (prefix_)
+            start_text();
+        // The signature separator ends in a space, but doesn't continue
+        continued_ = length_ > 0 && last_ == ' ' && !(length_ == 3 && signature_);
+        if (!continued_)
+            html_ += "<br>";
+        prefix_ = true;
+        signature_ = true;
+        depth_ = 0;
+        length_ = 0;
+        last_ = 0;
+    }
+
+    static const char *const COLORS[6];
+
+    std::string html_;
+
+    int quote_level_;
+
+    /**
+     * The quote marks at the start of this line
+     */
+    int depth_;
+
+    /**
+     * Characters of this line after the quote marks
+     */
+    std::size_t length_;
+
+    bool prefix_;
+
+    /**
+     * Whether this line could still be "-- "
+     */
+    bool signature_;
+
+    bool continued_;
+
+    bool pending_cr_;
+
+    char last_;
+};
+
+const char *const BodyWriter::COLORS[6] = {
+    "#9a5d9a", "#7474a7", "#3f8c8c", "#4c914c", "#818115", "#9f6666"
+};
+
+/**
+ * Fill in the header, if it's one we show
+ */
+static void apply_header(Client::Header &header, const std::string &name,
+                         const std::string &value) {
+    const char *begin = value.data();
+    const char *end = begin + value.size();
+    if (name == "Date")
+        parse_date(value, header.date, header.date_offset);
+    else if (name == "From")
+        header.from = read_contact(begin, end);
+    else if (name == "To")
+        header.to = read_contacts(begin, end);
+    else if (name == "Cc")
+        header.cc = read_contacts(begin, end);
+    else if (name == "Reply-To")
+        header.replyto = read_contact(begin, end);
+    else if (name == "Subject")
+        header.subject = value;
+    else if (name == "Message-ID" || name == "Message-Id")
+        header.messageId = value;
+}
+
+static void read_headers(JsonReader &reader, Client::Header &header) {
+    if (!reader.begin_array())
+        return;
+    std::string key;
+    while (reader.next_element()) {
+        std::string name, value;
+        if (!reader.begin_object())
+            continue;
+        while (reader.next_key(key)) {
+            if (key == "name")
+                name = reader.read_string();
+            else if (key == "value")
+                value = reader.read_string();
+            else
+                reader.skip();
+        }
+        apply_header(header, name, value);
+    }
+}
+
+/**
+ * Read a payload, like parse_payload, and its headers if we're given somewhere to
+ * put them.  Only the top level of a message has the headers we want.
+ */
+static std::string read_payload(JsonReader &reader, Client::Header *header) {
+    std::string mime_type, data, body;
+    bool found = false;
+    if (!reader.begin_object())
+        return body;
+    std::string key;
+    while (reader.next_key(key)) {
+        if (key == "mimeType") {
+            mime_type = reader.read_string();
+        } else if (key == "headers" && header) {
+            read_headers(reader, *header);
+        } else if (key == "body") {
+            if (!reader.begin_object())
+                continue;
+            while (reader.next_key(key)) {
+                if (key == "data")
+                    data = reader.read_string();
+                else
+                    reader.skip();
+            }
+        } else if (key == "parts") {
+            if (!reader.begin_array())
+                continue;
+            // Once we have a body, the rest of the parts are skipped unread
+            while (reader.next_element()) {
+                if (found) {
+                    reader.skip();
+                } else {
+                    body = read_payload(reader, nullptr);
+                    found = !body.empty();
+                }
+            }
+        } else {
+            reader.skip();
+        }
+    }
+    if (mime_type.compare(0, 9, "multipart") == 0)
+        return body;
+    if (mime_type == "text/plain")
+        return decode(QByteArray::fromRawData(data.data(), static_cast<int>(data.size())));
+    return "";
+}
+
+static Client::Email read_email(JsonReader &reader) {
+    Client::Email message;
+    if (!reader.begin_object())
+        return message;
+    std::string key;
+    while (reader.next_key(key)) {
+        if (key == "id") {
+            message.id = reader.read_string();
+        } else if (key == "threadId") {
+            message.threadId = reader.read_string();
+        } else if (key == "snippet") {
+            message.snippet = unescape(QString::fromStdString(reader.read_string())).toStdString();
+        } else if (key == "payload") {
+            message.body = read_payload(reader, &message.header);
+        } else if (key == "labelIds") {
+            if (!reader.begin_array())
+                continue;
+            while (reader.next_element())
+                message.labels.emplace_back(reader.read_string());
+        } else {
+            reader.skip();
+        }
+    }
+    return message;
+}
+
+}
+
+Client::Header parse_header(const QVariant &headers) {
+    QVariantList header_list = headers.toList();
+    Client::Header header;
+    for (const QVariant &i : header_list) {
+        QVariantMap item = i.toMap();
+        apply_header(header, item["name"].toString().toStdString(),
+                     item["value"].toString().toStdString());
+    }
+    return header;
+}
+
+std::string decode(const QVariant &encoded) {
+    return decode(encoded.toByteArray());
+}
+
+std::string decode(const QByteArray &encoded) {
+    BodyWriter writer(encoded.size());
+    writer.decode(encoded.constData(), encoded.size());
+    return writer.finish();
+}
+
+std::string parse_payload(const QVariant &p) {
+    QVariantMap payload = p.toMap();
+    if (payload["mimeType"].toString().startsWith("multipart")) {
+        QVariantList parts = payload["parts"].toList();
+        for (const QVariant &part : parts) {
+            std::string body = parse_payload(part);
+            if (body != "")
+                return body;
+        }
+    } else if (payload["mimeType"] == "text/plain") {
+        return decode(payload["body"].toMap()["data"]);
+    }
+    return "";
+}
+
+Client::Labels parse_labels(const QVariant &l) {
+    QVariantList labelids = l.toList();
+    Client::Labels labels;
+    for (const QVariant &i : labelids)
+        labels.emplace_back(i.toString().toStdString());
+    return labels;
+}
+
+Client::Email parse_email(const QVariant &i) {
+    QVariantMap item = i.toMap();
+    Client::Email message;
+    message.id = item["id"].toString().toStdString();
+    message.threadId = item["threadId"].toString().toStdString();
+    message.snippet = unescape(item["snippet"].toString()).toStdString();
+    message.header = parse_header(item["payload"].toMap()["headers"]);
+    message.body = parse_payload(item["payload"]);
+    message.labels = parse_labels(item["labelIds"]);
+    return message;
+}
+
+Client::Email parse_email(const QByteArray &json) {
+    JsonReader reader(json.constData(), json.size());
+    Client::Email message = read_email(reader);
+    // Half a message would be cached as if it were the whole thing
+    if (reader.failed())
+        return Client::Email();
+    return message;
+}
+
+Client::EmailList parse_email_list(const QByteArray &json, std::string &next) {
+    JsonReader reader(json.constData(), json.size());
+    Client::EmailList messages;
+    next.clear();
+    if (!reader.begin_object())
+        return messages;
+    std::string key;
+    while (reader.next_key(key)) {
+        if (key == "messages") {
+            if (!reader.begin_array())
+                continue;
+            while (reader.next_element())
+                messages.emplace_back(read_email(reader));
+        } else if (key == "nextPageToken") {
+            next = reader.read_string();
+        } else {
+            reader.skip();
+        }
+    }
+    if (reader.failed()) {
+        messages.clear();
+        next.clear();
+    }
+    return messages;
+}
+
+Client::ThreadList parse_thread_list(const QByteArray &json, std::string &next) {
+    JsonReader reader(json.constData(), json.size());
+    Client::ThreadList threads;
+    next.clear();
+    if (!reader.begin_object())
+        return threads;
+    std::string key;
+    while (reader.next_key(key)) {
+        if (key == "threads") {
+            if (!reader.begin_array())
+                continue;
+            while (reader.next_element()) {
+                Client::Thread thread;
+                if (!reader.begin_object())
+                    continue;
+                while (reader.next_key(key)) {
+                    if (key == "id")
+                        thread.id = reader.read_string();
+                    else if (key == "historyId")
+                        thread.historyId = reader.read_string();
+                    else if (key == "snippet")
+                        thread.snippet = unescape(QString::fromStdString(
+                                                      reader.read_string())).toStdString();
+                    else
+                        reader.skip();
+                }
+                threads.emplace_back(thread);
+            }
+        } else if (key == "nextPageToken") {
+            next = reader.read_string();
+        } else {
+            reader.skip();
+        }
+    }
+    if (reader.failed()) {
+        threads.clear();
+        next.clear();
+    }
+    return threads;
+}
+
+Client::EmailList parse_thread(const QByteArray &json, std::string &history_id) {
+    JsonReader reader(json.constData(), json.size());
+    Client::EmailList messages;
+    history_id.clear();
+    if (!reader.begin_object())
+        return messages;
+    std::string key;
+    while (reader.next_key(key)) {
+        if (key == "messages") {
+            if (!reader.begin_array())
+                continue;
+            while (reader.next_element())
+                messages.emplace_back(read_email(reader));
+        } else if (key == "historyId") {
+            history_id = reader.read_string();
+        } else {
+            reader.skip();
+        }
+    }
+    if (reader.failed()) {
+        messages.clear();
+        history_id.clear();
+    }
+    return messages;
+}
+
+Client::ChangeList parse_history(const QVariant &h) {
+    Client::ChangeList changes;
+    for (const QVariant &r : h.toList()) {
+        QVariantMap record = r.toMap();
+        const char *types[] = { "messagesAdded", "messagesDeleted", "labelsAdded", "labelsRemoved" };
+        for (int type = 0; type < 4; type++) {
+            for (const QVariant &c : record[types[type]].toList()) {
+                QVariantMap item = c.toMap();
+                QVariantMap message = item["message"].toMap();
+                Client::Change change;
+                change.id = message["id"].toString().toStdString();
+                change.threadId = message["threadId"].toString().toStdString();
+                change.labels = parse_labels(message["labelIds"]);
+                change.added = (type == 0);
+                change.deleted = (type == 1);
+                if (type == 2)
+                    change.labels_added = parse_labels(item["labelIds"]);
+                if (type == 3)
+                    change.labels_removed = parse_labels(item["labelIds"]);
+                changes.emplace_back(change);
+            }
+        }
+    }
+    return changes;
+}
+
+net::Uri::QueryParameters metadata_params() {
+    net::Uri::QueryParameters params = { { "format", "metadata" } };
+    for (std::string header : { "Date", "From", "To", "Cc", "Reply-To", "Subject", "Message-ID", "Message-Id" })
+        params.emplace_back("metadataHeaders", header);
+    return params;
+}
+
+net::Uri::QueryParameters body_params() {
+    return { { "format", "full" }, { "fields", "id,threadId,payload,labelIds" } };
+}
+
+}
+}
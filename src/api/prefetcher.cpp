@@ -0,0 +1,136 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/prefetcher.h>
+
+#include <iostream>
+#include <stdexcept>
+
+using namespace api;
+
+namespace {
+
+static Config::Ptr without_prefetcher(Config::Ptr config) {
+    Config::Ptr copy = std::make_shared<Config>(*config);
+    copy->prefetcher.reset();
+    return copy;
+}
+
+}
+
+
+Prefetcher::Foreground::Foreground(Ptr prefetcher) : prefetcher_(prefetcher) {
+    if (prefetcher_)
+        prefetcher_->foreground_started();
+}
+
+Prefetcher::Foreground::~Foreground() {
+    if (prefetcher_)
+        prefetcher_->foreground_finished();
+}
+
+
+Prefetcher::Prefetcher(Config::Ptr config) :
+    config_(without_prefetcher(config)), paging_(false), interrupted_(false), foreground_(0),
+    stopped_(false) {
+    worker_ = std::thread(&Prefetcher::run, this);
+}
+
+Prefetcher::~Prefetcher() {
+    shutdown();
+}
+
+void Prefetcher::prefetch(const std::deque<std::string> &ids) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = ids;
+    cv_.notify_all();
+}
+
+void Prefetcher::prefetch_page(bool threads, const std::string &query,
+                               const std::string &label_id, const std::string &token) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    page_.reset(new Page { threads, query, label_id, token });
+    if (current_ && paging_)
+        current_->cancel();
+    cv_.notify_all();
+}
+
+void Prefetcher::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        pending_.clear();
+        page_.reset();
+        if (current_)
+            current_->cancel();
+        cv_.notify_all();
+    }
+    if (worker_.joinable())
+        worker_.join();
+}
+
+void Prefetcher::foreground_started() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    foreground_ += 1;
+    // Get out of the way; the page goes back in line when we're done with it
+    if (current_ && paging_) {
+        current_->cancel();
+        interrupted_ = true;
+    }
+}
+
+void Prefetcher::foreground_finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    foreground_ -= 1;
+    cv_.notify_all();
+}
+
+void Prefetcher::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+        std::deque<std::string> ids;
+        std::unique_ptr<Page> page;
+        if (!pending_.empty())
+            ids.swap(pending_);
+        else if (page_ && foreground_ == 0)
+            page.swap(page_);
+        else {
+            cv_.wait(lock);
+            continue;
+        }
+
+        std::shared_ptr<Client> client = std::make_shared<Client>(config_);
+        current_ = client;
+        paging_ = bool(page);
+        interrupted_ = false;
+        lock.unlock();
+        // Nobody is waiting on this, so failures just mean it's fetched when needed
+        try {
+            if (page)
+                fetch_page(*client, *page);
+            else
+                client->messages_prefetch(ids);
+        } catch (std::exception &e) {
+            std::cerr << "Prefetch failed: " << e.what() << std::endl;
+        }
+        lock.lock();
+        current_.reset();
+
+        // Try an interrupted page again later, unless there's a newer one by now
+        if (page && interrupted_ && !page_ && !stopped_)
+            page_.swap(page);
+    }
+}
+
+void Prefetcher::fetch_page(Client &client, const Page &page) {
+    if (page.threads) {
+        Client::ThreadListRes res = client.threads_list(page.query, page.label_id, page.token);
+        client.threads_get_batch(res.first);
+    } else {
+        Client::EmailListRes res = client.messages_list(page.query, page.label_id, page.token);
+        client.messages_get_batch(res.first);
+    }
+}
@@ -0,0 +1,83 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/services.h>
+#include <api/connection_pool.h>
+#include <api/email_cache.h>
+#include <api/executor.h>
+#include <api/metadata_store.h>
+#include <api/prefetcher.h>
+#include <api/single_flight.h>
+#include <api/token_provider.h>
+
+#include <iostream>
+
+using namespace api;
+
+
+void api::start_services(Config::Ptr config, std::shared_ptr<TokenProvider> tokens,
+                         const std::string &store_path) {
+    config->pool = std::make_shared<ConnectionPool>(config->max_connections_per_host,
+                                                    config->connection_idle_timeout);
+    config->tokens = tokens ? tokens :
+                              std::make_shared<TokenProvider>(config->token_lifetime,
+                                                              config->token_refresh_margin);
+    config->flights = std::make_shared<SingleFlight>();
+    config->executor = std::make_shared<Executor>(config->executor_threads);
+    config->parsers = std::make_shared<Executor>(config->parse_threads);
+    config->revalidator = std::make_shared<Executor>(config->revalidate_threads);
+    config->emails = std::make_shared<EmailCache>(config->email_cache_bytes,
+                                                  config->metadata_ttl);
+    config->bodies = std::make_shared<BodyCache>(config->body_cache_bytes,
+                                                 config->metadata_ttl);
+    config->pages = std::make_shared<PageCache>(config->page_cache_bytes, config->page_ttl);
+    config->results = std::make_shared<ResultCache>(config->result_cache_bytes,
+                                                    config->result_ttl);
+
+    // Message metadata persists between runs, if we have somewhere to keep it
+    if (!store_path.empty()) {
+        try {
+            config->metadata = std::make_shared<MetadataStore>(store_path, config->metadata_ttl,
+                                                               config->metadata_max_age);
+        } catch (std::exception &e) {
+            std::cerr << "No metadata store: " << e.what() << std::endl;
+        }
+    }
+
+    // Made last, since it copies everything else
+    config->prefetcher = std::make_shared<Prefetcher>(config);
+}
+
+void api::stop_services(Config::Ptr config) {
+    // Stop the prefetcher first, as it may be using everything else
+    if (config->prefetcher) {
+        config->prefetcher->shutdown();
+        config->prefetcher.reset();
+    }
+    if (config->revalidator) {
+        config->revalidator->shutdown();
+        config->revalidator.reset();
+    }
+    if (config->executor) {
+        config->executor->shutdown();
+        config->executor.reset();
+    }
+    // Only once nothing else can be waiting for them
+    if (config->parsers) {
+        config->parsers->shutdown();
+        config->parsers.reset();
+    }
+    if (config->pool) {
+        config->pool->shutdown();
+        config->pool.reset();
+    }
+    config->tokens.reset();
+    config->metadata.reset();
+    config->emails.reset();
+    config->bodies.reset();
+    config->pages.reset();
+    config->results.reset();
+}
@@ -0,0 +1,87 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/single_flight.h>
+
+#include <algorithm>
+#include <chrono>
+
+using namespace api;
+
+
+SingleFlight::Ticket::Ticket(SingleFlight &flights, const std::string &key,
+                             const std::atomic<bool> &cancelled) :
+    flights_(flights), key_(key), cancelled_(cancelled), leader_(false), done_(false) {
+    std::lock_guard<std::mutex> lock(flights_.mutex_);
+    std::shared_ptr<Flight> &flight = flights_.flights_[key_];
+    if (!flight) {
+        flight = std::make_shared<Flight>();
+        flight->result = flight->promise.get_future().share();
+        leader_ = true;
+    }
+    flight->waiters.emplace_back(&cancelled_);
+    flight_ = flight;
+}
+
+SingleFlight::Ticket::~Ticket() {
+    // Don't leave anyone waiting on a request that will never be made
+    if (leader_ && !done_)
+        publish(QByteArray());
+
+    std::lock_guard<std::mutex> lock(flights_.mutex_);
+    auto &waiters = flight_->waiters;
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), &cancelled_), waiters.end());
+}
+
+bool SingleFlight::Ticket::leader() const {
+    return leader_;
+}
+
+bool SingleFlight::Ticket::abandoned() const {
+    std::lock_guard<std::mutex> lock(flights_.mutex_);
+    for (const std::atomic<bool> *cancelled : flight_->waiters) {
+        if (!*cancelled)
+            return false;
+    }
+    return true;
+}
+
+void SingleFlight::Ticket::publish(const QByteArray &result) {
+    if (!leader_ || done_)
+        return;
+    flights_.land(key_, flight_);
+    flight_->promise.set_value(result);
+    done_ = true;
+}
+
+void SingleFlight::Ticket::fail(std::exception_ptr error) {
+    if (!leader_ || done_)
+        return;
+    flights_.land(key_, flight_);
+    flight_->promise.set_exception(error);
+    done_ = true;
+}
+
+bool SingleFlight::Ticket::ready() const {
+    return flight_->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+bool SingleFlight::Ticket::wait(QByteArray &result) {
+    while (flight_->result.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+        if (cancelled_)
+            return false;
+    }
+    result = flight_->result.get();
+    return true;
+}
+
+void SingleFlight::land(const std::string &key, const std::shared_ptr<Flight> &flight) {
+    // Later callers should start a fresh request, rather than get this result
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = flights_.find(key);
+    if (iter != flights_.end() && iter->second == flight)
+        flights_.erase(iter);
+}
@@ -0,0 +1,135 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/token_provider.h>
+
+#include <unity/scopes/OnlineAccountClient.h>
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+namespace sc = unity::scopes;
+
+using namespace api;
+
+namespace {
+
+/**
+ * How long to wait before asking again, when Online Accounts fails or gives us
+ * back the token we already have
+ */
+const std::chrono::seconds RETRY_DELAY(30);
+
+}
+
+
+TokenProvider::TokenProvider(std::chrono::seconds lifetime, std::chrono::seconds refresh_margin) :
+    lifetime_(lifetime), refresh_margin_(refresh_margin), used_(false), fetching_(false),
+    stopped_(false) {
+}
+
+TokenProvider::~TokenProvider() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        cv_.notify_all();
+    }
+    if (refresher_.joinable())
+        refresher_.join();
+}
+
+std::string TokenProvider::token() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Started here, rather than in the constructor, so that fetch() can be overridden
+    if (!refresher_.joinable())
+        refresher_ = std::thread(&TokenProvider::run, this);
+
+    while (token_.empty() || clock::now() >= expires_) {
+        if (fetching_)
+            cv_.wait(lock);
+        else
+            update(lock);
+    }
+    if (!used_) {
+        used_ = true;
+        cv_.notify_all();
+    }
+    return token_;
+}
+
+void TokenProvider::invalidate(const std::string &token) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (token == token_)
+        token_.clear();
+}
+
+std::string TokenProvider::fetch() {
+    sc::OnlineAccountClient oa_client(SCOPE_NAME, SCOPE_NAME, "google");
+    for (auto const& status : oa_client.get_service_statuses()) {
+        if (status.service_authenticated)
+            return status.access_token;
+    }
+    throw std::runtime_error("Could not authenticate");
+}
+
+void TokenProvider::update(std::unique_lock<std::mutex> &lock) {
+    // Don't hold the lock over the D-Bus round trip, so that readers can keep using
+    // the old token while we get a new one.
+    fetching_ = true;
+    lock.unlock();
+    std::string token;
+    std::exception_ptr error;
+    try {
+        token = fetch();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+
+    fetching_ = false;
+    if (!error) {
+        clock::time_point now = clock::now();
+        if (token != fetched_) {
+            expires_ = now + lifetime_;
+            refresh_ = expires_ - refresh_margin_;
+        } else {
+            // Not renewed yet, so it still expires when we thought it would.  If
+            // that has passed, Online Accounts still vouches for it, for now.
+            if (expires_ <= now)
+                expires_ = now + RETRY_DELAY;
+            refresh_ = std::min(expires_, now + RETRY_DELAY);
+        }
+        fetched_ = token;
+        token_ = token;
+    }
+    cv_.notify_all();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void TokenProvider::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+        // Nobody needs the token kept fresh if nobody has asked for it
+        if (token_.empty() || fetching_ || !used_) {
+            cv_.wait(lock);
+            continue;
+        }
+        if (clock::now() < refresh_) {
+            cv_.wait_until(lock, refresh_);
+            continue;
+        }
+        used_ = false;
+        try {
+            update(lock);
+        } catch (std::exception &) {
+            // Keep the current token until it expires, and try again in a bit
+            used_ = true;
+            cv_.wait_for(lock, RETRY_DELAY);
+        }
+    }
+}
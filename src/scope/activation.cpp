@@ -11,6 +11,7 @@
 #include <unity/scopes/ActionMetadata.h>
 
 #include <iostream>
+#include <stdexcept>
 
 namespace sc = unity::scopes;
 
@@ -24,32 +25,42 @@ Activation::Activation(const sc::Result &result, const sc::ActionMetadata &metad
 }
 
 sc::ActivationResponse Activation::activate() {
+    sc::Result res = result();
+    // Placeholders stand in for messages whose details haven't arrived yet
+    if (res.contains("placeholder"))
+        return sc::ActivationResponse::NotHandled;
+
     std::string widgetId = widget_id();
-    if (widgetId == "reply") {
-        sc::Result res = result();
-        std::string message = action_metadata().scope_data().get_dict()["review"].get_string();
-        std::string to_source = (res["replyto address"].get_string() != "" ? "replyto" : "from");
-        std::string threadid = res["threadid"].get_string();
-        api::Client::Contact replyto;
-        replyto.name = res[to_source + " name"].get_string();
-        replyto.address = res[to_source + " address"].get_string();
-        client_.send_message(replyto, "Re: " + res["subject"].get_string(), message,
-                settings()["from"].get_string(), res["messageId"].get_string(), threadid);
-
-        sc::CannedQuery query(SCOPE_NAME, "threadid:" + threadid, "");
-        return sc::ActivationResponse(query);
-    } else if (widgetId == "modifiers") {
-        std::string id = result()["id"].get_string();
-        std::string actionId = action_id();
-        if (actionId == "mark unread")
-            client_.messages_set_unread(id, true);
-        else if (actionId == "mark read")
-            client_.messages_set_unread(id, false);
-        else if (actionId == "trash")
-            client_.messages_trash(id);
-        else if (actionId == "untrash")
-            client_.messages_untrash(id);
-        return sc::ActivationResponse::ShowPreview;
+    try {
+        if (widgetId == "reply") {
+            std::string message = action_metadata().scope_data().get_dict()["review"].get_string();
+            std::string to_source = (res["replyto address"].get_string() != "" ? "replyto" : "from");
+            std::string threadid = res["threadid"].get_string();
+            api::Client::Contact replyto;
+            replyto.name = res[to_source + " name"].get_string();
+            replyto.address = res[to_source + " address"].get_string();
+            if (replyto.address.empty() || threadid.empty())
+                return sc::ActivationResponse::NotHandled;
+            client_.send_message(replyto, "Re: " + res["subject"].get_string(), message,
+                    settings()["from"].get_string(), res["messageId"].get_string(), threadid);
+
+            sc::CannedQuery query(SCOPE_NAME, "threadid:" + threadid, "");
+            return sc::ActivationResponse(query);
+        } else if (widgetId == "modifiers") {
+            std::string id = res["id"].get_string();
+            std::string actionId = action_id();
+            if (actionId == "mark unread")
+                client_.messages_set_unread(id, true);
+            else if (actionId == "mark read")
+                client_.messages_set_unread(id, false);
+            else if (actionId == "trash")
+                client_.messages_trash(id);
+            else if (actionId == "untrash")
+                client_.messages_untrash(id);
+            return sc::ActivationResponse::ShowPreview;
+        }
+    } catch (std::domain_error &e) {
+        std::cerr << e.what() << std::endl;
     }
     return sc::ActivationResponse::NotHandled;
 }
@@ -7,6 +7,7 @@
 #include <scope/localization.h>
 #include <scope/preview.h>
 #include <api/client.h>
+#include <api/prefetcher.h>
 
 #include <unity/scopes/ColumnLayout.h>
 #include <unity/scopes/PreviewWidget.h>
@@ -14,6 +15,7 @@
 #include <unity/scopes/Result.h>
 #include <unity/scopes/VariantBuilder.h>
 
+#include <future>
 #include <iostream>
 
 namespace sc = unity::scopes;
@@ -27,10 +29,27 @@ Preview::Preview(const sc::Result &result, const sc::ActionMetadata &metadata,
 }
 
 void Preview::cancelled() {
+    client_.cancel();
 }
 
 void Preview::run(sc::PreviewReplyProxy const& reply) {
+    // Keep background prefetches out of our way
+    api::Prefetcher::Foreground foreground(client_.config()->prefetcher);
     sc::Result res = result();
+    // A placeholder has nothing to show or act on until its search finishes loading
+    if (res.contains("placeholder")) {
+        sc::ColumnLayout layout1col(1);
+        layout1col.add_column( { "header" });
+        reply->register_layout( { layout1col });
+        sc::PreviewWidget header("header", "header");
+        header.add_attribute_value("title", sc::Variant(_("Loading...")));
+        reply->push( { header });
+        return;
+    }
+
+    // The body takes another HTTP request, so start it while we build everything else
+    std::future<api::Client::Email> body_fetch = client_.messages_get_async(res["id"].get_string(),
+                                                                            true);
     sc::ColumnLayout layout1col(1), layout2col(2);
     layout1col.add_column( { "header", "recipients", "body", "modifiers", "search header", "searches",
                              "reply", "openers" });
@@ -87,8 +106,8 @@ void Preview::run(sc::PreviewReplyProxy const& reply) {
 
     reply->push( { header, recipients, search_header, searches, reply_widget, openers });
 
-    // The body we get through another HTTP request, so do it last and push it separately
-    api::Client::Email message = client_.messages_get(result()["id"].get_string(), true);
+    // Push the body separately, once it arrives
+    api::Client::Email message = body_fetch.get();
     sc::PreviewWidget body("body", "text");
     body.add_attribute_value("text", sc::Variant(message.body));
 
@@ -6,6 +6,8 @@
 
 #include <boost/algorithm/string/trim.hpp>
 
+#include <api/email_cache.h>
+#include <api/prefetcher.h>
 #include <scope/localization.h>
 #include <scope/query.h>
 #include <scope/svg.h>
@@ -21,7 +23,11 @@
 #include <QDateTime>
 #include <QRegularExpression>
 
+#include <future>
 #include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
 #include <sstream>
 
 namespace sc = unity::scopes;
@@ -120,11 +126,30 @@ static std::string trim_subject(const std::string line) {
     return line;
 }
 
-static std::string short_date(std::string input) {
-    QDateTime email = QDateTime::fromString(input.c_str(), api::TIME_FMT.c_str());
+/**
+ * A message's date in the local time zone, or an invalid one if it has none
+ */
+static QDateTime local_date(std::int64_t date) {
+    if (date == 0)
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(date * 1000);
+}
+
+static std::string long_date(std::int64_t date) {
+    QDateTime email = local_date(date);
     if (!email.isValid())
-        return input;
-    QDateTime now = QDateTime::currentDateTime();
+        return "";
+    return email.toString(api::TIME_FMT.c_str()).toStdString();
+}
+
+/**
+ * How recent a date is depends on the time of the query, which the caller reads
+ * once for all its results
+ */
+static std::string short_date(std::int64_t date, const QDateTime &now) {
+    QDateTime email = local_date(date);
+    if (!email.isValid())
+        return "";
     if (now.date() == email.date())
         /// These strings give short forms of dates and times, depending on how recent they are.
         /// Use the codes from http://qt-project.org/doc/qt-5/qdatetime.html#fromString-2
@@ -152,18 +177,73 @@ static std::string contacts_line(api::Client::ContactList contacts) {
     return ss.str();
 }
 
-static std::string create_emblem(std::string date, std::string color) {
+static std::string create_emblem(std::int64_t date, const QDateTime &now, std::string color) {
     return "data:image/svg+xml;utf8," SVG_FRAGMENT_1 + color + SVG_FRAGMENT_2 +
-            short_date(date) + SVG_FRAGMENT_3;
+            short_date(date, now) + SVG_FRAGMENT_3;
 }
+
+/**
+ * List and fetch what a query shows, handing each message to on_email as it arrives.
+ * Returns false if any of it failed to arrive or was cancelled, since an incomplete
+ * page mustn't be kept in place of the real one.
+ */
+static bool fetch_results(api::Client &client, bool threads, const std::string &thread_id,
+                          const std::string &query, const std::string &label_id,
+                          const std::string &token, const api::Client::EmailHandler &on_email,
+                          api::Client::Page &page) {
+    if (!thread_id.empty()) {
+        page.messages = client.threads_get(thread_id);
+        if (on_email) {
+            for (const api::Client::Email &message : page.messages) {
+                if (!on_email(message))
+                    break;
+            }
+        }
+    } else if (threads) {
+        api::Client::ThreadListRes res = client.threads_list(query, label_id, token);
+        page.next = res.second;
+        page.messages = client.threads_get_batch(res.first, on_email);
+    } else {
+        api::Client::EmailListRes res = client.messages_list(query, label_id, token);
+        page.next = res.second;
+        page.messages = client.messages_get_batch(res.first, on_email);
+    }
+    return !client.failed() && !client.cancelled();
+}
+
+/**
+ * Waits for a background job however we leave the scope, since the job refers to
+ * things that go away with it.  An exception thus can't leave the job running on,
+ * nor let it register anything after the error or login result.
+ */
+class Joiner {
+public:
+    explicit Joiner(std::future<void> &job) :
+        job_(job) {
+    }
+
+    ~Joiner() {
+        if (job_.valid())
+            job_.wait();
+    }
+
+private:
+    std::future<void> &job_;
+};
 }
 
 /**
  * Query class
  */
 Query::Query(const sc::CannedQuery &query, const sc::SearchMetadata &metadata,
-             api::Config::Ptr config) :
-    sc::SearchQueryBase(query, metadata), client_(config) {
+             api::Config::Ptr config, Scheduler::Ptr scheduler) :
+    sc::SearchQueryBase(query, metadata), show_skeletons(false), show_refined(false),
+    prefetch_count(0), prefetch_pages(false), client_(config), scheduler_(scheduler) {
+}
+
+Query::~Query() {
+    if (scheduler_)
+        scheduler_->remove(this);
 }
 
 void Query::cancelled() {
@@ -180,10 +260,41 @@ void Query::init_scope() {
     // 3: Individual with snippets
     thread_messages = (view == 0);
     show_snippets = (view != 1);
+    show_skeletons = config["skeleton"].get_bool();
+    show_refined = config["refine"].get_bool();
+    int prefetch = config["prefetch"].get_int();
+    // 0: The top results
+    // 1: Fewer, on a metered connection
+    // 2: None
+    prefetch_pages = (prefetch == 0);
+    if (prefetch == 0)
+        prefetch_count = client_.config()->prefetch_count;
+    else if (prefetch == 1)
+        prefetch_count = client_.config()->prefetch_count_metered;
+    else
+        prefetch_count = 0;
+}
+
+void Query::register_departments(sc::SearchReplyProxy const& reply,
+                                 const api::Client::LabelList &labels) {
+    const sc::CannedQuery &query(sc::SearchQueryBase::query());
+    // The empty string here is important; it denotes the department to use when none has been
+    // selected by the user.
+    sc::Department::SPtr inbox = sc::Department::create("", query, _("Inbox"));
+    for (const auto label_pair : labels) {
+        sc::Department::SPtr dept = sc::Department::create(label_pair.first, query,
+                                                           label_pair.second);
+        inbox->add_subdepartment(dept);
+    }
+    sc::Department::SPtr all_mail = sc::Department::create("ALL_MAIL", query, _("All mail"));
+    inbox->add_subdepartment(all_mail);
+    reply->register_departments(inbox);
 }
 
 void Query::run(sc::SearchReplyProxy const& reply) {
     init_scope();
+    // Keep background prefetches out of our way
+    api::Prefetcher::Foreground foreground(client_.config()->prefetcher);
 
     try {
         const sc::CannedQuery &query(sc::SearchQueryBase::query());
@@ -195,58 +306,36 @@ void Query::run(sc::SearchReplyProxy const& reply) {
             prefix = query_string.substr(0, sep);
         }
 
-        // The empty string here is important; it denotes the department to use when none has been
-        // selected by the user.
-        sc::Department::SPtr inbox = sc::Department::create("", query, _("Inbox"));
-        api::Client::LabelList labels = client_.get_labels();
-        for (const auto label_pair : labels) {
-            sc::Department::SPtr dept = sc::Department::create(label_pair.first, query,
-                                                               label_pair.second);
-            inbox->add_subdepartment(dept);
-        }
-        sc::Department::SPtr all_mail = sc::Department::create("ALL_MAIL", query, _("All mail"));
-        inbox->add_subdepartment(all_mail);
-        reply->register_departments(inbox);
+        // The labels are only needed for the departments, so they are fetched while we
+        // list the messages.  The departments are registered as soon as they arrive.
+        std::future<void> departments = client_.executor()->submit([this, &reply]() {
+            register_departments(reply, client_.get_labels());
+        });
+        Joiner join_departments(departments);
 
-        api::Client::EmailList messages;
-        std::string next;
-        if (prefix == "threadid") {
-            messages = client_.threads_get(query_string.substr(sep+1, std::string::npos));
-            thread_messages = true;
-        } else {
-            std::string token = "";
-            if (prefix == "more") {
-                size_t sep1 = query_string.find("~~");
-                size_t sep2 = query_string.rfind("~~");
-                dept_id = query_string.substr(sep1+2, sep2 - (sep1+2));
-                token = query_string.substr(sep2+2, std::string::npos);
-                query_string = query_string.substr(sep+1, sep1 - (sep+1));
-            }
-            std::string label_id = dept_id;
-            if (query_string.empty()) {
-                // We only get department info for empty query strings
-                if (label_id == "")
-                    label_id = "INBOX";
-                else if (label_id == "ALL_MAIL")
-                    label_id = "";
-            }
+        // Dates are shown relative to when the query started
+        QDateTime now = QDateTime::currentDateTime();
 
-            if (thread_messages) {
-                api::Client::ThreadListRes res = client_.threads_list(query_string, label_id, token);
-                messages = client_.threads_get_batch(res.first);
-                next = res.second;
-            } else {
-                api::Client::EmailListRes res = client_.messages_list(query_string, label_id, token);
-                messages = client_.messages_get_batch(res.first);
-                next = res.second;
-            }
-        }
-
-        auto single_cat = reply->register_category("messages", "", "",
-                                                   sc::CategoryRenderer(MESSAGE_TEMPLATE));
+        // Each message is pushed as soon as its part of the batch has arrived
+        sc::Category::SCPtr single_cat;
         std::map<std::string,sc::Category::SCPtr> categories;
+        std::deque<std::string> top_ids;
+        std::set<std::string> pushed_ids;
+        bool stopped = false;
+        auto prepare = [&]() {
+            // Departments must be registered before anything is pushed
+            if (departments.valid())
+                departments.get();
+            if (!single_cat)
+                single_cat = reply->register_category("messages", "", "",
+                                                      sc::CategoryRenderer(MESSAGE_TEMPLATE));
+        };
+        auto push_message = [&](const api::Client::Email &message) -> bool {
+            // What a search showed while it waited may come again with its results
+            if (!pushed_ids.insert(message.id).second)
+                return true;
+            prepare();
 
-        for (const api::Client::Email message : messages){
             bool unread = false;
             bool draft = false;
             for (const std::string &label : message.labels) {
@@ -257,7 +346,7 @@ void Query::run(sc::SearchReplyProxy const& reply) {
             }
             // Don't display drafts
             if (draft)
-                continue;
+                return true;
 
             sc::Category::SCPtr cat = single_cat;
             if (thread_messages) {
@@ -283,11 +372,12 @@ void Query::run(sc::SearchReplyProxy const& reply) {
             res.set_title(title.str());
 
             res["subject"] = message.header.subject;
-            res["date"] = message.header.date;
+            res["date"] = long_date(message.header.date);
             if (show_snippets)
                 res["snippet"] = message.snippet;
             res["gravatar"] = message.header.from.gravatar;
-            res["emblem"] = create_emblem(message.header.date, unread ? "black" : "#7a7a7a");
+            res["emblem"] = create_emblem(message.header.date, now,
+                                          unread ? "black" : "#7a7a7a");
 
             res["from name"] = message.header.from.name;
             res["from address"] = message.header.from.address;
@@ -309,10 +399,206 @@ void Query::run(sc::SearchReplyProxy const& reply) {
             // Push the result
             if (!reply->push(res)) {
                 // If the push fails, it means the query has been cancelled.  So quit.
+                stopped = true;
+                return false;
+            }
+            if (top_ids.size() < prefetch_count)
+                top_ids.emplace_back(message.id);
+            return true;
+        };
+
+        // A stand-in for something whose details we don't have yet.  Opening it shows
+        // its thread, by which time they should have arrived, so it needs a thread id.
+        // Previews and activations leave placeholders alone.
+        auto push_placeholder = [&](const std::string &id, const std::string &thread_id,
+                                    const std::string &snippet) -> bool {
+            if ((!id.empty() && pushed_ids.count(id)) || categories.count(thread_id))
+                return true;
+            prepare();
+            sc::CategorisedResult res(single_cat);
+            sc::CannedQuery thread_query(SCOPE_NAME, "threadid:" + thread_id, "");
+            res.set_uri(thread_query.to_uri());
+            res["id"] = id;
+            res["placeholder"] = true;
+            res.set_title(_("Loading..."));
+            if (show_snippets)
+                res["snippet"] = snippet;
+            res["threadid"] = thread_id;
+            if (!reply->push(res)) {
+                stopped = true;
+                return false;
+            }
+            return true;
+        };
+
+        std::string label_id;
+        std::string token;
+        std::string thread_id;
+        if (prefix == "threadid") {
+            thread_id = query_string.substr(sep+1, std::string::npos);
+            thread_messages = true;
+        } else {
+            if (prefix == "more") {
+                size_t sep1 = query_string.find("~~");
+                size_t sep2 = query_string.rfind("~~");
+                dept_id = query_string.substr(sep1+2, sep2 - (sep1+2));
+                token = query_string.substr(sep2+2, std::string::npos);
+                query_string = query_string.substr(sep+1, sep1 - (sep+1));
+            }
+            label_id = dept_id;
+            if (query_string.empty()) {
+                // We only get department info for empty query strings
+                if (label_id == "")
+                    label_id = "INBOX";
+                else if (label_id == "ALL_MAIL")
+                    label_id = "";
+            }
+        }
+
+        // Going back to something we've just shown shows it again straight away, while
+        // we check in the background for anything new for next time
+        api::ResultCache::Ptr results = client_.config()->results;
+        std::string key = api::ResultCache::key(query_string, label_id, token, thread_messages,
+                                                show_snippets);
+        api::Client::Page page;
+        std::string next;
+        bool refresh = false;
+        // What the skeletons were listed from, so that the refresh needn't list again
+        api::Client::Page listing;
+        bool listed = false;
+        bool cached = results && results->get(key, page);
+        if (scheduler_ && !cached) {
+            // While the user is still typing, we may show what the last search found
+            // that also matches this one, and only go to the network once they pause
+            if (show_refined) {
+                for (const api::Client::Email &message :
+                         scheduler_->refine(query_string, label_id, thread_messages)) {
+                    if (!push_message(message))
+                        break;
+                }
+            }
+            if (stopped || !scheduler_->settle(this) || client_.cancelled())
                 return;
+        }
+
+        if (cached) {
+            for (const api::Client::Email &message : page.messages) {
+                if (!push_message(message))
+                    break;
+            }
+            next = page.next;
+            refresh = true;
+            if (scheduler_)
+                scheduler_->remember(query_string, label_id, thread_messages, page.messages);
+
+        } else if (show_skeletons && thread_id.empty()) {
+            // Show what we have now; the rest of the details are fetched in the
+            // background, for when the user looks closer or comes back
+            if (thread_messages) {
+                api::Client::ThreadListRes res = client_.threads_list(query_string, label_id, token);
+                next = res.second;
+                listing.threads = res.first;
+                for (const api::Client::Thread &thread : res.first) {
+                    api::Client::EmailList cached;
+                    bool pushed = true;
+                    if (client_.thread_cached(thread, cached)) {
+                        for (const api::Client::Email &message : cached) {
+                            if (!(pushed = push_message(message)))
+                                break;
+                        }
+                    } else {
+                        pushed = push_placeholder("", thread.id, thread.snippet);
+                    }
+                    if (!pushed)
+                        break;
+                }
+            } else {
+                api::Client::EmailListRes res = client_.messages_list(query_string, label_id, token);
+                next = res.second;
+                listing.messages = res.first;
+                // Listings kept from the history don't say which thread a message is
+                // in, and a placeholder without one would have nothing to open
+                api::Client::EmailList unknown;
+                for (const api::Client::Email &message : res.first) {
+                    api::Client::Email cached;
+                    bool pushed = true;
+                    if (client_.message_cached(message.id, cached))
+                        pushed = push_message(cached);
+                    else if (!message.threadId.empty())
+                        pushed = push_placeholder(message.id, message.threadId, "");
+                    else
+                        unknown.emplace_back(message);
+                    if (!pushed)
+                        break;
+                }
+                if (!stopped && !unknown.empty())
+                    client_.messages_get_batch(unknown, push_message);
+            }
+            listing.next = next;
+            // A listing that didn't arrive is tried again from scratch
+            listed = !client_.failed() && !client_.cancelled();
+            refresh = true;
+
+        } else {
+            bool complete = fetch_results(client_, thread_messages, thread_id, query_string,
+                                          label_id, token, push_message, page);
+            next = page.next;
+            if (complete && !stopped) {
+                if (results)
+                    results->put(key, page);
+                if (scheduler_)
+                    scheduler_->remember(query_string, label_id, thread_messages,
+                                         page.messages);
             }
         }
 
+        if (refresh) {
+            // Revalidation has its own lane, so it never holds up a query's own requests
+            api::Config::Ptr config = client_.config();
+            api::Executor::Ptr lane = config->revalidator ? config->revalidator :
+                                                            client_.executor();
+            // A waiting job mustn't keep the configuration, and with it the
+            // executors, alive once the scope has let them go
+            std::weak_ptr<api::Config> weak_config = config;
+            bool threads = thread_messages;
+            lane->post([=]() {
+                api::Config::Ptr current = weak_config.lock();
+                if (!current)
+                    return;
+                try {
+                    api::Client background(current);
+                    api::Client::Page fresh;
+                    bool complete;
+                    if (listed) {
+                        fresh.next = listing.next;
+                        fresh.messages = threads ?
+                                    background.threads_get_batch(listing.threads) :
+                                    background.messages_get_batch(listing.messages);
+                        complete = !background.failed();
+                    } else {
+                        complete = fetch_results(background, threads, thread_id, query_string,
+                                                 label_id, token, api::Client::EmailHandler(),
+                                                 fresh);
+                    }
+                    if (results && complete)
+                        results->put(key, fresh);
+                } catch (std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                }
+            });
+        }
+
+        if (stopped)
+            return;
+        // Even with no messages, the departments come before the "more" result
+        if (departments.valid())
+            departments.get();
+
+        // The user will most likely look at one of these next
+        api::Config::Ptr config = client_.config();
+        if (config->prefetcher && !top_ids.empty())
+            config->prefetcher->prefetch(top_ids);
+
         if (!next.empty()) {
             auto cat = reply->register_category("more", "", "",
                                                 sc::CategoryRenderer(MORE_TEMPLATE));
@@ -322,6 +608,10 @@ void Query::run(sc::SearchReplyProxy const& reply) {
             sc::CannedQuery q(SCOPE_NAME, "more:" + query_string + "~~" + dept_id + "~~" + next, "");
             res.set_uri(q.to_uri());
             reply->push(res);
+
+            // So that opening it needn't wait, once nothing else is going on
+            if (config->prefetcher && prefetch_pages)
+                config->prefetcher->prefetch_page(thread_messages, query_string, label_id, next);
         }
 
     } catch (std::runtime_error &) {
@@ -0,0 +1,114 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <scope/query.h>
+#include <scope/scheduler.h>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include <QString>
+#include <QStringList>
+
+#include <algorithm>
+
+namespace alg = boost::algorithm;
+
+using namespace scope;
+
+
+namespace {
+
+/**
+ * Whether a message mentions each of the terms where the list shows it
+ */
+static bool matches(const api::Client::Email &message, const QStringList &terms) {
+    QString shown = QString::fromStdString(message.header.from.name + "\n" +
+                                           message.header.from.address + "\n" +
+                                           message.header.subject + "\n" + message.snippet);
+    for (const QString &term : terms) {
+        if (!shown.contains(term, Qt::CaseInsensitive))
+            return false;
+    }
+    return true;
+}
+
+}
+
+Scheduler::Scheduler(std::chrono::milliseconds debounce) :
+    debounce_(debounce) {
+    last_.threads = false;
+}
+
+bool Scheduler::is_search(const unity::scopes::CannedQuery &query) {
+    std::string query_string = alg::trim_copy(query.query_string());
+    return !query_string.empty() && !alg::starts_with(query_string, "more:") &&
+            !alg::starts_with(query_string, "threadid:");
+}
+
+void Scheduler::add(Query *query) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The lock keeps them from being destroyed while we cancel them
+    for (const Search &older : searches_)
+        older.query->cancelled();
+    searches_.clear();
+    auto now = std::chrono::steady_clock::now();
+    searches_.push_back({ query, now - added_ < debounce_ });
+    added_ = now;
+    changed_.notify_all();
+}
+
+void Scheduler::remove(Query *query) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = std::find_if(searches_.begin(), searches_.end(), [query](const Search &search) {
+        return search.query == query;
+    });
+    if (iter != searches_.end())
+        searches_.erase(iter);
+}
+
+bool Scheduler::settle(Query *query) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (superseded(query))
+        return false;
+    // Nobody is typing, so there's nothing to wait for
+    if (!searches_.back().typing)
+        return true;
+    return !changed_.wait_for(lock, debounce_, [this, query]() {
+        return superseded(query);
+    });
+}
+
+bool Scheduler::superseded(Query *query) const {
+    return searches_.empty() || searches_.back().query != query;
+}
+
+void Scheduler::remember(const std::string &query, const std::string &label_id, bool threads,
+                         const api::Client::EmailList &messages) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_ = { query, label_id, threads, messages };
+}
+
+api::Client::EmailList Scheduler::refine(const std::string &query, const std::string &label_id,
+                                         bool threads) const {
+    api::Client::EmailList refined;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (last_.query.empty() || query == last_.query || !alg::starts_with(query, last_.query) ||
+            label_id != last_.label_id || threads != last_.threads)
+        return refined;
+
+    // Search operators mean more than we can check here, so they get no head start
+    QStringList terms = QString::fromStdString(query).split(' ', QString::SkipEmptyParts);
+    for (const QString &term : terms) {
+        if (term.contains(':'))
+            return refined;
+    }
+    for (const api::Client::Email &message : last_.messages) {
+        if (matches(message, terms))
+            refined.emplace_back(message);
+    }
+    return refined;
+}
@@ -9,6 +9,7 @@
 #include <scope/query.h>
 #include <scope/scope.h>
 #include <scope/activation.h>
+#include <api/services.h>
 
 #include <iostream>
 #include <sstream>
@@ -27,20 +28,44 @@ void Scope::start(std::string const&) {
             + "/../share/locale/";
     bindtextdomain(GETTEXT_PACKAGE, translation_directory.c_str());
 
-    // Under test we set a different API root
+    // Under test we set a different API root, and perhaps a different server
     char *apiroot = getenv("NETWORK_SCOPE_APIROOT");
     if (apiroot) {
         config_->apiroot = apiroot;
     }
+    char *apidomain = getenv("NETWORK_SCOPE_APIDOMAIN");
+    if (apidomain) {
+        config_->apidomain = apidomain;
+    }
+
+    // Message metadata persists between runs in our cache directory, if we have one
+    std::string store_path;
+    try {
+        store_path = ScopeBase::cache_directory() + "/metadata";
+    } catch (std::exception &e) {
+        std::cerr << "No metadata store: " << e.what() << std::endl;
+    }
+
+    // All queries, previews, and activations share their connections, access token, threads,
+    // in-flight requests, and parsed messages
+    api::start_services(config_, nullptr, store_path);
+
+    scheduler_ = std::make_shared<Scheduler>(config_->search_debounce);
 }
 
 void Scope::stop() {
+    if (config_)
+        api::stop_services(config_);
 }
 
 sc::SearchQueryBase::UPtr Scope::search(const sc::CannedQuery &query,
                                         const sc::SearchMetadata &metadata) {
-    // Boilerplate construction of Query
-    return sc::SearchQueryBase::UPtr(new Query(query, metadata, config_));
+    // A new search supersedes the one typed before it
+    Scheduler::Ptr scheduler = Scheduler::is_search(query) ? scheduler_ : Scheduler::Ptr();
+    Query *search = new Query(query, metadata, config_, scheduler);
+    if (scheduler)
+        scheduler->add(search);
+    return sc::SearchQueryBase::UPtr(search);
 }
 
 sc::PreviewQueryBase::UPtr Scope::preview(sc::Result const& result,
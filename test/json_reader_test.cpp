@@ -0,0 +1,264 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/json_reader.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace api;
+
+
+namespace {
+
+/**
+ * Readers only point into the JSON, which must outlive them
+ */
+JsonReader reader_for(const char *json) {
+    return JsonReader(json, std::strlen(json));
+}
+
+JsonReader reader_for(const std::string &json) {
+    return JsonReader(json.data(), json.size());
+}
+
+/**
+ * The string values of each key in an object, in order, skipping everything else
+ */
+std::vector<std::pair<std::string, std::string>> read_strings(JsonReader &reader) {
+    std::vector<std::pair<std::string, std::string>> values;
+    std::string key;
+    if (reader.begin_object()) {
+        while (reader.next_key(key))
+            values.emplace_back(key, reader.read_string());
+    }
+    return values;
+}
+
+/**
+ * The name and value of a header, whose object has been entered
+ */
+std::pair<std::string, std::string> read_header(JsonReader &reader) {
+    std::pair<std::string, std::string> header;
+    std::string key;
+    while (reader.next_key(key)) {
+        if (key == "name")
+            header.first = reader.read_string();
+        else if (key == "value")
+            header.second = reader.read_string();
+        else
+            reader.skip();
+    }
+    return header;
+}
+
+struct Message {
+    std::string id;
+    std::vector<std::string> labels;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string snippet;
+};
+
+/**
+ * Read a message the way the parsers do, knowing what type each value should be
+ */
+Message read_message(JsonReader &reader) {
+    Message message;
+    std::string key;
+    if (!reader.begin_object())
+        return message;
+    while (reader.next_key(key)) {
+        if (key == "id") {
+            message.id = reader.read_string();
+        } else if (key == "labelIds") {
+            if (reader.begin_array()) {
+                while (reader.next_element())
+                    message.labels.push_back(reader.read_string());
+            }
+        } else if (key == "payload") {
+            if (!reader.begin_object())
+                continue;
+            while (reader.next_key(key)) {
+                if (key != "headers") {
+                    reader.skip();
+                    continue;
+                }
+                if (!reader.begin_array())
+                    continue;
+                while (reader.next_element()) {
+                    if (reader.begin_object())
+                        message.headers.push_back(read_header(reader));
+                }
+            }
+        } else if (key == "snippet") {
+            message.snippet = reader.read_string();
+        } else {
+            reader.skip();
+        }
+    }
+    return message;
+}
+
+const std::string MESSAGE = "{\"id\": \"abc\", \"labelIds\": [\"INBOX\", \"UNREAD\"], "
+        "\"payload\": {\"headers\": [{\"name\": \"Subject\", \"value\": \"Hi \\\"there\\\"\"}], "
+        "\"body\": {\"size\": 0}}, \"sizeEstimate\": 1234, \"snippet\": \"x\"}";
+
+}
+
+TEST(JsonReader, Escapes) {
+    JsonReader reader = reader_for("{\"a\": \"quote \\\" backslash \\\\ slash \\/\", "
+                                   "\"b\": \"\\b\\f\\n\\r\\t\"}");
+    auto values = read_strings(reader);
+    ASSERT_EQ(2u, values.size());
+    EXPECT_EQ("quote \" backslash \\ slash /", values[0].second);
+    EXPECT_EQ("\b\f\n\r\t", values[1].second);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, UnicodeEscapes) {
+    JsonReader reader = reader_for("{\"ascii\": \"\\u0041\", \"latin\": \"\\u00e9\", "
+                                   "\"bmp\": \"\\u20AC\", \"pair\": \"\\ud83d\\ude00\", "
+                                   "\"raw\": \"\xc3\xa9\"}");
+    auto values = read_strings(reader);
+    ASSERT_EQ(5u, values.size());
+    EXPECT_EQ("A", values[0].second);
+    EXPECT_EQ("\xc3\xa9", values[1].second);
+    EXPECT_EQ("\xe2\x82\xac", values[2].second);
+    EXPECT_EQ("\xf0\x9f\x98\x80", values[3].second);
+    EXPECT_EQ("\xc3\xa9", values[4].second);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, LoneSurrogate) {
+    // Not valid UTF-16, but it mustn't swallow what follows
+    JsonReader reader = reader_for("{\"a\": \"\\ud83dx\", \"b\": \"y\"}");
+    auto values = read_strings(reader);
+    ASSERT_EQ(2u, values.size());
+    EXPECT_EQ("y", values[1].second);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, NestedArrays) {
+    JsonReader reader = reader_for("[[\"a\", \"b\"], [], [\"c\"]]");
+    std::vector<std::vector<std::string>> seen;
+    ASSERT_TRUE(reader.begin_array());
+    while (reader.next_element()) {
+        seen.emplace_back();
+        ASSERT_TRUE(reader.begin_array());
+        while (reader.next_element())
+            seen.back().push_back(reader.read_string());
+    }
+    std::vector<std::vector<std::string>> expected = { { "a", "b" }, { }, { "c" } };
+    EXPECT_EQ(expected, seen);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, NestedArraysSkipped) {
+    JsonReader reader = reader_for("[[[\"a\"], [[]], {\"b\": [1, [2]]}], \"c\", [], \"d\"]");
+    std::vector<std::string> seen;
+    ASSERT_TRUE(reader.begin_array());
+    while (reader.next_element())
+        seen.push_back(reader.read_string());
+    std::vector<std::string> expected = { "", "c", "", "d" };
+    EXPECT_EQ(expected, seen);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, NumbersAreNotStrings) {
+    JsonReader reader = reader_for("{\"size\": 1234, \"ratio\": -1.5e3, \"flag\": true, "
+                                   "\"none\": null, \"historyId\": \"5678\"}");
+    auto values = read_strings(reader);
+    ASSERT_EQ(5u, values.size());
+    EXPECT_EQ("", values[0].second);
+    EXPECT_EQ("", values[1].second);
+    EXPECT_EQ("", values[2].second);
+    EXPECT_EQ("", values[3].second);
+    EXPECT_EQ("5678", values[4].second);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, UnknownFieldsSkipped) {
+    JsonReader reader = reader_for(MESSAGE);
+    Message message = read_message(reader);
+    EXPECT_EQ("abc", message.id);
+    std::vector<std::string> labels = { "INBOX", "UNREAD" };
+    EXPECT_EQ(labels, message.labels);
+    ASSERT_EQ(1u, message.headers.size());
+    EXPECT_EQ("Subject", message.headers[0].first);
+    EXPECT_EQ("Hi \"there\"", message.headers[0].second);
+    EXPECT_EQ("x", message.snippet);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, BracketsInStringsSkipped) {
+    JsonReader reader = reader_for("{\"skip\": {\"a\": \"}]\\\"{[\"}, \"id\": \"abc\"}");
+    auto values = read_strings(reader);
+    ASSERT_EQ(2u, values.size());
+    EXPECT_EQ("id", values[1].first);
+    EXPECT_EQ("abc", values[1].second);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, WrongTypesSkipped) {
+    // An object where we expect an array, and the other way around
+    JsonReader reader = reader_for("{\"labelIds\": {\"a\": \"b\"}, \"payload\": [1, 2], "
+                                   "\"id\": \"abc\"}");
+    std::string key, id;
+    ASSERT_TRUE(reader.begin_object());
+    while (reader.next_key(key)) {
+        if (key == "labelIds") {
+            EXPECT_FALSE(reader.begin_array());
+        } else if (key == "payload") {
+            EXPECT_FALSE(reader.begin_object());
+        } else {
+            id = reader.read_string();
+        }
+    }
+    EXPECT_EQ("abc", id);
+    EXPECT_FALSE(reader.failed());
+}
+
+TEST(JsonReader, EmptyInput) {
+    JsonReader reader = reader_for("");
+    EXPECT_FALSE(reader.begin_object());
+    EXPECT_TRUE(reader.failed());
+}
+
+TEST(JsonReader, TruncatedInput) {
+    // Every prefix of a document must stop cleanly, and all but the whole of it fail
+    for (std::size_t length = 0; length < MESSAGE.size(); length++) {
+        std::string truncated = MESSAGE.substr(0, length);
+        JsonReader reader = reader_for(truncated);
+        read_message(reader);
+        EXPECT_TRUE(reader.failed()) << truncated;
+    }
+}
+
+TEST(JsonReader, InvalidInput) {
+    const char *documents[] = {
+        "}", "]", ",", ":", "{\"a\" \"b\"}", "{\"a\": }", "{a: \"b\"}", "[\"a\" \"b\"",
+        "{\"a\": \"\\u12\"}", "{\"a\": \"\\uzzzz\"}", "{\"a\": \"b\\", "{{{{", "[[[[",
+    };
+    for (const char *document : documents) {
+        JsonReader reader = reader_for(document);
+        read_message(reader);
+    }
+
+    // Mangle a real document at random, which mustn't crash or hang
+    std::srand(1);
+    const char garbage[] = "{}[],:\"\\ u0";
+    for (int i = 0; i < 10000; i++) {
+        std::string mangled = MESSAGE;
+        for (int j = 0; j < 3; j++)
+            mangled[std::rand() % mangled.size()] = garbage[std::rand() % (sizeof(garbage) - 1)];
+        JsonReader reader = reader_for(mangled);
+        read_message(reader);
+    }
+}
@@ -0,0 +1,180 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/multipart.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace api;
+
+
+namespace {
+
+struct Part {
+    int index;
+    int status;
+    std::string body;
+};
+
+/**
+ * Run a whole response through the parser, fed in chunks of the given size, or
+ * all at once
+ */
+std::vector<Part> parse(const std::string &response, std::size_t chunk = 0) {
+    std::vector<Part> parts;
+    MultipartParser parser("batch_foo", [&parts](int index, int status, const char *body,
+                                                 std::size_t length) {
+        parts.push_back({ index, status, std::string(body, length) });
+    });
+    if (chunk == 0)
+        chunk = response.size();
+    for (std::size_t start = 0; start < response.size(); start += chunk)
+        parser.feed(response.data() + start, std::min(chunk, response.size() - start));
+    parser.finish();
+    return parts;
+}
+
+std::string part(const std::string &content_id, const std::string &body,
+                 const std::string &eol = "\r\n") {
+    std::string headers = "Content-Type: application/http" + eol;
+    if (!content_id.empty())
+        headers += "Content-ID: " + content_id + eol;
+    return "--batch_foo" + eol + headers + eol +
+            "HTTP/1.1 200 OK" + eol + "Content-Type: application/json" + eol + eol +
+            body + eol;
+}
+
+const std::string CLOSE = "--batch_foo--\r\n";
+
+}
+
+TEST(MultipartParser, PartsInOrder) {
+    std::vector<Part> parts = parse(part("<response-0:a@example.com>", "{\"id\": \"a\"}") +
+                                    part("<response-1:b@example.com>", "{\"id\": \"b\"}") + CLOSE);
+    ASSERT_EQ(2u, parts.size());
+    EXPECT_EQ(0, parts[0].index);
+    EXPECT_EQ(200, parts[0].status);
+    EXPECT_EQ("{\"id\": \"a\"}", parts[0].body);
+    EXPECT_EQ(1, parts[1].index);
+    EXPECT_EQ("{\"id\": \"b\"}", parts[1].body);
+}
+
+TEST(MultipartParser, PartsOutOfOrder) {
+    std::vector<Part> parts = parse(part("<response-2:c@example.com>", "c") +
+                                    part("<response-0:a@example.com>", "a") +
+                                    part("<response-1:b@example.com>", "b") + CLOSE);
+    ASSERT_EQ(3u, parts.size());
+    EXPECT_EQ(2, parts[0].index);
+    EXPECT_EQ("c", parts[0].body);
+    EXPECT_EQ(0, parts[1].index);
+    EXPECT_EQ("a", parts[1].body);
+    EXPECT_EQ(1, parts[2].index);
+    EXPECT_EQ("b", parts[2].body);
+}
+
+TEST(MultipartParser, MissingOrUnknownContentId) {
+    std::vector<Part> parts = parse(part("", "none") +
+                                    part("<someone-else@example.com>", "unknown") +
+                                    part("<response-:x@example.com>", "no digits") +
+                                    part("<response-4:d@example.com>", "d") + CLOSE);
+    ASSERT_EQ(4u, parts.size());
+    EXPECT_EQ(-1, parts[0].index);
+    EXPECT_EQ("none", parts[0].body);
+    EXPECT_EQ(-1, parts[1].index);
+    EXPECT_EQ(-1, parts[2].index);
+    EXPECT_EQ(4, parts[3].index);
+}
+
+TEST(MultipartParser, PreambleAndEpilogue) {
+    std::vector<Part> parts = parse("This is the preamble.\r\nIt is ignored.\r\n" +
+                                    part("<response-0:a@example.com>", "a") + CLOSE +
+                                    "This is the epilogue.\r\n" +
+                                    part("<response-1:b@example.com>", "ignored too"));
+    ASSERT_EQ(1u, parts.size());
+    EXPECT_EQ(0, parts[0].index);
+    EXPECT_EQ("a", parts[0].body);
+}
+
+TEST(MultipartParser, BoundaryInBody) {
+    // Only a delimiter at the start of a line ends a part
+    std::string body = "{\"snippet\": \"--batch_foo --batch_foo--\"}";
+    std::vector<Part> parts = parse(part("<response-0:a@example.com>", body) +
+                                    part("<response-1:b@example.com>", "b") + CLOSE);
+    ASSERT_EQ(2u, parts.size());
+    EXPECT_EQ(0, parts[0].index);
+    EXPECT_EQ(body, parts[0].body);
+    EXPECT_EQ(1, parts[1].index);
+    EXPECT_EQ("b", parts[1].body);
+
+    // However the response is cut up
+    for (std::size_t chunk = 1; chunk < 16; chunk++) {
+        std::vector<Part> pieces = parse(part("<response-0:a@example.com>", body) + CLOSE, chunk);
+        ASSERT_EQ(1u, pieces.size()) << chunk;
+        EXPECT_EQ(body, pieces[0].body) << chunk;
+    }
+}
+
+TEST(MultipartParser, LineFeedsOnly) {
+    std::vector<Part> parts = parse(part("<response-0:a@example.com>", "line 1\nline 2", "\n") +
+                                    part("<response-1:b@example.com>", "b", "\n") +
+                                    "--batch_foo--\n");
+    ASSERT_EQ(2u, parts.size());
+    EXPECT_EQ(0, parts[0].index);
+    EXPECT_EQ(200, parts[0].status);
+    EXPECT_EQ("line 1\nline 2", parts[0].body);
+    EXPECT_EQ(1, parts[1].index);
+    EXPECT_EQ("b", parts[1].body);
+}
+
+TEST(MultipartParser, TruncatedFinalBoundary) {
+    // Cut off before the closing delimiter...
+    std::vector<Part> parts = parse(part("<response-0:a@example.com>", "a") +
+                                    "--batch_foo\r\nContent-ID: <response-1:b@example.com>\r\n"
+                                    "\r\nHTTP/1.1 200 OK\r\n\r\n{\"id\": \"b");
+    ASSERT_EQ(2u, parts.size());
+    EXPECT_EQ("a", parts[0].body);
+    EXPECT_EQ(1, parts[1].index);
+    EXPECT_EQ("{\"id\": \"b", parts[1].body);
+
+    // ...and in the middle of it
+    parts = parse(part("<response-0:a@example.com>", "a") + "--batch_foo");
+    ASSERT_EQ(1u, parts.size());
+    EXPECT_EQ("a", parts[0].body);
+}
+
+TEST(MultipartParser, ErrorStatus) {
+    std::vector<Part> parts = parse("--batch_foo\r\nContent-ID: <response-0:a@example.com>\r\n\r\n"
+                                    "HTTP/1.1 404 Not Found\r\n\r\nNot Found\r\n" + CLOSE);
+    ASSERT_EQ(1u, parts.size());
+    EXPECT_EQ(404, parts[0].status);
+    EXPECT_EQ("Not Found", parts[0].body);
+}
+
+TEST(MultipartParser, FedInPieces) {
+    std::string response = "preamble\r\n" + part("<response-1:b@example.com>", "b") +
+            part("<response-0:a@example.com>", "a") + CLOSE;
+    std::vector<Part> whole = parse(response);
+    for (std::size_t chunk = 1; chunk < response.size(); chunk++) {
+        std::vector<Part> pieces = parse(response, chunk);
+        ASSERT_EQ(whole.size(), pieces.size()) << "chunk " << chunk;
+        for (std::size_t i = 0; i < whole.size(); i++) {
+            EXPECT_EQ(whole[i].index, pieces[i].index) << "chunk " << chunk;
+            EXPECT_EQ(whole[i].status, pieces[i].status) << "chunk " << chunk;
+            EXPECT_EQ(whole[i].body, pieces[i].body) << "chunk " << chunk;
+        }
+    }
+}
+
+TEST(MultipartParser, BoundaryFromContentType) {
+    EXPECT_EQ("batch_foo", MultipartParser::boundary_from("multipart/mixed; boundary=batch_foo"));
+    EXPECT_EQ("batch_foo",
+              MultipartParser::boundary_from("multipart/mixed; boundary=\"batch_foo\"; x=y"));
+    EXPECT_EQ("", MultipartParser::boundary_from("application/json"));
+}
@@ -0,0 +1,447 @@
+/* Copyright 2014 Robert Schroll
+ *
+ * This file is part of Gmail Scope and is distributed under the terms of
+ * the GPL. See the file LICENSE for full details.
+ */
+
+#include <api/metadata_store.h>
+#include <api/parser.h>
+
+#include <gtest/gtest.h>
+
+#include <QTemporaryDir>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace api;
+
+typedef std::vector<std::pair<std::string, std::string>> Mailboxes;
+
+
+namespace {
+
+/**
+ * The names and addresses of an address list
+ */
+Mailboxes mailboxes(const char *list) {
+    Mailboxes result;
+    for (const Client::Contact &contact : parser::parse_contact_list(QString::fromUtf8(list)))
+        result.emplace_back(contact.name, contact.address);
+    return result;
+}
+
+}
+
+TEST(Addresses, QuotedCommas) {
+    Mailboxes expected = { { "Doe, John", "j@x.com" }, { "Jane", "jane@y.com" } };
+    EXPECT_EQ(expected, mailboxes("\"Doe, John\" <j@x.com>, Jane <jane@y.com>"));
+}
+
+TEST(Addresses, QuotedEscapes) {
+    Mailboxes expected = { { "Quote \"me\"", "q@x.com" } };
+    EXPECT_EQ(expected, mailboxes("\"Quote \\\"me\\\"\" <q@x.com>"));
+}
+
+TEST(Addresses, Groups) {
+    EXPECT_EQ(Mailboxes(), mailboxes("undisclosed-recipients:;"));
+
+    Mailboxes expected = { { "a@x.com", "a@x.com" }, { "B", "b@x.com" }, { "c@x.com", "c@x.com" } };
+    EXPECT_EQ(expected, mailboxes("Friends: a@x.com, \"B\" <b@x.com>;, c@x.com"));
+}
+
+TEST(Addresses, Comments) {
+    // A comment stands in for a missing name, but is otherwise dropped
+    Mailboxes expected = { { "Joe Bloggs", "joe@example.com" } };
+    EXPECT_EQ(expected, mailboxes("joe@example.com (Joe Bloggs)"));
+    EXPECT_EQ(expected, mailboxes("Joe (the (nested) man) Bloggs <joe@example.com>"));
+    EXPECT_EQ(expected, mailboxes("Joe Bloggs <joe(work)@example.com>"));
+
+    expected = { { "a, b", "c@x.com" } };
+    EXPECT_EQ(expected, mailboxes("c@x.com (a, b)"));
+}
+
+TEST(Addresses, EncodedWords) {
+    Mailboxes expected = { { "Andr\xc3\xa9", "andre@x.com" }, { "Andr\xc3\xa9", "b@x.com" } };
+    EXPECT_EQ(expected, mailboxes("=?UTF-8?Q?Andr=C3=A9?= <andre@x.com>, "
+                                  "=?UTF-8?B?QW5kcsOp?= <b@x.com>"));
+
+    // Names that were never encoded come through as they are
+    expected = { { "Andr\xc3\xa9", "andre@x.com" } };
+    EXPECT_EQ(expected, mailboxes("Andr\xc3\xa9 <andre@x.com>"));
+}
+
+TEST(Addresses, BareAddresses) {
+    Mailboxes expected = { { "a@x.com", "a@x.com" }, { "b@x.com", "b@x.com" } };
+    EXPECT_EQ(expected, mailboxes("a@x.com, b@x.com"));
+    expected = { { "a@x.com", "a@x.com" } };
+    EXPECT_EQ(expected, mailboxes("<a@x.com>"));
+}
+
+TEST(Addresses, EmptyEntries) {
+    Mailboxes expected = { { "a@x.com", "a@x.com" }, { "b@x.com", "b@x.com" } };
+    EXPECT_EQ(expected, mailboxes("a@x.com,, b@x.com,"));
+    EXPECT_EQ(expected, mailboxes(", a@x.com ,\r\n\tb@x.com , "));
+    EXPECT_EQ(Mailboxes(), mailboxes(""));
+    EXPECT_EQ(Mailboxes(), mailboxes(" , "));
+}
+
+TEST(Addresses, FirstContact) {
+    Client::Contact contact = parser::parse_contact("Mary Smith <Mary@X.net>, j@x.com");
+    EXPECT_EQ("Mary Smith", contact.name);
+    EXPECT_EQ("Mary@X.net", contact.address);
+
+    // Gravatars are keyed on the lower-cased address
+    contact = parser::parse_contact("J@X.com");
+    EXPECT_EQ("https://secure.gravatar.com/avatar/9770a3f4776427ffeeb72df5521c05d4?d=identicon",
+              contact.gravatar);
+
+    // Someone, even if we can't tell who
+    contact = parser::parse_contact("undisclosed-recipients:;");
+    EXPECT_EQ("", contact.name);
+    EXPECT_EQ("", contact.address);
+}
+
+namespace {
+
+/**
+ * 1994-11-15 13:12:31 UTC, the example in RFC 1123
+ */
+const std::int64_t RFC_EXAMPLE = 784905151;
+
+/**
+ * 2014-06-02 10:00:00 UTC
+ */
+const std::int64_t JUNE_2014 = 1401703200;
+
+struct Date {
+    bool parsed;
+    std::int64_t date;
+    int offset;
+};
+
+Date date(const std::string &input) {
+    // Unlikely values, so that we can tell if they're left alone
+    Date result = { false, -1, -1 };
+    result.parsed = parser::parse_date(input, result.date, result.offset);
+    return result;
+}
+
+}
+
+TEST(Dates, NumericZones) {
+    Date result = date("Tue, 15 Nov 1994 08:12:31 -0500");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(-5 * 60, result.offset);
+
+    result = date("Tue, 15 Nov 1994 18:42:31 +0530");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(5 * 60 + 30, result.offset);
+
+    result = date("Tue, 15 Nov 1994 13:12:31 -0000");
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(0, result.offset);
+}
+
+TEST(Dates, NamedZones) {
+    Date result = date("Tue, 15 Nov 1994 13:12:31 GMT");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(0, result.offset);
+
+    result = date("Tue, 15 Nov 1994 05:12:31 PST");
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(-8 * 60, result.offset);
+
+    result = date("Tue, 15 Nov 1994 09:12:31 edt");
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(-4 * 60, result.offset);
+
+    // Unknown and missing zones are taken as UTC
+    result = date("Tue, 15 Nov 1994 13:12:31 XYZ");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(0, result.offset);
+
+    result = date("Tue, 15 Nov 1994 13:12:31");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(0, result.offset);
+}
+
+TEST(Dates, MissingDayOfWeek) {
+    Date result = date("15 Nov 1994 08:12:31 -0500");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(RFC_EXAMPLE, result.date);
+    EXPECT_EQ(-5 * 60, result.offset);
+}
+
+TEST(Dates, MissingSeconds) {
+    Date result = date("Mon, 2 Jun 2014 10:00 +0000");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(JUNE_2014, result.date);
+}
+
+TEST(Dates, ShortYears) {
+    EXPECT_EQ(RFC_EXAMPLE, date("Tue, 15 Nov 94 13:12:31 +0000").date);
+    // 2005-01-01 00:00:00 UTC, both ways
+    EXPECT_EQ(1104537600, date("Sat, 1 Jan 05 00:00:00 +0000").date);
+    EXPECT_EQ(1104537600, date("Sat, 1 Jan 105 00:00:00 +0000").date);
+}
+
+TEST(Dates, Comments) {
+    Date result = date("Mon, 2 Jun 2014 10:00:00 +0000 (UTC)");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(JUNE_2014, result.date);
+    EXPECT_EQ(0, result.offset);
+
+    result = date("Mon, 2 Jun 2014 03:00:00 -0700 (PDT)");
+    EXPECT_EQ(JUNE_2014, result.date);
+    EXPECT_EQ(-7 * 60, result.offset);
+
+    // Comments and folding whitespace may turn up anywhere
+    result = date("Mon (Monday), 2 (day) June\r\n 2014 10 : 00 : 00 +0000");
+    EXPECT_TRUE(result.parsed);
+    EXPECT_EQ(JUNE_2014, result.date);
+}
+
+TEST(Dates, LeapDay) {
+    // 2000-02-29 12:00:00 UTC
+    EXPECT_EQ(951825600, date("Tue, 29 Feb 2000 12:00:00 +0000").date);
+}
+
+TEST(Dates, Unparseable) {
+    const char *inputs[] = {
+        "", "garbage", "Mon, 2 Jun 2014", "Mon, 32 Jun 2014 10:00:00 +0000",
+        "Mon, 2 Foo 2014 10:00:00 +0000", "Mon, 2 Ju 2014 10:00:00 +0000",
+        "Mon, 2 Jun 2014 25:00:00 +0000", "Mon, 2 Jun 2014 10-00-00 +0000",
+    };
+    for (const char *input : inputs) {
+        Date result = date(input);
+        EXPECT_FALSE(result.parsed) << input;
+        EXPECT_EQ(-1, result.date) << input;
+        EXPECT_EQ(-1, result.offset) << input;
+    }
+
+    // A message with such a date has none, which is shown as nothing
+    Client::Email message = parser::parse_email(QByteArray(
+            "{\"id\": \"a\", \"payload\": {\"headers\": [{\"name\": \"Date\", \"value\": \"soon\"}]}}"));
+    EXPECT_EQ("a", message.id);
+    EXPECT_EQ(0, message.header.date);
+    EXPECT_EQ(0, message.header.date_offset);
+}
+
+namespace {
+
+/**
+ * The way bodies were decoded before they were decoded in a single pass, split into
+ * lines and reassembled, kept to check that nothing changed
+ */
+std::string reference_decode(const std::string &text) {
+    static const char *const COLORS[] = {
+        "#9a5d9a", "#7474a7", "#3f8c8c", "#4c914c", "#818115", "#9f6666"
+    };
+    std::string unix_text;
+    for (std::size_t i = 0; i < text.size(); i++) {
+        if (!(text[i] == '\r' && i + 1 < text.size() && text[i + 1] == '\n'))
+            unix_text += text[i];
+    }
+    std::vector<std::string> lines(1);
+    for (char c : unix_text) {
+        if (c == '\n')
+            lines.emplace_back();
+        else
+            lines.back() += c;
+    }
+
+    std::string html;
+    bool continued = false;
+    int quote_level = 0;
+    for (std::string &line : lines) {
+        int i = 0;
+        while (i < static_cast<int>(line.size()) && line[i] == '>')
+            i += 1;
+        if (continued && quote_level != i)
+            html += "<br>";
+        while (quote_level < i) {
+            html += std::string("<font color='") + COLORS[quote_level % 6] + "'>";
+            quote_level += 1;
+        }
+        while (quote_level > i) {
+            html += "</font>";
+            quote_level -= 1;
+        }
+        if (i < static_cast<int>(line.size()) && line[i] == ' ')
+            i += 1;
+        line.erase(0, i);
+        html += line;
+        continued = (!line.empty() && line.back() == ' ' && line != "-- ");
+        if (!continued)
+            html += "<br>";
+    }
+    while (quote_level > 0) {
+        html += "</font>";
+        quote_level -= 1;
+    }
+
+    std::size_t n = html.size();
+    while (n > 4 && html.compare(n - 4, 4, "<br>") == 0)
+        n -= 4;
+    return html.substr(0, n);
+}
+
+/**
+ * Decode text as Gmail would send it, base64url encoded with its padding
+ */
+std::string decode(const std::string &text) {
+    QByteArray raw(text.data(), text.size());
+    return parser::decode(raw.toBase64(QByteArray::Base64UrlEncoding));
+}
+
+}
+
+TEST(Bodies, LineEndings) {
+    EXPECT_EQ("a<br>b<br>c", decode("a\r\nb\nc\r\n"));
+    // A lone carriage return isn't a line break
+    EXPECT_EQ("a\rb", decode("a\rb"));
+    EXPECT_EQ("a<br>b\r", decode("a\r\nb\r"));
+}
+
+TEST(Bodies, BlankLines) {
+    EXPECT_EQ("a<br><br>b", decode("a\r\n\r\nb\r\n\r\n\r\n"));
+    // Only the breaks after the text are dropped, and never the last of them
+    EXPECT_EQ("<br>", decode(""));
+    EXPECT_EQ("<font color='#9a5d9a'>b<br></font>", decode("> b\r\n\r\n"));
+}
+
+TEST(Bodies, FlowedLines) {
+    // A line ending in a space continues on the next
+    EXPECT_EQ("one two three<br>four", decode("one \r\ntwo \r\nthree\r\nfour"));
+}
+
+TEST(Bodies, QuoteLevels) {
+    EXPECT_EQ("a<br><font color='#9a5d9a'>b<br><font color='#7474a7'>c<br></font>d<br></font>e",
+              decode("a\r\n> b\r\n>> c\r\n>d\r\ne"));
+    // Only one space after the quote marks belongs to them
+    EXPECT_EQ("<font color='#9a5d9a'> b<br></font>", decode(">  b"));
+    // A continued line stops at a change of quote level
+    EXPECT_EQ("a <br><font color='#9a5d9a'>b<br></font>", decode("a \r\n> b"));
+    // The colors cycle
+    EXPECT_EQ(reference_decode(">>>>>>>> deep"), decode(">>>>>>>> deep"));
+}
+
+TEST(Bodies, Signatures) {
+    // The signature separator ends in a space, but doesn't continue
+    EXPECT_EQ("Hi<br>-- <br>Joe", decode("Hi\r\n-- \r\nJoe"));
+    EXPECT_EQ("Hi<br>--- Joe", decode("Hi\r\n--- \r\nJoe"));
+    EXPECT_EQ("<font color='#9a5d9a'>-- <br>Joe<br></font>", decode("> -- \r\n> Joe"));
+}
+
+TEST(Bodies, TextPassedThrough) {
+    // Markup and links are left as they always have been
+    EXPECT_EQ("<b>bold</b> &amp; 1 < 2", decode("<b>bold</b> &amp; 1 < 2"));
+    EXPECT_EQ("See https://example.com/a_b-c?d=e&f=g#h<br>or <http://example.com/>",
+              decode("See https://example.com/a_b-c?d=e&f=g#h\r\nor <http://example.com/>"));
+    EXPECT_EQ("caf\xc3\xa9", decode("caf\xc3\xa9"));
+}
+
+TEST(Bodies, Base64Variants) {
+    // The bytes that encode to "-" and "_" in base64url, and "+" and "/" otherwise
+    std::string text = "\xfb\xff\xbf ~~~? >>>";
+    QByteArray raw(text.data(), text.size());
+    const QByteArray::Base64Options variants[] = {
+        QByteArray::Base64UrlEncoding,
+        QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals,
+        QByteArray::Base64Encoding,
+        QByteArray::Base64Encoding | QByteArray::OmitTrailingEquals
+    };
+    // Every length, so that each amount of padding turns up
+    for (QByteArray::Base64Options options : variants) {
+        for (std::size_t length = 0; length <= text.size(); length++) {
+            QByteArray encoded = raw.left(length).toBase64(options);
+            EXPECT_EQ(reference_decode(text.substr(0, length)), parser::decode(encoded))
+                    << encoded.constData();
+        }
+    }
+}
+
+TEST(Bodies, SameAsBefore) {
+    // Random mixes of the characters that matter, with every sort of line ending
+    std::srand(1);
+    const char alphabet[] = "ab >>\r\n-- x<&";
+    for (int i = 0; i < 20000; i++) {
+        std::string text;
+        for (int length = std::rand() % 40; length > 0; length--)
+            text += alphabet[std::rand() % (sizeof(alphabet) - 1)];
+        EXPECT_EQ(reference_decode(text), decode(text)) << text;
+    }
+}
+
+namespace {
+
+const std::string MESSAGE_JSON =
+        "{\"id\": \"14a\", \"threadId\": \"14a\", \"labelIds\": [\"INBOX\"], "
+        "\"snippet\": \"Hi\", \"payload\": {\"mimeType\": \"text/plain\", "
+        "\"headers\": [{\"name\": \"Subject\", \"value\": \"Lunch\"}]}}";
+
+QByteArray truncated(const std::string &json, std::size_t length) {
+    return QByteArray(json.data(), length);
+}
+
+}
+
+TEST(Responses, TruncatedMessage) {
+    Client::Email message = parser::parse_email(truncated(MESSAGE_JSON, MESSAGE_JSON.size()));
+    EXPECT_EQ("14a", message.id);
+    EXPECT_EQ("Lunch", message.header.subject);
+
+    // As when the last part of a batch is cut off, which must never be stored
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    MetadataStore store(dir.path().toStdString() + "/metadata", std::chrono::seconds(3600),
+                        std::chrono::seconds(86400));
+    for (std::size_t length = 0; length < MESSAGE_JSON.size(); length++) {
+        message = parser::parse_email(truncated(MESSAGE_JSON, length));
+        EXPECT_EQ("", message.id) << length;
+        store.put_messages({ message });
+        store.put_thread("14a", "7", { message });
+    }
+    EXPECT_EQ(0u, store.size());
+    Client::EmailList thread;
+    EXPECT_FALSE(store.get_thread("14a", "7", thread));
+}
+
+TEST(Responses, TruncatedLists) {
+    std::string list = "{\"messages\": [" + MESSAGE_JSON + ", " + MESSAGE_JSON +
+            "], \"nextPageToken\": \"2\"}";
+    std::string next;
+    EXPECT_EQ(2u, parser::parse_email_list(truncated(list, list.size()), next).size());
+    EXPECT_EQ("2", next);
+    for (std::size_t length = 0; length < list.size(); length++) {
+        EXPECT_TRUE(parser::parse_email_list(truncated(list, length), next).empty()) << length;
+        EXPECT_EQ("", next);
+    }
+
+    std::string thread = "{\"historyId\": \"7\", \"messages\": [" + MESSAGE_JSON + "]}";
+    std::string history_id;
+    EXPECT_EQ(1u, parser::parse_thread(truncated(thread, thread.size()), history_id).size());
+    EXPECT_EQ("7", history_id);
+    for (std::size_t length = 0; length < thread.size(); length++) {
+        EXPECT_TRUE(parser::parse_thread(truncated(thread, length), history_id).empty()) << length;
+        EXPECT_EQ("", history_id);
+    }
+
+    std::string threads = "{\"threads\": [{\"id\": \"14a\", \"historyId\": \"7\"}], "
+            "\"nextPageToken\": \"2\"}";
+    EXPECT_EQ(1u, parser::parse_thread_list(truncated(threads, threads.size()), next).size());
+    for (std::size_t length = 0; length < threads.size(); length++) {
+        EXPECT_TRUE(parser::parse_thread_list(truncated(threads, length), next).empty()) << length;
+        EXPECT_EQ("", next);
+    }
+}